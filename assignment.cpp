@@ -8,592 +8,9420 @@
 #include <limits>
 #include <climits>
 #include <ctime>
+#include <chrono>
+#include <random>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <charconv>
+#include <cstring>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <cmath>
+#include <numeric>
+#include <optional>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <new>
+#include <unordered_set>
+#include <deque>
+#include <future>
+#include <cstdio>
+#include <fcntl.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #include <immintrin.h>
+    #define BOOKSHOP_X86_KERNELS 1
+#endif
+
+#ifdef _WIN32
+    #define NOMINMAX
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+// The network service and its load generator use epoll
+#ifdef __linux__
+    #include <csignal>
+    #include <sys/epoll.h>
+    #include <sys/socket.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <arpa/inet.h>
+    #define BOOKSHOP_NETWORK 1
+#endif
 
 using namespace std;
 
+class StringPool;
+
+// Handle to a string interned in the StringPool: 16 bytes instead of a
+// std::string's 32 plus its heap block, and equal strings share one copy.
+// Assigning text interns it; construction from text is explicit so that
+// comparisons never intern by accident.
+class PooledString {
+private:
+    const char* text;
+    uint32_t length;
+
+    friend class StringPool;
+    PooledString(const char* data, uint32_t size) : text(data), length(size) {}
+
+public:
+    PooledString() : text(""), length(0) {}
+    explicit PooledString(string_view value);
+
+    PooledString& operator=(string_view value) {
+        return *this = PooledString(value);
+    }
+
+    PooledString& assign(string_view value) {
+        return *this = PooledString(value);
+    }
+
+    operator string_view() const {
+        return string_view(text, length);
+    }
+
+    string str() const {
+        return string(text, length);
+    }
+
+    const char* data() const {
+        return text;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    bool empty() const {
+        return length == 0;
+    }
+
+    string_view substr(size_t pos, size_t count = string_view::npos) const {
+        return string_view(*this).substr(pos, count);
+    }
+
+    // Interned strings are equal exactly when they share storage
+    bool operator==(const PooledString& other) const {
+        return text == other.text;
+    }
+
+    bool operator!=(const PooledString& other) const {
+        return text != other.text;
+    }
+
+    bool operator<(const PooledString& other) const {
+        return string_view(*this) < string_view(other);
+    }
+};
+
+inline bool operator==(const PooledString& a, string_view b) {
+    return string_view(a) == b;
+}
+
+inline bool operator==(const PooledString& a, const string& b) {
+    return string_view(a) == string_view(b);
+}
+
+inline ostream& operator<<(ostream& out, const PooledString& value) {
+    return out << string_view(value);
+}
+
+namespace std {
+    template <>
+    struct hash<PooledString> {
+        size_t operator()(const PooledString& value) const {
+            return std::hash<const void*>()(value.data());
+        }
+    };
+}
+
+// Arena of deduplicated strings. Strings are copied once into large chunks
+// and never freed, so PooledString handles stay valid for the life of the
+// process. Safe to use from several threads.
+class StringPool {
+private:
+    static const size_t CHUNK_SIZE = 1 << 20;
+
+    // Open-addressed dedup table, never over half full; a slot without
+    // text is unused. Probing compares the saved hash before the bytes.
+    struct Slot {
+        const char* text;
+        uint32_t length;
+        uint32_t hash;
+    };
+
+    mutex poolMutex;
+    vector<unique_ptr<char[]>> chunks;
+    char* cursor;
+    size_t remaining;
+    size_t arenaBytes;
+    vector<Slot> slots;
+    size_t used;
+
+    void grow() {
+        vector<Slot> old;
+        old.swap(slots);
+        slots.assign(old.empty() ? 1024 : old.size() * 2, Slot{nullptr, 0, 0});
+        size_t mask = slots.size() - 1;
+        for (const auto& slot : old) {
+            if (slot.text) {
+                size_t pos = slot.hash & mask;
+                while (slots[pos].text) {
+                    pos = (pos + 1) & mask;
+                }
+                slots[pos] = slot;
+            }
+        }
+    }
+
+    const char* store(string_view value) {
+        if (value.size() > remaining) {
+            size_t size = max(CHUNK_SIZE, value.size());
+            chunks.emplace_back(new char[size]);
+            cursor = chunks.back().get();
+            remaining = size;
+            arenaBytes += size;
+        }
+        memcpy(cursor, value.data(), value.size());
+        const char* stored = cursor;
+        cursor += value.size();
+        remaining -= value.size();
+        return stored;
+    }
+
+public:
+    StringPool() : cursor(nullptr), remaining(0), arenaBytes(0), used(0) {}
+
+    static StringPool& shared() {
+        static StringPool pool;
+        return pool;
+    }
+
+    PooledString intern(string_view value) {
+        if (value.empty()) {
+            return PooledString();
+        }
+        uint32_t hash = (uint32_t)std::hash<string_view>()(value);
+        lock_guard<mutex> lock(poolMutex);
+        if ((used + 1) * 2 > slots.size()) {
+            grow();
+        }
+        size_t mask = slots.size() - 1;
+        size_t pos = hash & mask;
+        for (; slots[pos].text; pos = (pos + 1) & mask) {
+            const Slot& slot = slots[pos];
+            if (slot.hash == hash && slot.length == value.size() && memcmp(slot.text, value.data(), value.size()) == 0) {
+                return PooledString(slot.text, slot.length);
+            }
+        }
+        slots[pos] = Slot{store(value), (uint32_t)value.size(), hash};
+        used++;
+        return PooledString(slots[pos].text, slots[pos].length);
+    }
+
+    size_t count() {
+        lock_guard<mutex> lock(poolMutex);
+        return used;
+    }
+
+    // Arena chunks plus the dedup table
+    size_t bytesUsed() {
+        lock_guard<mutex> lock(poolMutex);
+        return arenaBytes + slots.size() * sizeof(Slot);
+    }
+};
+
+inline PooledString::PooledString(string_view value) : PooledString(StringPool::shared().intern(value)) {}
+
+// An amount of money in whole cents. Prices, sale totals and every sum of
+// them are integers, so totals are exact and the files never go through
+// floating-point formatting or the locale.
+class Money {
+private:
+    int64_t value;
+
+    explicit constexpr Money(int64_t cents) : value(cents) {}
+
+public:
+    constexpr Money() : value(0) {}
+
+    static constexpr Money fromCents(int64_t cents) {
+        return Money(cents);
+    }
+
+    // Nearest cent to an amount that only exists as a double, as in files
+    // written before amounts were kept in cents
+    static Money fromDouble(double amount) {
+        return Money(llround(amount * 100.0));
+    }
+
+    static constexpr Money max() {
+        return Money(INT64_MAX);
+    }
+
+    constexpr int64_t cents() const {
+        return value;
+    }
+
+    // For ratios and shares only; sums stay in cents
+    double toDouble() const {
+        return value / 100.0;
+    }
+
+    Money& operator+=(Money other) {
+        value += other.value;
+        return *this;
+    }
+
+    Money& operator-=(Money other) {
+        value -= other.value;
+        return *this;
+    }
+
+    friend Money operator+(Money a, Money b) { return a += b; }
+    friend Money operator-(Money a, Money b) { return a -= b; }
+    friend Money operator*(Money a, int64_t n) { return Money(a.value * n); }
+    friend Money operator*(int64_t n, Money a) { return Money(a.value * n); }
+    friend bool operator==(Money a, Money b) { return a.value == b.value; }
+    friend bool operator!=(Money a, Money b) { return a.value != b.value; }
+    friend bool operator<(Money a, Money b) { return a.value < b.value; }
+    friend bool operator<=(Money a, Money b) { return a.value <= b.value; }
+    friend bool operator>(Money a, Money b) { return a.value > b.value; }
+    friend bool operator>=(Money a, Money b) { return a.value >= b.value; }
+
+    // One of n equal shares, to the nearest cent: a unit price or an
+    // average order
+    friend Money operator/(Money a, int64_t n) {
+        int64_t half = n / 2;
+        return Money((a.value >= 0 ? a.value + half : a.value - half) / n);
+    }
+
+    // "12", "12.5", "12.50" or "-0.25"; digits past the cent round half away
+    // from zero. Anything else, like the exponents older files could hold,
+    // is read as a double, so every file that loaded before still loads.
+    static bool parse(string_view text, Money& amount) {
+        bool negative = !text.empty() && text[0] == '-';
+        string_view digits = text.substr(negative ? 1 : 0);
+        size_t point = digits.find('.');
+        string_view whole = digits.substr(0, point);
+        string_view fraction = point == string_view::npos ? string_view() : digits.substr(point + 1);
+        uint64_t units = 0;
+        bool plain = (!whole.empty() || !fraction.empty()) && whole.size() <= 15;
+        if (plain && !whole.empty()) {
+            auto result = from_chars(whole.data(), whole.data() + whole.size(), units);
+            plain = result.ec == errc() && result.ptr == whole.data() + whole.size();
+        }
+        for (char c : fraction) {
+            plain = plain && c >= '0' && c <= '9';
+        }
+        if (plain) {
+            int64_t cents = (int64_t)units * 100;
+            cents += fraction.size() > 0 ? (fraction[0] - '0') * 10 : 0;
+            cents += fraction.size() > 1 ? fraction[1] - '0' : 0;
+            cents += fraction.size() > 2 && fraction[2] >= '5' ? 1 : 0;
+            amount = Money(negative ? -cents : cents);
+            return true;
+        }
+        double legacy;
+        auto result = from_chars(text.data(), text.data() + text.size(), legacy);
+        if (result.ec != errc() || result.ptr != text.data() + text.size() || !(fabs(legacy) < 1e15)) {
+            return false;
+        }
+        amount = fromDouble(legacy);
+        return true;
+    }
+
+    // Write "12.50" or "-0.25" to out, which has room for 24 characters;
+    // returns the end of the text
+    char* write(char* out) const {
+        uint64_t magnitude = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+        if (value < 0) {
+            *out++ = '-';
+        }
+        out = to_chars(out, out + 20, magnitude / 100).ptr;
+        *out++ = '.';
+        *out++ = (char)('0' + magnitude % 100 / 10);
+        *out++ = (char)('0' + magnitude % 10);
+        return out;
+    }
+
+    void appendTo(string& out) const {
+        char text[24];
+        out.append(text, write(text) - text);
+    }
+
+    string str() const {
+        char text[24];
+        return string(text, write(text) - text);
+    }
+};
+
+ostream& operator<<(ostream& out, Money amount) {
+    return out << amount.str();
+}
+
 // Structure to store book information
 struct Book {
-    string id;
-    string title;
-    string author;
-    string category;
-    double price;
+    PooledString id;
+    PooledString title;
+    PooledString author;
+    PooledString category;
+    Money price;
     int quantity;
-    string dateAdded;
+    int64_t dateAdded;      // seconds since the epoch
 };
 
-// Structure to store sales information
+// Structure to store sales information. bookTitle is the same pooled string
+// as the book's title rather than a copy, and stays valid if the book is
+// later deleted.
 struct Sale {
     string saleId;
+    PooledString bookId;
+    PooledString bookTitle;
+    int quantity;
+    Money totalAmount;
+    int64_t date;           // seconds since the epoch
+    PooledString customerName;
+};
+
+// One line of a cart: a book and how many copies of it
+struct CartLine {
     string bookId;
-    string bookTitle;
     int quantity;
-    double totalAmount;
-    string date;
-    string customerName;
 };
 
-// Structure to store user information
+// Fields to change on an existing book; unset fields keep their value
+struct BookChanges {
+    optional<string> title;
+    optional<string> author;
+    optional<string> category;
+    optional<Money> price;
+    optional<int> quantity;
+};
+
+// Structure to store user information. credential is a salted password
+// hash; see hashPassword().
 struct User {
     string username;
-    string password;
+    string credential;
     string role;
 };
 
-class BookshopManager {
+// Append-only sequence whose elements never move. They live in fixed-size
+// chunks that are allocated as the log grows and never reallocated, so a
+// thread that read size() under the lock guarding the appends may go on
+// reading the elements below it without that lock while appends continue.
+template <typename T>
+class AppendLog {
 private:
-    vector<Book> books;
-    vector<Sale> sales;
-    vector<User> users;
-    bool isLoggedIn;
-    string currentUser;
-    string currentRole;
-    
-    // File names for data storage
-    const string BOOKS_FILE = "books.txt";
-    const string SALES_FILE = "sales.txt";
-    const string USERS_FILE = "users.txt";
+    static const size_t CHUNK_BITS = 16;
+    static const size_t CHUNK_SIZE = size_t(1) << CHUNK_BITS;
+    static const size_t MAX_CHUNKS = size_t(1) << 16;
+
+    unique_ptr<T*[]> chunks;    // MAX_CHUNKS slots; raw storage, elements built in place
+    size_t length;
+
+    T* slot(size_t i) const {
+        return chunks[i >> CHUNK_BITS] + (i & (CHUNK_SIZE - 1));
+    }
 
 public:
-    BookshopManager() : isLoggedIn(false), currentUser(""), currentRole("") {
-        initializeDefaultUsers();
-        loadData();
+    class const_iterator {
+    private:
+        const AppendLog* log;
+        size_t index;
+
+    public:
+        const_iterator(const AppendLog* owner, size_t position) : log(owner), index(position) {}
+        const T& operator*() const { return (*log)[index]; }
+        const T* operator->() const { return &(*log)[index]; }
+        const_iterator& operator++() { index++; return *this; }
+        bool operator==(const const_iterator& other) const { return index == other.index; }
+        bool operator!=(const const_iterator& other) const { return index != other.index; }
+    };
+
+    AppendLog() : chunks(new T*[MAX_CHUNKS]()), length(0) {}
+
+    ~AppendLog() {
+        clear();
+        for (size_t c = 0; c < MAX_CHUNKS && chunks[c]; c++) {
+            ::operator delete(chunks[c]);
+        }
     }
 
-    // Initialize default users
-    void initializeDefaultUsers() {
-        users.clear();
-        users.push_back({"admin", "admin123", "admin"});
-        users.push_back({"staff", "staff123", "staff"});
-        users.push_back({"manager", "manager123", "manager"});
-        saveUsers();
+    AppendLog(const AppendLog&) = delete;
+    AppendLog& operator=(const AppendLog&) = delete;
+
+    template <typename... Args>
+    T& emplace_back(Args&&... args) {
+        size_t chunk = length >> CHUNK_BITS;
+        if (chunk >= MAX_CHUNKS) {
+            throw length_error("AppendLog is full");
+        }
+        if (!chunks[chunk]) {
+            chunks[chunk] = static_cast<T*>(::operator new(CHUNK_SIZE * sizeof(T)));
+        }
+        T* element = new (slot(length)) T(std::forward<Args>(args)...);
+        length++;
+        return *element;
     }
 
-    // Get current date and time
-    string getCurrentDateTime() {
-        time_t now = time(0);
-        char* dt = ctime(&now);
-        string dateTime = dt;
-        dateTime.pop_back(); // Remove newline character
-        return dateTime;
+    void push_back(const T& value) {
+        emplace_back(value);
     }
 
-    // Clear screen function
-    void clearScreen() {
-        #ifdef _WIN32
-            system("cls");
-        #else
-            system("clear");
-        #endif
+    void push_back(T&& value) {
+        emplace_back(std::move(value));
     }
 
-    // Input validation functions
-    int getValidatedInt(const string& prompt, int min = 0, int max = INT_MAX) {
-        int value;
-        while (true) {
-            cout << prompt;
-            if (cin >> value && value >= min && value <= max) {
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                return value;
-            } else {
-                cout << "Invalid input! Please enter a number between " << min << " and " << max << ".\n";
-                cin.clear();
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            }
+    // Chunks are kept for reuse when the log shrinks
+    void resize(size_t n) {
+        while (length > n) {
+            slot(--length)->~T();
+        }
+        while (length < n) {
+            emplace_back();
         }
     }
 
-    double getValidatedDouble(const string& prompt, double min = 0.0) {
-        double value;
-        while (true) {
-            cout << prompt;
-            if (cin >> value && value >= min) {
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-                return value;
-            } else {
-                cout << "Invalid input! Please enter a valid number >= " << min << ".\n";
-                cin.clear();
-                cin.ignore(numeric_limits<streamsize>::max(), '\n');
-            }
-        }
+    void clear() {
+        resize(0);
     }
 
-    string getValidatedString(const string& prompt) {
-        string value;
-        while (true) {
-            cout << prompt;
-            getline(cin, value);
-            if (!value.empty()) {
-                return value;
-            }
-            cout << "Input cannot be empty! Please try again.\n";
-        }
+    size_t size() const {
+        return length;
     }
 
-    // File I/O functions
-    void loadData() {
-        loadBooks();
-        loadSales();
-        loadUsers();
+    bool empty() const {
+        return length == 0;
     }
 
-    void saveData() {
-        saveBooks();
-        saveSales();
-        saveUsers();
+    T& operator[](size_t i) {
+        return *slot(i);
     }
 
-    void loadBooks() {
-        ifstream file(BOOKS_FILE);
-        books.clear();
-        if (file.is_open()) {
-            string line;
-            while (getline(file, line)) {
-                if (!line.empty()) {
-                    stringstream ss(line);
-                    Book book;
-                    getline(ss, book.id, '|');
-                    getline(ss, book.title, '|');
-                    getline(ss, book.author, '|');
-                    getline(ss, book.category, '|');
-                    ss >> book.price;
-                    ss.ignore();
-                    ss >> book.quantity;
-                    ss.ignore();
-                    getline(ss, book.dateAdded);
-                    books.push_back(book);
-                }
-            }
-            file.close();
-        }
+    const T& operator[](size_t i) const {
+        return *slot(i);
     }
 
-    void saveBooks() {
-        ofstream file(BOOKS_FILE);
-        if (file.is_open()) {
-            for (const auto& book : books) {
-                file << book.id << "|" << book.title << "|" << book.author << "|"
-                     << book.category << "|" << book.price << "|" << book.quantity
-                     << "|" << book.dateAdded << "\n";
-            }
-            file.close();
-        }
+    T& back() {
+        return *slot(length - 1);
     }
 
-    void loadSales() {
-        ifstream file(SALES_FILE);
-        sales.clear();
-        if (file.is_open()) {
-            string line;
-            while (getline(file, line)) {
-                if (!line.empty()) {
-                    stringstream ss(line);
-                    Sale sale;
-                    getline(ss, sale.saleId, '|');
-                    getline(ss, sale.bookId, '|');
-                    getline(ss, sale.bookTitle, '|');
-                    ss >> sale.quantity;
-                    ss.ignore();
-                    ss >> sale.totalAmount;
-                    ss.ignore();
-                    getline(ss, sale.date, '|');
-                    getline(ss, sale.customerName);
-                    sales.push_back(sale);
-                }
-            }
-            file.close();
-        }
+    const_iterator begin() const {
+        return const_iterator(this, 0);
     }
 
-    void saveSales() {
-        ofstream file(SALES_FILE);
-        if (file.is_open()) {
-            for (const auto& sale : sales) {
-                file << sale.saleId << "|" << sale.bookId << "|" << sale.bookTitle
-                     << "|" << sale.quantity << "|" << sale.totalAmount << "|"
-                     << sale.date << "|" << sale.customerName << "\n";
-            }
-            file.close();
-        }
+    const_iterator end() const {
+        return const_iterator(this, length);
     }
+};
 
-    void loadUsers() {
-        ifstream file(USERS_FILE);
-        if (file.is_open()) {
-            string line;
-            while (getline(file, line)) {
-                if (!line.empty()) {
-                    stringstream ss(line);
-                    User user;
-                    getline(ss, user.username, '|');
-                    getline(ss, user.password, '|');
-                    getline(ss, user.role);
-                    
-                    // Check if user already exists in default users
-                    bool exists = false;
-                    for (const auto& existingUser : users) {
-                        if (existingUser.username == user.username) {
-                            exists = true;
-                            break;
-                        }
-                    }
-                    if (!exists) {
-                        users.push_back(user);
+// The sales history. Sales are never changed once recorded, so snapshots
+// read them below a cut while new sales are appended.
+using SalesHistory = AppendLog<Sale>;
+
+// Epoch-based reclamation for the snapshot reads. A reader pins the current
+// epoch for as long as it uses shared objects; a writer that unlinks one
+// retires it instead of freeing it, and what was retired runs once every
+// reader pinned at or before that epoch has let go. Retired work runs in
+// the order it was retired.
+class EpochReclaimer {
+private:
+    static const size_t SLOTS = 64;
+
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch{0};      // 0 when no reader holds it
+    };
+
+    atomic<uint64_t> current;
+    array<Slot, SLOTS> slots;
+    mutex retiredMutex;
+    deque<pair<uint64_t, function<void()>>> retired;
+    atomic<size_t> waiting;
+
+public:
+    // Pins the epoch for its lifetime. Readers take a free slot, so any
+    // number of threads may pin at once as long as SLOTS are not all held.
+    class Guard {
+    private:
+        EpochReclaimer& owner;
+        Slot* slot;
+
+    public:
+        explicit Guard(EpochReclaimer& reclaimer) : owner(reclaimer), slot(nullptr) {
+            size_t start = hash<thread::id>()(this_thread::get_id()) % SLOTS;
+            while (true) {
+                for (size_t i = 0; i < SLOTS; i++) {
+                    Slot& candidate = owner.slots[(start + i) % SLOTS];
+                    uint64_t free = 0;
+                    if (candidate.epoch.compare_exchange_strong(free, owner.current.load())) {
+                        slot = &candidate;
+                        return;
                     }
                 }
+                this_thread::yield();
             }
-            file.close();
         }
-    }
 
-    void saveUsers() {
-        ofstream file(USERS_FILE);
-        if (file.is_open()) {
-            for (const auto& user : users) {
-                file << user.username << "|" << user.password << "|" << user.role << "\n";
+        ~Guard() {
+            slot->epoch.store(0);
+            if (owner.waiting.load(memory_order_relaxed) > 0) {
+                owner.collect();
             }
-            file.close();
+        }
+
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+    };
+
+    EpochReclaimer() : current(1), waiting(0) {}
+
+    // No readers are left by now
+    ~EpochReclaimer() {
+        for (auto& entry : retired) {
+            entry.second();
         }
     }
 
-    // Authentication functions
-    bool login() {
-        clearScreen();
-        cout << "\n" << string(60, '=') << "\n";
-        cout << "           GENIUS BOOKS - LOGIN SYSTEM\n";
-        cout << string(60, '=') << "\n\n";
-        
-        string username, password;
-        cout << "Enter Username: ";
-        getline(cin, username);
-        cout << "Enter Password: ";
-        getline(cin, password);
-        
-        for (const auto& user : users) {
-            if (user.username == username && user.password == password) {
-                isLoggedIn = true;
-                currentUser = username;
-                currentRole = user.role;
-                cout << "\n✓ Login successful! Welcome, " << username << "!\n";
-                cout << "Role: " << user.role << "\n";
-                cout << "Press Enter to continue...";
-                cin.get();
-                return true;
+    EpochReclaimer(const EpochReclaimer&) = delete;
+    EpochReclaimer& operator=(const EpochReclaimer&) = delete;
+
+    // Run release once no reader can still see what the caller has just
+    // unlinked
+    void retire(function<void()> release) {
+        {
+            lock_guard<mutex> lock(retiredMutex);
+            retired.emplace_back(current.fetch_add(1), move(release));
+            waiting++;
+        }
+        collect();
+    }
+
+    void collect() {
+        lock_guard<mutex> lock(retiredMutex);
+        uint64_t oldest = UINT64_MAX;
+        for (const Slot& slot : slots) {
+            uint64_t epoch = slot.epoch.load();
+            if (epoch != 0) {
+                oldest = min(oldest, epoch);
             }
         }
-        
-        cout << "\n✗ Invalid username or password!\n";
-        cout << "Press Enter to continue...";
-        cin.get();
-        return false;
+        while (!retired.empty() && retired.front().first < oldest) {
+            retired.front().second();
+            retired.pop_front();
+            waiting--;
+        }
     }
 
-    void logout() {
-        isLoggedIn = false;
-        currentUser = "";
-        currentRole = "";
-        cout << "\n✓ Logged out successfully!\n";
-        cout << "Press Enter to continue...";
-        cin.get();
+    // Retired work still waiting for readers
+    size_t pending() const {
+        return waiting.load();
     }
+};
 
-    // Book management functions
-    void viewBooks() {
-        clearScreen();
-        cout << "\n" << string(80, '=') << "\n";
-        cout << "                    AVAILABLE BOOKS\n";
-        cout << string(80, '=') << "\n";
+// Chunk layout shared by every StableColumn: chunk c holds FIRST_CHUNK << c
+// values, so the chunk of any index is found with one bit scan and runs
+// of contiguous values get longer as a column grows. Columns of the same
+// length have the same runs.
+struct ColumnChunks {
+    static const size_t FIRST_BITS = 12;
+    static const size_t MAX_CHUNKS = 40;
+
+    static size_t chunkOf(size_t i) {
+        size_t blocks = (i >> FIRST_BITS) + 1;
+        #ifdef __GNUC__
+            return 63 - __builtin_clzll(blocks);
+        #else
+            size_t chunk = 0;
+            while (blocks >>= 1) {
+                chunk++;
+            }
+            return chunk;
+        #endif
+    }
+
+    static size_t chunkStart(size_t chunk) {
+        return ((size_t(1) << chunk) - 1) << FIRST_BITS;
+    }
+
+    // Call run(first, count) for each contiguous run of [begin, end)
+    template <typename Run>
+    static void runs(size_t begin, size_t end, Run run) {
+        while (begin < end) {
+            size_t chunk = chunkOf(begin);
+            size_t count = min(end, chunkStart(chunk + 1)) - begin;
+            run(begin, count);
+            begin += count;
+        }
+    }
+};
+
+// Append-only column of plain values whose elements never move, for the
+// sales columns. As with AppendLog, a reader that noted size() under the
+// lock guarding the appends may read below it without that lock while
+// appends continue.
+template <typename T>
+class StableColumn {
+private:
+    static_assert(is_trivially_copyable<T>::value, "StableColumn holds plain values");
+
+    array<T*, ColumnChunks::MAX_CHUNKS> chunks;
+    size_t length;
+
+public:
+    StableColumn() : length(0) {
+        chunks.fill(nullptr);
+    }
+
+    ~StableColumn() {
+        for (T* chunk : chunks) {
+            ::operator delete(chunk);
+        }
+    }
+
+    StableColumn(const StableColumn&) = delete;
+    StableColumn& operator=(const StableColumn&) = delete;
+
+    void push_back(T value) {
+        size_t chunk = ColumnChunks::chunkOf(length);
+        if (!chunks[chunk]) {
+            chunks[chunk] = static_cast<T*>(::operator new(sizeof(T) << (ColumnChunks::FIRST_BITS + chunk)));
+        }
+        new (chunks[chunk] + (length - ColumnChunks::chunkStart(chunk))) T(value);
+        length++;
+    }
+
+    // Chunks are kept for reuse
+    void clear() {
+        length = 0;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    const T* at(size_t i) const {
+        size_t chunk = ColumnChunks::chunkOf(i);
+        return chunks[chunk] + (i - ColumnChunks::chunkStart(chunk));
+    }
+
+    const T& operator[](size_t i) const {
+        return *at(i);
+    }
+
+    const T& back() const {
+        return *at(length - 1);
+    }
+};
+
+// Read-only view of a whole file. Memory-mapped where the platform allows
+// it, so loaders can parse records in place without copying lines out.
+class MappedFile {
+private:
+    const char* data;
+    size_t length;
+    #ifdef _WIN32
+        string buffer;
+    #else
+        void* mapping;
+    #endif
+
+public:
+    MappedFile() : data(nullptr), length(0) {
+        #ifndef _WIN32
+            mapping = nullptr;
+        #endif
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool open(const string& path) {
+        close();
+        #ifdef _WIN32
+            ifstream file(path, ios::binary);
+            if (!file.is_open()) {
+                return false;
+            }
+            buffer.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+            data = buffer.data();
+            length = buffer.size();
+            return true;
+        #else
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0) {
+                ::close(fd);
+                return false;
+            }
+            length = (size_t)info.st_size;
+            if (length > 0) {
+                mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping == MAP_FAILED) {
+                    mapping = nullptr;
+                    length = 0;
+                    ::close(fd);
+                    return false;
+                }
+                madvise(mapping, length, MADV_SEQUENTIAL);
+                data = static_cast<const char*>(mapping);
+            }
+            ::close(fd);
+            return true;
+        #endif
+    }
+
+    void close() {
+        #ifdef _WIN32
+            buffer.clear();
+        #else
+            if (mapping) {
+                munmap(mapping, length);
+                mapping = nullptr;
+            }
+        #endif
+        data = nullptr;
+        length = 0;
+    }
+
+    string_view view() const {
+        return string_view(data ? data : "", length);
+    }
+};
+
+// Split a line on '|' into at most maxFields views; the last field keeps
+// the rest of the line. Returns the number of fields found.
+size_t splitFields(string_view line, string_view* fields, size_t maxFields) {
+    size_t count = 0;
+    while (count + 1 < maxFields) {
+        size_t sep = line.find('|');
+        if (sep == string_view::npos) {
+            break;
+        }
+        fields[count++] = line.substr(0, sep);
+        line.remove_prefix(sep + 1);
+    }
+    fields[count++] = line;
+    return count;
+}
+
+// Locale-free number parsing for record fields; the whole field must be
+// the number
+template <typename T>
+bool parseNumber(string_view text, T& value) {
+    auto result = from_chars(text.data(), text.data() + text.size(), value);
+    return result.ec == errc() && result.ptr == text.data() + text.size();
+}
+
+// ... and formatting
+template <typename T>
+void appendNumber(string& out, T value) {
+    char digits[24];
+    out.append(digits, to_chars(digits, digits + sizeof(digits), value).ptr - digits);
+}
+
+// Call onLine for every complete '\n'-terminated line in text, without a
+// '\r' before the newline from files written on Windows. A final line
+// without its newline is only passed on when includePartial is set.
+template <typename Callback>
+void forEachLine(string_view text, bool includePartial, Callback onLine) {
+    const char* pos = text.data();
+    const char* end = pos + text.size();
+    while (pos < end) {
+        const char* newline = static_cast<const char*>(memchr(pos, '\n', end - pos));
+        if (!newline) {
+            if (includePartial) {
+                onLine(string_view(pos, end - pos));
+            }
+            break;
+        }
+        const char* lineEnd = newline > pos && newline[-1] == '\r' ? newline - 1 : newline;
+        onLine(string_view(pos, lineEnd - pos));
+        pos = newline + 1;
+    }
+}
+
+// Runtime metrics. Every thread counts into its own slab of relaxed
+// atomics, so the hot paths never share a cache line; readers add the slabs
+// up. Build with -DBOOKSHOP_NO_METRICS to compile the probes out entirely.
+enum class Counter {
+    BookLookups,
+    SalesMade,
+    SalesRejected,
+    RecordsLoaded,
+    RecordsScanned,
+    BytesWritten,
+    Fsyncs,
+    Requests,
+    Count
+};
+
+// Latency histograms. Book lookups are timed for one call in 64; the
+// lookup counter has the exact number of calls.
+enum class Timer {
+    LoadData,
+    SaveData,
+    Compaction,
+    CheckpointPause,
+    Sale,
+    BookLookup,
+    Report,
+    Fsync,
+    Startup,
+    Count
+};
+
+// When the process started, for the startup timer
+const chrono::steady_clock::time_point LAUNCH_TIME = chrono::steady_clock::now();
+
+inline uint64_t nanosecondsSinceLaunch() {
+    return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - LAUNCH_TIME).count();
+}
+
+class Metrics {
+public:
+    // Bucket k counts durations of 2^(k-1) up to 2^k nanoseconds
+    static const size_t BUCKETS = 40;
+    static const size_t COUNTERS = (size_t)Counter::Count;
+    static const size_t TIMERS = (size_t)Timer::Count;
+
+    struct Totals {
+        array<uint64_t, COUNTERS> counters{};
+        array<array<uint64_t, BUCKETS>, TIMERS> buckets{};
+        array<uint64_t, TIMERS> sumNs{};
+    };
+
+private:
+    // Written only by its own thread, read by anyone
+    struct Slab {
+        array<atomic<uint64_t>, COUNTERS> counters{};
+        array<array<atomic<uint64_t>, BUCKETS>, TIMERS> buckets{};
+        array<atomic<uint64_t>, TIMERS> sumNs{};
+    };
+
+    mutable mutex slabsMutex;
+    vector<unique_ptr<Slab>> slabs;     // kept after their thread exits so no counts are lost
+
+    Slab& local() {
+        thread_local Slab* slab = nullptr;
+        if (!slab) {
+            lock_guard<mutex> lock(slabsMutex);
+            slabs.push_back(make_unique<Slab>());
+            slab = slabs.back().get();
+        }
+        return *slab;
+    }
+
+    // The owning thread is the only writer, so a load and store is enough
+    static void bump(atomic<uint64_t>& value, uint64_t amount) {
+        value.store(value.load(memory_order_relaxed) + amount, memory_order_relaxed);
+    }
+
+public:
+    static Metrics& shared() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    static constexpr bool enabled() {
+        #ifdef BOOKSHOP_NO_METRICS
+            return false;
+        #else
+            return true;
+        #endif
+    }
+
+    void add(Counter counter, uint64_t amount = 1) {
+        bump(local().counters[(size_t)counter], amount);
+    }
+
+    void observe(Timer timer, uint64_t nanoseconds) {
+        size_t bucket = 0;
+        for (uint64_t rest = nanoseconds; rest > 0 && bucket + 1 < BUCKETS; rest >>= 1) {
+            bucket++;
+        }
+        Slab& slab = local();
+        bump(slab.buckets[(size_t)timer][bucket], 1);
+        bump(slab.sumNs[(size_t)timer], nanoseconds);
+    }
+
+    Totals totals() const {
+        Totals result;
+        lock_guard<mutex> lock(slabsMutex);
+        for (const auto& slab : slabs) {
+            for (size_t c = 0; c < COUNTERS; c++) {
+                result.counters[c] += slab->counters[c].load(memory_order_relaxed);
+            }
+            for (size_t t = 0; t < TIMERS; t++) {
+                for (size_t b = 0; b < BUCKETS; b++) {
+                    result.buckets[t][b] += slab->buckets[t][b].load(memory_order_relaxed);
+                }
+                result.sumNs[t] += slab->sumNs[t].load(memory_order_relaxed);
+            }
+        }
+        return result;
+    }
+
+    static const char* counterName(size_t counter) {
+        static const char* NAMES[] = {"book_lookups_total", "sales_total", "sales_rejected_total",
+                                      "records_loaded_total", "records_scanned_total", "bytes_written_total",
+                                      "fsyncs_total", "requests_total"};
+        return NAMES[counter];
+    }
+
+    static const char* counterHelp(size_t counter) {
+        static const char* HELP[] = {"Book lookups by id.", "Sales recorded.", "Sales refused.",
+                                     "Books and sales read at startup.", "Sales rows read by reports.",
+                                     "Bytes written to journal and snapshot files.",
+                                     "fsync calls on journal and snapshot files.",
+                                     "Requests answered by the network service."};
+        return HELP[counter];
+    }
+
+    static const char* timerName(size_t timer) {
+        static const char* NAMES[] = {"load_data_seconds", "save_data_seconds", "compaction_seconds",
+                                      "checkpoint_pause_seconds", "sale_seconds", "book_lookup_seconds", "report_seconds", "fsync_seconds",
+                                      "startup_seconds"};
+        return NAMES[timer];
+    }
+
+    static const char* timerHelp(size_t timer) {
+        static const char* HELP[] = {"Time to load all data at startup.", "Time to save data on exit.",
+                                     "Time to fold the journal into the snapshot files.",
+                                     "Time updates wait while a checkpoint copies the catalogue.",
+                                     "Time to record one sale.", "Book lookup time, sampled 1 in 64.",
+                                     "Time to build a sales report.", "Journal and snapshot fsync time.",
+                                     "Time from launch to the first menu prompt."};
+        return HELP[timer];
+    }
+
+    // Upper bound of the bucket holding the p-th quantile; 0 when empty
+    static double percentileNs(const array<uint64_t, BUCKETS>& buckets, double p) {
+        uint64_t count = 0;
+        for (uint64_t bucket : buckets) {
+            count += bucket;
+        }
+        if (count == 0) {
+            return 0.0;
+        }
+        uint64_t rank = (uint64_t)max(1.0, ceil(p * count));
+        uint64_t cumulative = 0;
+        for (size_t b = 0; b < BUCKETS; b++) {
+            cumulative += buckets[b];
+            if (cumulative >= rank) {
+                return (double)(1ULL << b);
+            }
+        }
+        return (double)(1ULL << (BUCKETS - 1));
+    }
+
+    // Everything in the Prometheus text exposition format
+    string prometheus() const {
+        Totals all = totals();
+        stringstream out;
+        for (size_t c = 0; c < COUNTERS; c++) {
+            out << "# HELP bookshop_" << counterName(c) << " " << counterHelp(c) << "\n"
+                << "# TYPE bookshop_" << counterName(c) << " counter\n"
+                << "bookshop_" << counterName(c) << " " << all.counters[c] << "\n";
+        }
+        for (size_t t = 0; t < TIMERS; t++) {
+            string name = string("bookshop_") + timerName(t);
+            out << "# HELP " << name << " " << timerHelp(t) << "\n"
+                << "# TYPE " << name << " histogram\n";
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < BUCKETS; b++) {
+                cumulative += all.buckets[t][b];
+                if (b + 1 < BUCKETS) {
+                    char bound[32];
+                    snprintf(bound, sizeof(bound), "%g", (double)(1ULL << b) / 1e9);
+                    out << name << "_bucket{le=\"" << bound << "\"} " << cumulative << "\n";
+                }
+            }
+            out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n"
+                << name << "_sum " << all.sumNs[t] / 1e9 << "\n"
+                << name << "_count " << cumulative << "\n";
+        }
+        return out.str();
+    }
+};
+
+// Times the enclosing scope into a histogram
+class ScopedTimer {
+private:
+    Timer timer;
+    chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedTimer(Timer which, bool active = true) : timer(which) {
+        if (active) {
+            start = chrono::steady_clock::now();
+        }
+    }
+
+    ~ScopedTimer() {
+        if (start != chrono::steady_clock::time_point()) {
+            auto elapsed = chrono::steady_clock::now() - start;
+            Metrics::shared().observe(timer, (uint64_t)chrono::duration_cast<chrono::nanoseconds>(elapsed).count());
+        }
+    }
+};
+
+// Every 2^shift-th call on this thread, for sampling very hot paths
+template <int shift>
+inline bool sampleThisCall() {
+    thread_local uint32_t calls = 0;
+    return (calls++ & ((1u << shift) - 1)) == 0;
+}
+
+#define BOOKSHOP_CONCAT_(a, b) a##b
+#define BOOKSHOP_CONCAT(a, b) BOOKSHOP_CONCAT_(a, b)
+#ifndef BOOKSHOP_NO_METRICS
+    #define METRIC_ADD(counter, amount) Metrics::shared().add(Counter::counter, (amount))
+    #define METRIC_TIME(timer) ScopedTimer BOOKSHOP_CONCAT(metricTimer, __LINE__)(Timer::timer)
+    #define METRIC_TIME_SAMPLED(timer, shift) \
+        ScopedTimer BOOKSHOP_CONCAT(metricTimer, __LINE__)(Timer::timer, sampleThisCall<shift>())
+    #define METRIC_OBSERVE(timer, nanoseconds) Metrics::shared().observe(Timer::timer, (nanoseconds))
+#else
+    #define METRIC_ADD(counter, amount) ((void)0)
+    #define METRIC_TIME(timer) ((void)0)
+    #define METRIC_TIME_SAMPLED(timer, shift) ((void)0)
+    #define METRIC_OBSERVE(timer, nanoseconds) ((void)0)
+#endif
+
+// Writes the metrics to a file in the background every interval, through a
+// temporary file and a rename so scrapers never see a partial file
+class MetricsDumper {
+private:
+    string path;
+    chrono::seconds interval;
+    bool stopping;
+    mutex stateMutex;
+    condition_variable wake;
+    thread worker;
+
+    void dump() {
+        string temporary = path + ".tmp";
+        {
+            ofstream file(temporary, ios::trunc);
+            file << Metrics::shared().prometheus();
+            if (!file.good()) {
+                return;
+            }
+        }
+        rename(temporary.c_str(), path.c_str());
+    }
+
+public:
+    MetricsDumper() : interval(10), stopping(false) {}
+
+    ~MetricsDumper() {
+        stop();
+    }
+
+    void start(const string& fileName, chrono::seconds every) {
+        stop();
+        path = fileName;
+        interval = every;
+        stopping = false;
+        worker = thread([this] {
+            unique_lock<mutex> lock(stateMutex);
+            while (!wake.wait_for(lock, interval, [this] { return stopping; })) {
+                lock.unlock();
+                dump();
+                lock.lock();
+            }
+        });
+    }
+
+    // Stop the worker and write the final numbers
+    void stop() {
+        if (!worker.joinable()) {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(stateMutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+        dump();
+    }
+};
+
+// Open-addressing hash index from Book::id to its slot in the books vector.
+// Linear probing with backward-shift deletion, so no tombstones build up.
+// Keys are not stored; probes compare against the id held in the vector.
+class BookIndex {
+private:
+    struct Entry {
+        uint64_t hash;
+        uint32_t slot; // EMPTY when unused
+    };
+    static const uint32_t EMPTY = UINT32_MAX;
+
+    vector<Entry> table;
+    size_t mask;
+    size_t count;
+
+    static uint64_t hashId(string_view id) {
+        return std::hash<string_view>()(id);
+    }
+
+    void grow() {
+        vector<Entry> old;
+        old.swap(table);
+        table.assign(old.empty() ? 16 : old.size() * 2, Entry{0, EMPTY});
+        mask = table.size() - 1;
+        for (const auto& entry : old) {
+            if (entry.slot != EMPTY) {
+                place(entry);
+            }
+        }
+    }
+
+    void place(const Entry& entry) {
+        size_t pos = entry.hash & mask;
+        while (table[pos].slot != EMPTY) {
+            pos = (pos + 1) & mask;
+        }
+        table[pos] = entry;
+    }
+
+    // Position in the table holding id, or npos
+    size_t locate(string_view id, const vector<Book>& books) const {
+        if (table.empty()) {
+            return string::npos;
+        }
+        uint64_t h = hashId(id);
+        size_t pos = h & mask;
+        while (table[pos].slot != EMPTY) {
+            if (table[pos].hash == h && books[table[pos].slot].id == id) {
+                return pos;
+            }
+            pos = (pos + 1) & mask;
+        }
+        return string::npos;
+    }
+
+public:
+    BookIndex() : mask(0), count(0) {}
+
+    void clear() {
+        table.clear();
+        mask = 0;
+        count = 0;
+    }
+
+    void rebuild(const vector<Book>& books) {
+        clear();
+        size_t capacity = 16;
+        while (capacity < books.size() * 2) {
+            capacity *= 2;
+        }
+        table.assign(capacity, Entry{0, EMPTY});
+        mask = capacity - 1;
+        for (size_t i = 0; i < books.size(); i++) {
+            insert(books[i].id, (uint32_t)i, books);
+        }
+    }
+
+    // Slot of the book with this id, or -1 if there is none
+    long find(string_view id, const vector<Book>& books) const {
+        size_t pos = locate(id, books);
+        return pos == string::npos ? -1 : (long)table[pos].slot;
+    }
+
+    // Add id -> slot; an id that is already indexed keeps its first slot
+    bool insert(string_view id, uint32_t slot, const vector<Book>& books) {
+        if (locate(id, books) != string::npos) {
+            return false;
+        }
+        if ((count + 1) * 2 > table.size()) {
+            grow();
+        }
+        place(Entry{hashId(id), slot});
+        count++;
+        return true;
+    }
+
+    // Remove id before its book is erased from the vector, which moves the
+    // last book into the erased slot; only that book's entry changes
+    void erase(string_view id, const vector<Book>& books) {
+        size_t pos = locate(id, books);
+        if (pos == string::npos) {
+            return;
+        }
+        uint32_t erased = table[pos].slot;
+        // Backward-shift the rest of the probe run into the hole
+        size_t hole = pos;
+        size_t next = (hole + 1) & mask;
+        while (table[next].slot != EMPTY) {
+            size_t home = table[next].hash & mask;
+            if (((next - home) & mask) >= ((next - hole) & mask)) {
+                table[hole] = table[next];
+                hole = next;
+            }
+            next = (next + 1) & mask;
+        }
+        table[hole].slot = EMPTY;
+        count--;
+
+        uint32_t last = (uint32_t)books.size() - 1;
+        if (erased != last) {
+            table[locate(books[last].id, books)].slot = erased;
+        }
+    }
+
+    size_t size() const {
+        return count;
+    }
+};
+
+// Catalogue order over the slots of the books vector. Erasing a book moves
+// the last one into its slot, so the vector alone forgets the order books
+// were added in. A delete only blanks the book's entry here, and the blanks
+// are squeezed out once they make up half the list, so deletes stay O(1)
+// amortized.
+class CatalogueOrder {
+private:
+    static const uint32_t GONE = UINT32_MAX;
+
+    vector<uint32_t> order;     // slots in catalogue order, GONE once deleted
+    vector<uint32_t> position;  // index into order of every slot
+    size_t gone;
+
+    void compact() {
+        size_t kept = 0;
+        for (uint32_t slot : order) {
+            if (slot != GONE) {
+                position[slot] = (uint32_t)kept;
+                order[kept++] = slot;
+            }
+        }
+        order.resize(kept);
+        gone = 0;
+    }
+
+public:
+    CatalogueOrder() : gone(0) {}
+
+    // Slot order is catalogue order right after a load
+    void rebuild(size_t books) {
+        order.resize(books);
+        position.resize(books);
+        for (size_t i = 0; i < books; i++) {
+            order[i] = position[i] = (uint32_t)i;
+        }
+        gone = 0;
+    }
+
+    // A book was appended to the vector
+    void push() {
+        position.push_back((uint32_t)order.size());
+        order.push_back((uint32_t)(position.size() - 1));
+    }
+
+    // Call before the book in slot is erased and the last slot moves into it
+    void erase(uint32_t slot) {
+        uint32_t last = (uint32_t)position.size() - 1;
+        order[position[slot]] = GONE;
+        gone++;
+        if (slot != last) {
+            order[position[last]] = slot;
+            position[slot] = position[last];
+        }
+        position.pop_back();
+        if (gone * 2 > order.size()) {
+            compact();
+        }
+    }
+
+    // Visit every slot in catalogue order
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        for (uint32_t slot : order) {
+            if (slot != GONE) {
+                visit(slot);
+            }
+        }
+    }
+
+    // Visit slots in catalogue order from entry from of the list until
+    // visit returns false; returns the entry it stopped at, or end()
+    template <typename Visit>
+    size_t walk(size_t from, Visit visit) const {
+        for (; from < order.size(); from++) {
+            if (order[from] != GONE && !visit(order[from])) {
+                break;
+            }
+        }
+        return from;
+    }
+
+    size_t end() const {
+        return order.size();
+    }
+
+    // Orders two slots the way the catalogue does
+    uint32_t rank(uint32_t slot) const {
+        return position[slot];
+    }
+};
+
+// Versions of the catalogue for snapshot reads. Each book has a chain of
+// versions, newest first, stamped with the catalogue change that made
+// them; a reader that noted stamp s sees each book as its newest version
+// stamped at or before s. Changes are made under the catalogue lock and
+// readers take none. A version goes once no pinned reader can need it, and
+// a deleted book keeps a tombstone at the head of its chain. Stock levels
+// change with every sale and are not versioned.
+class CatalogueVersions {
+private:
+    struct Version {
+        Book book;
+        uint64_t stamp;
+        bool deleted;
+        atomic<Version*> older;
+    };
+
+    // Open-addressed table of chain heads by book id, never over half full.
+    // It grows by copying into one twice the size; readers still in the old
+    // one finish there.
+    struct Table {
+        size_t mask;
+        size_t used;
+        unique_ptr<atomic<Version*>[]> heads;
+
+        explicit Table(size_t capacity) : mask(capacity - 1), used(0), heads(new atomic<Version*>[capacity]) {
+            for (size_t i = 0; i < capacity; i++) {
+                heads[i].store(nullptr, memory_order_relaxed);
+            }
+        }
+    };
+
+    atomic<Table*> table;
+    atomic<uint64_t> clock;     // stamp of the latest change
+
+    static size_t slotOf(PooledString id, size_t mask) {
+        return (size_t)((uint64_t)hash<PooledString>()(id) * 0x9E3779B97F4A7C15ull >> 20) & mask;
+    }
+
+    // The head that holds id's chain, or the empty one where it would go
+    static atomic<Version*>& headFor(const Table& in, PooledString id) {
+        for (size_t i = slotOf(id, in.mask);; i = (i + 1) & in.mask) {
+            Version* head = in.heads[i].load();
+            if (!head || head->book.id == id) {
+                return in.heads[i];
+            }
+        }
+    }
+
+    static bool sameEntry(const Book& a, const Book& b) {
+        return a.title == b.title && a.author == b.author && a.category == b.category && a.price == b.price
+               && a.dateAdded == b.dateAdded;
+    }
+
+    static void freeChain(Version* version) {
+        while (version) {
+            Version* next = version->older.load();
+            delete version;
+            version = next;
+        }
+    }
+
+    Table* grow(EpochReclaimer& epochs) {
+        Table* old = table.load();
+        Table* bigger = new Table(2 * (old->mask + 1));
+        for (size_t i = 0; i <= old->mask; i++) {
+            if (Version* head = old->heads[i].load()) {
+                headFor(*bigger, head->book.id).store(head);
+            }
+        }
+        bigger->used = old->used;
+        table.store(bigger);
+        epochs.retire([old] { delete old; });
+        return bigger;
+    }
+
+    // Newest version of a chain visible at stamp, or null
+    static const Version* visible(const Version* version, uint64_t stamp) {
+        while (version && version->stamp > stamp) {
+            version = version->older.load();
+        }
+        return version;
+    }
+
+public:
+    CatalogueVersions() : table(new Table(64)), clock(0) {}
+
+    // Pending retirements must have run by now
+    ~CatalogueVersions() {
+        Table* last = table.load();
+        for (size_t i = 0; i <= last->mask; i++) {
+            freeChain(last->heads[i].load());
+        }
+        delete last;
+    }
+
+    CatalogueVersions(const CatalogueVersions&) = delete;
+    CatalogueVersions& operator=(const CatalogueVersions&) = delete;
+
+    // Record a book as added, changed or, with deleted, removed. Stock-only
+    // changes make no version. Callers hold the catalogue lock exclusively.
+    void commit(const Book& book, bool deleted, EpochReclaimer& epochs) {
+        Table* current = table.load();
+        atomic<Version*>* head = &headFor(*current, book.id);
+        Version* newest = head->load();
+        if (!newest) {
+            if (deleted) {
+                return;
+            }
+            if (2 * (current->used + 1) > current->mask + 1) {
+                current = grow(epochs);
+                head = &headFor(*current, book.id);
+            }
+            current->used++;
+        } else if (newest->deleted == deleted && (deleted || sameEntry(newest->book, book))) {
+            return;
+        }
+        uint64_t stamp = clock.load() + 1;
+        Version* version = new Version{book, stamp, deleted, {newest}};
+        head->store(version);
+        clock.store(stamp);
+        if (newest) {
+            // Readers that noted an earlier stamp may still walk past version
+            epochs.retire([version] { freeChain(version->older.exchange(nullptr)); });
+        }
+    }
+
+    // Make the versions match books: commit each one and delete the rest.
+    // Callers hold the catalogue lock exclusively.
+    void rebuild(const vector<Book>& books, EpochReclaimer& epochs) {
+        unordered_set<PooledString> present;
+        for (const auto& book : books) {
+            present.insert(book.id);
+            commit(book, false, epochs);
+        }
+        vector<Book> removed;
+        Table* current = table.load();
+        for (size_t i = 0; i <= current->mask; i++) {
+            Version* head = current->heads[i].load();
+            if (head && !head->deleted && !present.count(head->book.id)) {
+                removed.push_back(head->book);
+            }
+        }
+        for (const auto& book : removed) {
+            commit(book, true, epochs);
+        }
+    }
+
+    // Stamp of the latest change; readers note it after pinning the epoch
+    uint64_t stamp() const {
+        return clock.load();
+    }
+
+    // The book as of stamp, or null if it did not exist then
+    const Book* find(PooledString id, uint64_t stamp) const {
+        const Version* version = visible(headFor(*table.load(), id).load(), stamp);
+        return version && !version->deleted ? &version->book : nullptr;
+    }
+
+    // Books in the catalogue as of stamp
+    size_t count(uint64_t stamp) const {
+        const Table* current = table.load();
+        size_t books = 0;
+        for (size_t i = 0; i <= current->mask; i++) {
+            const Version* version = visible(current->heads[i].load(), stamp);
+            books += version && !version->deleted;
+        }
+        return books;
+    }
+};
+
+// Aggregation kernels over contiguous sales columns. The AVX2 versions are
+// picked at runtime when the CPU supports them; the scalar ones are used
+// everywhere else.
+#ifdef BOOKSHOP_X86_KERNELS
+__attribute__((target("avx2")))
+int64_t sumInt64Avx2(const int64_t* values, size_t n) {
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    __m256i acc2 = _mm256_setzero_si256();
+    __m256i acc3 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_add_epi64(acc0, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i)));
+        acc1 = _mm256_add_epi64(acc1, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i + 4)));
+        acc2 = _mm256_add_epi64(acc2, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i + 8)));
+        acc3 = _mm256_add_epi64(acc3, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i + 12)));
+    }
+    __m256i acc = _mm256_add_epi64(_mm256_add_epi64(acc0, acc1), _mm256_add_epi64(acc2, acc3));
+    int64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    int64_t total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; i++) {
+        total += values[i];
+    }
+    return total;
+}
+
+// AVX2 has no 64-bit integer min or max, so each is a compare and a blend
+__attribute__((target("avx2")))
+void minMaxInt64Avx2(const int64_t* values, size_t n, int64_t& minValue, int64_t& maxValue) {
+    size_t i = 0;
+    int64_t lo = values[0];
+    int64_t hi = values[0];
+    if (n >= 4) {
+        __m256i vmin = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values));
+        __m256i vmax = vmin;
+        for (i = 4; i + 4 <= n; i += 4) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i));
+            vmin = _mm256_blendv_epi8(vmin, v, _mm256_cmpgt_epi64(vmin, v));
+            vmax = _mm256_blendv_epi8(vmax, v, _mm256_cmpgt_epi64(v, vmax));
+        }
+        int64_t lanes[4];
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), vmin);
+        lo = min(min(lanes[0], lanes[1]), min(lanes[2], lanes[3]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), vmax);
+        hi = max(max(lanes[0], lanes[1]), max(lanes[2], lanes[3]));
+    }
+    for (; i < n; i++) {
+        lo = min(lo, values[i]);
+        hi = max(hi, values[i]);
+    }
+    minValue = lo;
+    maxValue = hi;
+}
+
+__attribute__((target("avx2")))
+int64_t sumInt32Avx2(const int32_t* values, size_t n) {
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+        __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i + 4));
+        acc0 = _mm256_add_epi64(acc0, _mm256_cvtepi32_epi64(lo));
+        acc1 = _mm256_add_epi64(acc1, _mm256_cvtepi32_epi64(hi));
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), _mm256_add_epi64(acc0, acc1));
+    int64_t total = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    for (; i < n; i++) {
+        total += values[i];
+    }
+    return total;
+}
+
+bool cpuHasAvx2() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+#endif
+
+int64_t sumInt64(const int64_t* values, size_t n) {
+    #ifdef BOOKSHOP_X86_KERNELS
+        if (cpuHasAvx2()) {
+            return sumInt64Avx2(values, n);
+        }
+    #endif
+    int64_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += values[i];
+    }
+    return total;
+}
+
+// Leaves minValue and maxValue untouched when n is 0
+void minMaxInt64(const int64_t* values, size_t n, int64_t& minValue, int64_t& maxValue) {
+    if (n == 0) {
+        return;
+    }
+    #ifdef BOOKSHOP_X86_KERNELS
+        if (cpuHasAvx2()) {
+            minMaxInt64Avx2(values, n, minValue, maxValue);
+            return;
+        }
+    #endif
+    minValue = maxValue = values[0];
+    for (size_t i = 1; i < n; i++) {
+        minValue = min(minValue, values[i]);
+        maxValue = max(maxValue, values[i]);
+    }
+}
+
+int64_t sumInt32(const int32_t* values, size_t n) {
+    #ifdef BOOKSHOP_X86_KERNELS
+        if (cpuHasAvx2()) {
+            return sumInt32Avx2(values, n);
+        }
+    #endif
+    int64_t total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += values[i];
+    }
+    return total;
+}
+
+// Per-group sums: totals[codes[i]] += values[i]. The scatter has no useful
+// AVX2 form, so two interleaved accumulator sets hide the store-to-load
+// dependency when the same group repeats.
+template <typename T, typename Total>
+void groupSum(const uint32_t* codes, const T* values, size_t n, vector<Total>& totals) {
+    vector<Total> second(totals.size(), 0);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        totals[codes[i]] += values[i];
+        second[codes[i + 1]] += values[i + 1];
+    }
+    for (; i < n; i++) {
+        totals[codes[i]] += values[i];
+    }
+    for (size_t g = 0; g < totals.size(); g++) {
+        totals[g] += second[g];
+    }
+}
+
+// Dictionary encoding for repeated strings in a column. Pooled strings are
+// already deduplicated, so codes are keyed on their storage. Codes are
+// only ever added, so decode() is safe below a size() noted under the lock
+// guarding encode().
+class StringDictionary {
+private:
+    // Open-addressed table of code + 1 (0 when unused) by the string's
+    // address, never over half full; only the writer uses it
+    vector<uint32_t> slots;
+    StableColumn<PooledString> values;
+
+    size_t home(PooledString value) const {
+        return (size_t)(((uintptr_t)value.data() * 0x9E3779B97F4A7C15ull) >> 20) & (slots.size() - 1);
+    }
+
+    void place(uint32_t code) {
+        size_t pos = home(values[code]);
+        while (slots[pos] != 0) {
+            pos = (pos + 1) & (slots.size() - 1);
+        }
+        slots[pos] = code + 1;
+    }
+
+public:
+    uint32_t encode(PooledString value) {
+        if (!slots.empty()) {
+            for (size_t pos = home(value); slots[pos] != 0; pos = (pos + 1) & (slots.size() - 1)) {
+                if (values[slots[pos] - 1] == value) {
+                    return slots[pos] - 1;
+                }
+            }
+        }
+        uint32_t code = (uint32_t)values.size();
+        values.push_back(value);
+        if (values.size() * 2 > slots.size()) {
+            slots.assign(max<size_t>(64, slots.size() * 2), 0);
+            for (uint32_t c = 0; c < values.size(); c++) {
+                place(c);
+            }
+        } else {
+            place(code);
+        }
+        return code;
+    }
+
+    PooledString decode(uint32_t code) const {
+        return values[code];
+    }
+
+    size_t size() const {
+        return values.size();
+    }
+
+    void clear() {
+        slots.clear();
+        values.clear();
+    }
+};
+
+// Parallel building blocks for the analytics reports
+size_t hardwareThreads() {
+    return max<size_t>(1, thread::hardware_concurrency());
+}
+
+// Split [0, n) into parts contiguous ranges and run work(part, begin, end)
+// for each, one per thread; part 0 runs on the calling thread
+template <typename Work>
+void parallelParts(size_t n, size_t parts, Work work) {
+    vector<thread> helpers;
+    for (size_t part = 1; part < parts; part++) {
+        helpers.emplace_back([&work, n, parts, part] { work(part, n * part / parts, n * (part + 1) / parts); });
+    }
+    work(0, 0, parts > 0 ? n / parts : n);
+    for (auto& helper : helpers) {
+        helper.join();
+    }
+}
+
+// Sort runs of the vector on separate threads, then merge neighbouring
+// runs pairwise, also in parallel, until one run is left
+template <typename T, typename Less>
+void parallelSort(vector<T>& items, Less less) {
+    const size_t MIN_RUN = 1 << 15;
+    size_t parts = 1;
+    while (parts * 2 <= hardwareThreads() && items.size() / (parts * 2) >= MIN_RUN) {
+        parts *= 2;
+    }
+    vector<size_t> bounds(parts + 1);
+    for (size_t i = 0; i <= parts; i++) {
+        bounds[i] = items.size() * i / parts;
+    }
+    parallelParts(parts, parts, [&](size_t, size_t first, size_t last) {
+        for (size_t run = first; run < last; run++) {
+            sort(items.begin() + bounds[run], items.begin() + bounds[run + 1], less);
+        }
+    });
+    for (size_t width = 1; width < parts; width *= 2) {
+        size_t merges = parts / (2 * width);
+        parallelParts(merges, merges, [&](size_t, size_t first, size_t last) {
+            for (size_t m = first; m < last; m++) {
+                size_t run = m * 2 * width;
+                inplace_merge(items.begin() + bounds[run], items.begin() + bounds[run + width],
+                              items.begin() + bounds[run + 2 * width], less);
+            }
+        });
+    }
+}
+
+// Sales figures for one group of a report: a book, customer, category or
+// period
+struct GroupTotal {
+    Money revenue;
+    int64_t units = 0;
+    uint64_t orders = 0;
+    int64_t first = INT64_MAX;      // time of the earliest and latest sale
+    int64_t last = INT64_MIN;
+
+    void add(Money amount, int32_t quantity, int64_t when) {
+        revenue += amount;
+        units += quantity;
+        orders++;
+        first = min(first, when);
+        last = max(last, when);
+    }
+
+    void merge(const GroupTotal& other) {
+        revenue += other.revenue;
+        units += other.units;
+        orders += other.orders;
+        first = min(first, other.first);
+        last = max(last, other.last);
+    }
+};
+
+// Summary figures over a set of sales
+struct SalesTotals {
+    size_t count;
+    int64_t units;
+    Money revenue;
+    Money minAmount;
+    Money maxAmount;
+};
+
+// Full-history figures for the sales summary: the totals, and the book and
+// customer with the most revenue
+struct SalesSummary {
+    SalesTotals totals = {0, 0, Money(), Money(), Money()};
+    PooledString topBook;
+    Money topBookRevenue;
+    int64_t topBookUnits = 0;
+    PooledString topCustomer;
+    Money topCustomerRevenue;
+};
+
+// Row numbers in time order, in blocks of up to BLOCK_ROWS. Sales arrive
+// in time order, so a row is almost always added to the last block. One
+// from a clock that stepped back goes into a copy of the one block it
+// falls in, split if full, under a new table of blocks that shares all the
+// others; that costs a block and the table rather than the whole index.
+// Readers keep the table they were given, which is left as it was.
+class TimeIndex {
+public:
+    static const size_t BLOCK_ROWS = 1 << 12;
+
+private:
+    struct Table {
+        StableColumn<uint32_t*> blocks;
+        StableColumn<size_t> starts;    // position of each block's first row
+    };
+
+    unique_ptr<Table> table;
+    size_t length;
+
+    void freeBlocks() {
+        for (size_t k = 0; k < table->blocks.size(); k++) {
+            delete[] table->blocks[k];
+        }
+    }
+
+public:
+    // A table and block an insert took out of use, for release() once no
+    // reader can still see them; the table's other blocks live on
+    struct Replaced {
+        Table* table = nullptr;
+        uint32_t* block = nullptr;
+
+        explicit operator bool() const {
+            return table != nullptr;
+        }
+
+        void release() const {
+            delete table;
+            delete[] block;
+        }
+    };
+
+    // The first rows of the index as it was when taken; copies are cheap
+    // and reads take no lock while rows are added
+    class Reader {
+    private:
+        const Table* table;
+        size_t rows;
+        size_t blockCount;
+
+        // Last block starting at or before position
+        size_t blockOf(size_t position) const {
+            size_t low = 0, high = blockCount;
+            while (low < high) {
+                size_t middle = low + (high - low) / 2;
+                if (table->starts[middle] <= position) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            return low - 1;
+        }
+
+        size_t blockEnd(size_t k) const {
+            return k + 1 < blockCount ? table->starts[k + 1] : rows;
+        }
+
+    public:
+        Reader(const Table* index, size_t length)
+            : table(index), rows(length), blockCount(index->blocks.size()) {}
+
+        size_t size() const {
+            return rows;
+        }
+
+        uint32_t operator[](size_t position) const {
+            size_t k = blockOf(position);
+            return table->blocks[k][position - table->starts[k]];
+        }
+
+        // First position from 'first' on whose row is not before(row); the
+        // rows before() holds for come first
+        template <typename Before>
+        size_t partitionPoint(size_t first, Before before) const {
+            if (first >= rows) {
+                return rows;
+            }
+            size_t low = blockOf(first), high = blockCount;
+            while (low < high) {
+                size_t middle = low + (high - low) / 2;
+                if (before(table->blocks[middle][blockEnd(middle) - 1 - table->starts[middle]])) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+            if (low == blockCount) {
+                return rows;
+            }
+            const uint32_t* block = table->blocks[low];
+            size_t start = table->starts[low];
+            return start + (partition_point(block + (max(first, start) - start), block + (blockEnd(low) - start), before) - block);
+        }
+
+        // Call visit(row) for positions [first, last), a block at a time
+        template <typename Visit>
+        void forEach(size_t first, size_t last, Visit visit) const {
+            for (size_t k = first < last ? blockOf(first) : 0; first < last; k++) {
+                const uint32_t* block = table->blocks[k];
+                size_t start = table->starts[k];
+                for (size_t end = min(last, blockEnd(k)); first < end; first++) {
+                    visit(block[first - start]);
+                }
+            }
+        }
+    };
+
+    TimeIndex() : table(new Table()), length(0) {}
+
+    ~TimeIndex() {
+        freeBlocks();
+    }
+
+    TimeIndex(const TimeIndex&) = delete;
+    TimeIndex& operator=(const TimeIndex&) = delete;
+
+    // No readers may be left
+    void clear() {
+        freeBlocks();
+        table.reset(new Table());
+        length = 0;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    uint32_t back() const {
+        size_t last = table->blocks.size() - 1;
+        return table->blocks[last][length - 1 - table->starts[last]];
+    }
+
+    void push_back(uint32_t row) {
+        size_t blocks = table->blocks.size();
+        if (blocks == 0 || length - table->starts[blocks - 1] == BLOCK_ROWS) {
+            table->blocks.push_back(new uint32_t[BLOCK_ROWS]);
+            table->starts.push_back(length);
+            blocks++;
+        }
+        table->blocks[blocks - 1][length - table->starts[blocks - 1]] = row;
+        length++;
+    }
+
+    // Put row at a position below size(); the rows from there on move up one
+    Replaced insert(size_t position, uint32_t row) {
+        unique_ptr<Table> next(new Table());
+        size_t blocks = table->blocks.size();
+        size_t target = 0;
+        while (target + 1 < blocks && table->starts[target + 1] <= position) {
+            target++;
+        }
+        for (size_t k = 0; k < blocks; k++) {
+            if (k != target) {
+                next->blocks.push_back(table->blocks[k]);
+                next->starts.push_back(table->starts[k] + (k > target ? 1 : 0));
+                continue;
+            }
+            size_t start = table->starts[k];
+            size_t end = k + 1 < blocks ? table->starts[k + 1] : length;
+            vector<uint32_t> rows(table->blocks[k], table->blocks[k] + (end - start));
+            rows.insert(rows.begin() + (position - start), row);
+            size_t half = rows.size() > BLOCK_ROWS ? (rows.size() + 1) / 2 : rows.size();
+            for (size_t from = 0; from < rows.size(); from += half) {
+                uint32_t* block = new uint32_t[BLOCK_ROWS];
+                copy(rows.begin() + from, rows.begin() + min(rows.size(), from + half), block);
+                next->blocks.push_back(block);
+                next->starts.push_back(start + from);
+            }
+        }
+        Replaced replaced;
+        replaced.block = table->blocks[target];
+        replaced.table = table.release();
+        table = move(next);
+        length++;
+        return replaced;
+    }
+
+    // The rows there are now; callers hold the lock guarding the appends
+    Reader reader() const {
+        return Reader(table.get(), length);
+    }
+};
+
+// Column-oriented copy of the sales history used for aggregation, so
+// reports touch only the numbers they add up instead of whole Sale rows.
+// Rows are in the same order as the sales vector. Columns are only ever
+// appended to, so reports read them through a View of the rows there were
+// when it was taken, while sales go on being appended.
+class SalesColumns {
+private:
+    StableColumn<int32_t> quantity;
+    StableColumn<int64_t> amount;     // in cents
+    StableColumn<int64_t> time;
+    StableColumn<uint32_t> bookCode;
+    StableColumn<uint32_t> customerCode;
+    StringDictionary books;
+    StringDictionary customers;
+    TimeIndex byTime;
+    // Running totals, so a view has them without a scan
+    int64_t unitCount;
+    Money revenueTotal;
+
+    // Add a row's values, leaving the time index alone
+    uint32_t appendValues(const Sale& sale) {
+        uint32_t row = (uint32_t)time.size();
+        quantity.push_back(sale.quantity);
+        amount.push_back(sale.totalAmount.cents());
+        time.push_back(sale.date);
+        bookCode.push_back(books.encode(sale.bookId));
+        customerCode.push_back(customers.encode(sale.customerName));
+        unitCount += sale.quantity;
+        revenueTotal += sale.totalAmount;
+        return row;
+    }
+
+    // Add a row; returns what the time index replaced, if the row was out
+    // of order. It goes after the sales made at the same time, as an
+    // append would have put it
+    TimeIndex::Replaced appendRow(const Sale& sale) {
+        uint32_t row = appendValues(sale);
+        if (byTime.size() == 0 || time[byTime.back()] <= sale.date) {
+            byTime.push_back(row);
+            return TimeIndex::Replaced();
+        }
+        size_t position = byTime.reader().partitionPoint(0, [&](uint32_t other) { return time[other] <= sale.date; });
+        return byTime.insert(position, row);
+    }
+
+public:
+    class View;
+
+    SalesColumns() : unitCount(0) {}
+
+    // No views may be open
+    void clear() {
+        quantity.clear();
+        amount.clear();
+        time.clear();
+        bookCode.clear();
+        customerCode.clear();
+        books.clear();
+        customers.clear();
+        byTime.clear();
+        unitCount = 0;
+        revenueTotal = Money();
+    }
+
+    // What the time index replaced is retired, so views still reading it
+    // keep it
+    void append(const Sale& sale, EpochReclaimer& epochs) {
+        TimeIndex::Replaced replaced = appendRow(sale);
+        if (replaced) {
+            epochs.retire([replaced] { replaced.release(); });
+        }
+    }
+
+    // No views may be open. The time index is sorted once, rather than
+    // copied for every sale out of order, with ties kept in row order as
+    // appends would have
+    void rebuild(const SalesHistory& sales) {
+        clear();
+        for (const auto& sale : sales) {
+            appendValues(sale);
+        }
+        vector<uint32_t> order(size());
+        iota(order.begin(), order.end(), 0);
+        stable_sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) { return time[a] < time[b]; });
+        for (uint32_t row : order) {
+            byTime.push_back(row);
+        }
+    }
+
+    // Give books and customers codes in this order before any rows are
+    // added, e.g. to match a segment's dictionary; no views may be open
+    void presetCodes(const vector<PooledString>& bookIds, const vector<PooledString>& customerNames) {
+        for (const auto& id : bookIds) {
+            books.encode(id);
+        }
+        for (const auto& name : customerNames) {
+            customers.encode(name);
+        }
+    }
+
+    // No views may be open
+    void appendUnseen(const Sale& sale) {
+        appendRow(sale).release();
+    }
+
+    size_t size() const {
+        return amount.size();
+    }
+
+    // The rows there are now; callers hold the lock guarding the appends
+    View view() const;
+};
+
+// Read-only view of the first rows of a SalesColumns. Copies are cheap and
+// every read takes no lock; the time index table it holds must stay alive,
+// which the epochs take care of while the view's reader stays pinned.
+class SalesColumns::View {
+private:
+    const SalesColumns* columns;
+    TimeIndex::Reader byTime;
+    size_t rows;
+    size_t bookEntries;
+    size_t customerEntries;
+    int64_t unitCount;
+    Money revenueTotal;
+
+    bool rowBefore(uint32_t row, int64_t when) const {
+        return columns->time[row] < when;
+    }
+
+    // First position in time order from 'first' on of a sale made at or
+    // after 'when'
+    size_t lowerBound(size_t first, int64_t when) const {
+        return byTime.partitionPoint(first, [&](uint32_t row) { return rowBefore(row, when); });
+    }
+
+    // Rows below this many are not worth another thread
+    static const size_t MIN_PART_ROWS = 1 << 16;
+
+    // Call visit(part, row) for every sale made in [from, to), split into
+    // at most maxParts runs that each get a thread. Rows are visited in
+    // time order when asked or when the range is bounded, otherwise in
+    // stored order. Returns the number of runs used.
+    template <typename Visit>
+    size_t scanInParallel(int64_t from, int64_t to, size_t maxParts, bool inTimeOrder, Visit visit) const {
+        bool everything = !inTimeOrder && from == INT64_MIN && to == INT64_MAX;
+        pair<size_t, size_t> range = everything ? make_pair<size_t, size_t>(0, size()) : timeRange(from, to);
+        size_t count = range.second - range.first;
+        size_t parts = max<size_t>(1, min(maxParts, count / MIN_PART_ROWS));
+        METRIC_ADD(RecordsScanned, count);
+        parallelParts(count, parts, [&](size_t part, size_t begin, size_t end) {
+            if (everything) {
+                for (size_t i = begin; i < end; i++) {
+                    visit(part, (uint32_t)i);
+                }
+            } else {
+                byTime.forEach(range.first + begin, range.first + end, [&](uint32_t row) { visit(part, row); });
+            }
+        });
+        return parts;
+    }
+
+public:
+    explicit View(const SalesColumns& owner)
+        : columns(&owner), byTime(owner.byTime.reader()), rows(owner.size()), bookEntries(owner.books.size()),
+          customerEntries(owner.customers.size()), unitCount(owner.unitCount), revenueTotal(owner.revenueTotal) {}
+
+    size_t size() const {
+        return rows;
+    }
+
+    int64_t units() const {
+        return unitCount;
+    }
+
+    Money revenue() const {
+        return revenueTotal;
+    }
+
+    // Positions [first, last) in time order of the sales made from 'from'
+    // up to but not including 'to'; see rowInTimeOrder()
+    pair<size_t, size_t> timeRange(int64_t from, int64_t to) const {
+        size_t first = lowerBound(0, from);
+        return {first, lowerBound(first, max(from, to))};
+    }
+
+    uint32_t rowInTimeOrder(size_t position) const {
+        return byTime[position];
+    }
+
+    int64_t timeAt(size_t position) const {
+        return columns->time[byTime[position]];
+    }
+
+    // First position in time order of a sale made at or after 'when'
+    size_t positionOf(int64_t when) const {
+        return lowerBound(0, when);
+    }
+
+    // Sums and extremes, a contiguous run of each column at a time
+    SalesTotals totals() const {
+        METRIC_ADD(RecordsScanned, rows);
+        SalesTotals result = {rows, 0, Money(), Money(), Money()};
+        int64_t cents = 0;
+        int64_t smallest = INT64_MAX, largest = INT64_MIN;
+        ColumnChunks::runs(0, rows, [&](size_t first, size_t count) {
+            result.units += sumInt32(columns->quantity.at(first), count);
+            cents += sumInt64(columns->amount.at(first), count);
+            int64_t low = 0, high = 0;
+            minMaxInt64(columns->amount.at(first), count, low, high);
+            smallest = min(smallest, low);
+            largest = max(largest, high);
+        });
+        result.revenue = Money::fromCents(cents);
+        if (rows > 0) {
+            result.minAmount = Money::fromCents(smallest);
+            result.maxAmount = Money::fromCents(largest);
+        }
+        return result;
+    }
+
+    // Revenue in cents and units per book, indexed by bookCode; see bookId()
+    void revenueByBook(vector<int64_t>& revenue, vector<int64_t>& units) const {
+        METRIC_ADD(RecordsScanned, rows);
+        revenue.assign(bookEntries, 0);
+        units.assign(bookEntries, 0);
+        ColumnChunks::runs(0, rows, [&](size_t first, size_t count) {
+            groupSum(columns->bookCode.at(first), columns->amount.at(first), count, revenue);
+            groupSum(columns->bookCode.at(first), columns->quantity.at(first), count, units);
+        });
+    }
+
+    // Revenue in cents per customer, indexed by customerCode; see customerName()
+    void revenueByCustomer(vector<int64_t>& revenue) const {
+        METRIC_ADD(RecordsScanned, rows);
+        revenue.assign(customerEntries, 0);
+        ColumnChunks::runs(0, rows, [&](size_t first, size_t count) {
+            groupSum(columns->customerCode.at(first), columns->amount.at(first), count, revenue);
+        });
+    }
+
+    PooledString bookId(uint32_t code) const {
+        return columns->books.decode(code);
+    }
+
+    PooledString customerName(uint32_t code) const {
+        return columns->customers.decode(code);
+    }
+
+    size_t bookCount() const {
+        return bookEntries;
+    }
+
+    size_t customerCount() const {
+        return customerEntries;
+    }
+
+    uint32_t bookCodeOf(uint32_t row) const {
+        return columns->bookCode[row];
+    }
+
+    uint32_t customerCodeOf(uint32_t row) const {
+        return columns->customerCode[row];
+    }
+
+    // Totals per group over the sales made in [from, to); groupOf(row)
+    // gives a row's group in [0, groups). Each thread adds into its own
+    // dense table and the tables are merged at the end. Threads are capped
+    // so the tables stay within a fixed memory budget.
+    template <typename GroupOf>
+    vector<GroupTotal> groupTotals(int64_t from, int64_t to, size_t groups, GroupOf groupOf) const {
+        const size_t TABLE_BUDGET = size_t(256) << 20;
+        size_t maxParts = min(hardwareThreads(), max<size_t>(1, TABLE_BUDGET / max<size_t>(1, groups * sizeof(GroupTotal))));
+        vector<vector<GroupTotal>> partials(maxParts);
+        size_t parts = scanInParallel(from, to, maxParts, false, [&](size_t part, uint32_t row) {
+            vector<GroupTotal>& table = partials[part];
+            if (table.empty()) {
+                table.resize(groups);
+            }
+            table[groupOf(row)].add(Money::fromCents(columns->amount[row]), columns->quantity[row], columns->time[row]);
+        });
+        vector<GroupTotal> totals = move(partials[0]);
+        totals.resize(groups);
+        for (size_t part = 1; part < parts; part++) {
+            for (size_t g = 0; g < partials[part].size(); g++) {
+                totals[g].merge(partials[part][g]);
+            }
+        }
+        return totals;
+    }
+
+    // Totals per time bucket over the sales made in [from, to), keyed by
+    // the bucket's start. bucketOf(time) is copied into every thread, so
+    // it can cache the bounds of the last bucket it saw; rows are walked in
+    // time order so that cache almost always hits. Each thread keeps a hash
+    // table of its buckets; they are merged in time order.
+    template <typename BucketOf>
+    map<int64_t, GroupTotal> bucketTotals(int64_t from, int64_t to, BucketOf bucketOf) const {
+        size_t maxParts = hardwareThreads();
+        vector<unordered_map<int64_t, GroupTotal>> partials(maxParts);
+        vector<BucketOf> bucketers(maxParts, bucketOf);
+        size_t parts = scanInParallel(from, to, maxParts, true, [&](size_t part, uint32_t row) {
+            int64_t when = columns->time[row];
+            partials[part][bucketers[part](when)].add(Money::fromCents(columns->amount[row]), columns->quantity[row], when);
+        });
+        map<int64_t, GroupTotal> totals;
+        for (size_t part = 0; part < parts; part++) {
+            for (const auto& bucket : partials[part]) {
+                totals[bucket.first].merge(bucket.second);
+            }
+        }
+        return totals;
+    }
+};
+
+inline SalesColumns::View SalesColumns::view() const {
+    return View(*this);
+}
+
+// Timestamps are seconds since the epoch. Files written before that were
+// kept ctime()-style local text ("Sat Oct 17 19:13:39 2026") and are
+// converted when read.
+tm localTime(int64_t timestamp) {
+    time_t seconds = (time_t)timestamp;
+    struct tm local;
+    #ifdef _WIN32
+        localtime_s(&local, &seconds);
+    #else
+        localtime_r(&seconds, &local);
+    #endif
+    return local;
+}
+
+// mktime() re-reads the time zone on every call, which thread sanitizers
+// report when sales shards or report threads call it together; the callers
+// cache what it returns, so one lock costs nothing
+int64_t makeLocalTime(struct tm& local) {
+    static mutex timeZoneMutex;
+    lock_guard<mutex> lock(timeZoneMutex);
+    return (int64_t)mktime(&local);
+}
+
+// Same layout as ctime() without the newline; safe from several threads
+string formatTimestamp(int64_t timestamp) {
+    tm local = localTime(timestamp);
+    char text[32];
+    size_t length = strftime(text, sizeof(text), "%a %b %e %H:%M:%S %Y", &local);
+    return string(text, length);
+}
+
+// Accepts epoch seconds or the old ctime() text
+bool parseTimestamp(string_view text, int64_t& timestamp) {
+    if (parseNumber(text, timestamp)) {
+        return true;
+    }
+    static const char* MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    char month[4] = {0};
+    char buffer[64];
+    size_t length = min(text.size(), sizeof(buffer) - 1);
+    memcpy(buffer, text.data(), length);
+    buffer[length] = '\0';
+    struct tm local;
+    memset(&local, 0, sizeof(local));
+    if (sscanf(buffer, "%*3s %3s %d %d:%d:%d %d", month, &local.tm_mday, &local.tm_hour,
+               &local.tm_min, &local.tm_sec, &local.tm_year) != 6) {
+        return false;
+    }
+    local.tm_mon = -1;
+    for (int m = 0; m < 12; m++) {
+        if (strcmp(month, MONTHS[m]) == 0) {
+            local.tm_mon = m;
+        }
+    }
+    if (local.tm_mon < 0) {
+        return false;
+    }
+
+    // mktime is slow and legacy files hold many records from the same day,
+    // so midnight of the last day seen is remembered
+    thread_local int cachedYear = -1, cachedMonth = -1, cachedDay = -1;
+    thread_local int64_t cachedMidnight = 0;
+    if (local.tm_year != cachedYear || local.tm_mon != cachedMonth || local.tm_mday != cachedDay) {
+        struct tm midnight = local;
+        midnight.tm_year -= 1900;
+        midnight.tm_hour = midnight.tm_min = midnight.tm_sec = 0;
+        midnight.tm_isdst = -1;
+        cachedMidnight = makeLocalTime(midnight);
+        cachedYear = local.tm_year;
+        cachedMonth = local.tm_mon;
+        cachedDay = local.tm_mday;
+    }
+    timestamp = cachedMidnight + local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+    return true;
+}
+
+// "YYYY-MM-DD" of a timestamp in local time
+string dayKey(int64_t timestamp) {
+    tm local = localTime(timestamp);
+    char key[40];
+    snprintf(key, sizeof(key), "%04d-%02d-%02d", local.tm_year + 1900, local.tm_mon + 1, local.tm_mday);
+    return key;
+}
+
+// Local midnight at the start of the day a timestamp falls on, moved by
+// offset days; days are not all 24 hours where clocks change
+int64_t startOfDay(int64_t timestamp, int offset = 0) {
+    struct tm day = localTime(timestamp);
+    day.tm_mday += offset;
+    day.tm_hour = day.tm_min = day.tm_sec = 0;
+    day.tm_isdst = -1;
+    return makeLocalTime(day);
+}
+
+// Local midnight at the start of a "YYYY-MM-DD" day
+bool parseDay(string_view text, int64_t& timestamp) {
+    int year, month, day;
+    string buffer(text);
+    char extra;
+    if (sscanf(buffer.c_str(), "%d-%d-%d%c", &year, &month, &day, &extra) != 3 ||
+        month < 1 || month > 12 || day < 1 || day > 31) {
+        return false;
+    }
+    struct tm local;
+    memset(&local, 0, sizeof(local));
+    local.tm_year = year - 1900;
+    local.tm_mon = month - 1;
+    local.tm_mday = day;
+    local.tm_isdst = -1;
+    timestamp = makeLocalTime(local);
+    return true;
+}
+
+// dayKey() for a stream of timestamps. The bounds of the last day seen are
+// kept, since consecutive sales nearly always fall on the same day.
+class DayKeys {
+private:
+    int64_t dayStart;
+    int64_t dayEnd;
+    string key;
+
+public:
+    DayKeys() : dayStart(1), dayEnd(0) {}
+
+    const string& of(int64_t timestamp) {
+        if (timestamp < dayStart || timestamp >= dayEnd) {
+            key = dayKey(timestamp);
+            dayStart = startOfDay(timestamp);
+            dayEnd = startOfDay(timestamp, 1);
+        }
+        return key;
+    }
+};
+
+// Start of the local day or month a timestamp falls in, caching the bounds
+// of the last one found
+class CalendarBuckets {
+private:
+    bool monthly;
+    int64_t bucketStart;
+    int64_t bucketEnd;
+
+public:
+    explicit CalendarBuckets(bool byMonth) : monthly(byMonth), bucketStart(1), bucketEnd(0) {}
+
+    int64_t operator()(int64_t timestamp) {
+        if (timestamp < bucketStart || timestamp >= bucketEnd) {
+            tm start = localTime(timestamp);
+            start.tm_hour = start.tm_min = start.tm_sec = 0;
+            start.tm_isdst = -1;
+            if (monthly) {
+                start.tm_mday = 1;
+            }
+            tm end = start;
+            if (monthly) {
+                end.tm_mon++;
+            } else {
+                end.tm_mday++;
+            }
+            bucketStart = makeLocalTime(start);
+            bucketEnd = makeLocalTime(end);
+        }
+        return bucketStart;
+    }
+
+    string label(int64_t start) const {
+        string day = dayKey(start);
+        return monthly ? day.substr(0, 7) : day;
+    }
+};
+
+// Units and revenue for one book
+struct BookSalesTotal {
+    int64_t units;
+    Money revenue;
+};
+
+// Running sales figures, updated with every recorded sale so dashboards
+// never rescan the history
+class SalesAggregates {
+private:
+    size_t saleCount;
+    int64_t totalUnits;
+    Money totalRevenue;
+    unordered_map<PooledString, BookSalesTotal> perBook;
+    map<string, Money> revenuePerDay;
+    // Ordered by units sold, most first, for top-N lookups
+    set<pair<int64_t, PooledString>, greater<pair<int64_t, PooledString>>> bestsellers;
+    DayKeys days;
+
+public:
+    SalesAggregates() : saleCount(0), totalUnits(0) {}
+
+    void clear() {
+        saleCount = 0;
+        totalUnits = 0;
+        totalRevenue = Money();
+        perBook.clear();
+        revenuePerDay.clear();
+        bestsellers.clear();
+    }
+
+    void apply(const Sale& sale) {
+        addTotals(1, sale.quantity, sale.totalAmount);
+        addDay(days.of(sale.date), sale.totalAmount);
+        addBook(sale.bookId, sale.quantity, sale.totalAmount);
+    }
+
+    // The bestseller order is built once from the final totals rather than
+    // moved with every sale
+    void rebuild(const SalesHistory& sales) {
+        clear();
+        for (const auto& sale : sales) {
+            addTotals(1, sale.quantity, sale.totalAmount);
+            addDay(days.of(sale.date), sale.totalAmount);
+            BookSalesTotal& book = perBook[sale.bookId];
+            book.units += sale.quantity;
+            book.revenue += sale.totalAmount;
+        }
+        for (const auto& entry : perBook) {
+            bestsellers.insert({entry.second.units, entry.first});
+        }
+    }
+
+    // Sales known only by their totals, e.g. from a sealed segment's
+    // summary, are added in parts: overall, then per book and per day
+    void addTotals(size_t sales, int64_t units, Money revenue) {
+        saleCount += sales;
+        totalUnits += units;
+        totalRevenue += revenue;
+    }
+
+    void addBook(PooledString bookId, int64_t units, Money revenue) {
+        BookSalesTotal& book = perBook[bookId];
+        if (book.units > 0) {
+            bestsellers.erase({book.units, bookId});
+        }
+        book.units += units;
+        book.revenue += revenue;
+        bestsellers.insert({book.units, bookId});
+    }
+
+    void addDay(const string& day, Money revenue) {
+        revenuePerDay[day] += revenue;
+    }
+
+    size_t count() const {
+        return saleCount;
+    }
+
+    int64_t units() const {
+        return totalUnits;
+    }
+
+    Money revenue() const {
+        return totalRevenue;
+    }
+
+    BookSalesTotal bookTotal(PooledString bookId) const {
+        auto it = perBook.find(bookId);
+        return it == perBook.end() ? BookSalesTotal{0, Money()} : it->second;
+    }
+
+    Money revenueOn(const string& day) const {
+        auto it = revenuePerDay.find(day);
+        return it == revenuePerDay.end() ? Money() : it->second;
+    }
+
+    const map<string, Money>& dailyRevenue() const {
+        return revenuePerDay;
+    }
+
+    // The n best-selling books as (units, book id), most units first
+    vector<pair<int64_t, PooledString>> topSellers(size_t n) const {
+        vector<pair<int64_t, PooledString>> top;
+        for (auto it = bestsellers.begin(); it != bestsellers.end() && top.size() < n; ++it) {
+            top.push_back(*it);
+        }
+        return top;
+    }
+
+    // Compare against a full recomputation; mismatches are described in
+    // problems. Amounts are in cents, so every figure must match exactly.
+    bool verify(const SalesAggregates& expected, vector<string>& problems) const {
+
+        if (saleCount != expected.saleCount) {
+            problems.push_back("sale count " + to_string(saleCount) + " != " + to_string(expected.saleCount));
+        }
+        if (totalUnits != expected.totalUnits) {
+            problems.push_back("units " + to_string(totalUnits) + " != " + to_string(expected.totalUnits));
+        }
+        if (totalRevenue != expected.totalRevenue) {
+            problems.push_back("revenue " + totalRevenue.str() + " != " + expected.totalRevenue.str());
+        }
+        if (perBook.size() != expected.perBook.size()) {
+            problems.push_back("books with sales " + to_string(perBook.size()) + " != " + to_string(expected.perBook.size()));
+        }
+        for (const auto& entry : expected.perBook) {
+            BookSalesTotal actual = bookTotal(entry.first);
+            if (actual.units != entry.second.units || actual.revenue != entry.second.revenue) {
+                problems.push_back("totals for book " + entry.first.str());
+            }
+        }
+        if (revenuePerDay.size() != expected.revenuePerDay.size()) {
+            problems.push_back("days with sales " + to_string(revenuePerDay.size()) + " != " + to_string(expected.revenuePerDay.size()));
+        }
+        for (const auto& entry : expected.revenuePerDay) {
+            if (revenueOn(entry.first) != entry.second) {
+                problems.push_back("revenue on " + entry.first);
+            }
+        }
+        if (bestsellers != expected.bestsellers) {
+            problems.push_back("bestseller ranking");
+        }
+        return problems.empty();
+    }
+};
+
+// Analytics reports over the sales history
+enum class SalesReport { TopBooks, Categories, Customers, Daily, Monthly };
+
+// A finished report: column names and formatted cells, ready to print or
+// export
+struct ReportTable {
+    string title;
+    vector<string> columns;
+    vector<vector<string>> rows;
+
+    // RFC 4180 text: cells with commas, quotes or line breaks are quoted
+    string csv() const {
+        string text;
+        auto appendRow = [&text](const vector<string>& cells) {
+            for (size_t i = 0; i < cells.size(); i++) {
+                if (i > 0) {
+                    text += ',';
+                }
+                if (cells[i].find_first_of(",\"\r\n") == string::npos) {
+                    text += cells[i];
+                    continue;
+                }
+                text += '"';
+                for (char c : cells[i]) {
+                    text += c;
+                    if (c == '"') {
+                        text += '"';
+                    }
+                }
+                text += '"';
+            }
+            text += "\r\n";
+        };
+        appendRow(columns);
+        for (const auto& row : rows) {
+            appendRow(row);
+        }
+        return text;
+    }
+};
+
+// One search hit: the book and how well it matched
+struct SearchResult {
+    PooledString bookId;
+    uint32_t score;
+};
+
+// Inverted index over the words of each book's title, author and category.
+// Every query word must match (AND); a word matches index terms it is a
+// prefix of. Hits are ranked by field weight, with whole-word matches
+// counting double. A word is expanded to at most MAX_EXPANSION postings,
+// so one or two typed characters cost no more than a common word. Books
+// are added, replaced and removed one at a time, so the index follows the
+// catalogue without being rebuilt.
+class SearchIndex {
+private:
+    struct Posting {
+        uint32_t doc;
+        uint32_t weight;
+    };
+    typedef map<string, vector<Posting>> TermMap;
+
+    static const uint32_t TITLE_WEIGHT = 3;
+    static const uint32_t AUTHOR_WEIGHT = 2;
+    static const uint32_t CATEGORY_WEIGHT = 1;
+    // Postings a query word is expanded to at most. A broader word is
+    // checked against the hits of the other words instead, or, when every
+    // word is that broad, ranked over its first MAX_EXPANSION postings
+    // with the whole term first.
+    static const size_t MAX_EXPANSION = 1 << 12;
+    // Hits are looked up one by one when a word has this many times more
+    // postings than there are hits
+    static const size_t PROBE_RATIO = 16;
+
+    // Sorted term dictionary, so a prefix is a contiguous range
+    TermMap terms;
+    // Documents are numbered once per book id and reused when it returns
+    unordered_map<PooledString, uint32_t> docOf;
+    vector<PooledString> bookOf;
+    vector<vector<TermMap::iterator>> termsOf;
+
+    static void addTokens(string_view text, uint32_t weight, map<string, uint32_t>& weights) {
+        string token;
+        for (size_t i = 0; i <= text.size(); i++) {
+            unsigned char c = i < text.size() ? (unsigned char)text[i] : ' ';
+            if (isalnum(c) || c >= 0x80) {
+                token += (char)tolower(c);
+            } else if (!token.empty()) {
+                weights[token] += weight;
+                token.clear();
+            }
+        }
+    }
+
+    void removeDoc(uint32_t doc) {
+        for (auto term : termsOf[doc]) {
+            vector<Posting>& postings = term->second;
+            auto it = lower_bound(postings.begin(), postings.end(), doc,
+                                  [](const Posting& p, uint32_t d) { return p.doc < d; });
+            if (it != postings.end() && it->doc == doc) {
+                postings.erase(it);
+            }
+            if (postings.empty()) {
+                terms.erase(term);
+            }
+        }
+        termsOf[doc].clear();
+    }
+
+    static bool matchesTerm(const string& word, const string& term) {
+        return term.compare(0, word.size(), word) == 0;
+    }
+
+    // Postings behind a query word, once per matching term; counting stops
+    // past MAX_EXPANSION, so a broad word costs no more than that
+    size_t postingCount(const string& word) const {
+        size_t count = 0;
+        for (auto it = terms.lower_bound(word);
+             it != terms.end() && count <= MAX_EXPANSION && matchesTerm(word, it->first); ++it) {
+            count += it->second.size();
+        }
+        return count;
+    }
+
+    // Matches for one query word as (doc, score), sorted by doc, from at
+    // most MAX_EXPANSION postings. The whole term sorts first among the
+    // terms it prefixes, so it is the one always taken in full.
+    vector<Posting> matchWord(const string& word) const {
+        vector<Posting> matches;
+        // Each term's postings are in doc order already; they are copied
+        // one after another and merged pairwise
+        vector<size_t> runs = {0};
+        for (auto it = terms.lower_bound(word);
+             it != terms.end() && matches.size() < MAX_EXPANSION && matchesTerm(word, it->first); ++it) {
+            uint32_t factor = it->first.size() == word.size() ? 2 : 1;
+            size_t take = min(it->second.size(), MAX_EXPANSION - matches.size());
+            for (size_t p = 0; p < take; p++) {
+                matches.push_back({it->second[p].doc, it->second[p].weight * factor});
+            }
+            runs.push_back(matches.size());
+        }
+        if (runs.size() <= 2) {
+            return matches;
+        }
+        auto byDoc = [](const Posting& a, const Posting& b) { return a.doc < b.doc; };
+        while (runs.size() > 2) {
+            vector<size_t> merged = {0};
+            for (size_t r = 2; r < runs.size(); r += 2) {
+                inplace_merge(matches.begin() + runs[r - 2], matches.begin() + runs[r - 1],
+                              matches.begin() + runs[r], byDoc);
+                merged.push_back(runs[r]);
+            }
+            if (runs.size() % 2 == 0) {
+                merged.push_back(runs.back());
+            }
+            runs.swap(merged);
+        }
+        // A word can prefix several terms of the same book; keep the best
+        size_t out = 0;
+        for (size_t i = 0; i < matches.size(); i++) {
+            if (out > 0 && matches[out - 1].doc == matches[i].doc) {
+                matches[out - 1].weight = max(matches[out - 1].weight, matches[i].weight);
+            } else {
+                matches[out++] = matches[i];
+            }
+        }
+        matches.resize(out);
+        return matches;
+    }
+
+    // First posting at or after doc, galloping from the last one found
+    // since the docs sought only increase
+    static vector<Posting>::const_iterator seek(vector<Posting>::const_iterator from,
+                                                vector<Posting>::const_iterator end, uint32_t doc) {
+        size_t step = 1;
+        while (step < (size_t)(end - from) && from[step - 1].doc < doc) {
+            from += step;
+            step *= 2;
+        }
+        return lower_bound(from, from + min(step, (size_t)(end - from)), doc,
+                           [](const Posting& p, uint32_t d) { return p.doc < d; });
+    }
+
+    // Score of one query word for one book, or 0 if it does not match;
+    // looks only at that book's own terms
+    uint32_t scoreWord(uint32_t doc, const string& word) const {
+        uint32_t best = 0;
+        for (auto term : termsOf[doc]) {
+            if (!matchesTerm(word, term->first)) {
+                continue;
+            }
+            const vector<Posting>& postings = term->second;
+            auto it = lower_bound(postings.begin(), postings.end(), doc,
+                                  [](const Posting& p, uint32_t d) { return p.doc < d; });
+            uint32_t factor = term->first.size() == word.size() ? 2 : 1;
+            best = max(best, it->weight * factor);
+        }
+        return best;
+    }
+
+public:
+    void clear() {
+        terms.clear();
+        docOf.clear();
+        bookOf.clear();
+        termsOf.clear();
+    }
+
+    // Index a new book or re-index a changed one
+    void add(const Book& book) {
+        uint32_t doc;
+        auto known = docOf.find(book.id);
+        if (known != docOf.end()) {
+            doc = known->second;
+            removeDoc(doc);
+        } else {
+            doc = (uint32_t)bookOf.size();
+            docOf.emplace(book.id, doc);
+            bookOf.push_back(book.id);
+            termsOf.emplace_back();
+        }
+
+        map<string, uint32_t> weights;
+        addTokens(book.title, TITLE_WEIGHT, weights);
+        addTokens(book.author, AUTHOR_WEIGHT, weights);
+        addTokens(book.category, CATEGORY_WEIGHT, weights);
+        for (const auto& entry : weights) {
+            auto term = terms.emplace(entry.first, vector<Posting>()).first;
+            vector<Posting>& postings = term->second;
+            if (postings.empty() || postings.back().doc < doc) {
+                postings.push_back({doc, entry.second});
+            } else {
+                auto it = lower_bound(postings.begin(), postings.end(), doc,
+                                      [](const Posting& p, uint32_t d) { return p.doc < d; });
+                postings.insert(it, {doc, entry.second});
+            }
+            termsOf[doc].push_back(term);
+        }
+    }
+
+    void remove(PooledString bookId) {
+        auto known = docOf.find(bookId);
+        if (known != docOf.end()) {
+            removeDoc(known->second);
+        }
+    }
+
+    void rebuild(const vector<Book>& books) {
+        clear();
+        for (const auto& book : books) {
+            add(book);
+        }
+    }
+
+    // Up to limit books matching every word of the query, best first
+    vector<SearchResult> search(string_view query, size_t limit) const {
+        map<string, uint32_t> words;
+        addTokens(query, 1, words);
+        vector<SearchResult> results;
+        if (words.empty()) {
+            return results;
+        }
+
+        // Only the rarest word's matches are collected up front; the other
+        // words are checked against them. A word of one term is merged
+        // along its postings in place, and a broad word or one with far
+        // more postings than there are hits is looked up in each hit's own
+        // terms, so a common prefix is only collected when the hits are as
+        // common and the prefix is not broad
+        map<string, size_t> counts;
+        const string* rarest = nullptr;
+        for (const auto& word : words) {
+            size_t count = postingCount(word.first);
+            if (count == 0) {
+                return results;
+            }
+            counts[word.first] = count;
+            if (!rarest || count < counts[*rarest]) {
+                rarest = &word.first;
+            }
+        }
+        vector<Posting> hits = matchWord(*rarest);
+        vector<uint32_t> scores;
+        // Best score per hit from postings in doc order, like the hits
+        auto merge = [&](const vector<Posting>& postings, uint32_t factor) {
+            auto from = postings.begin();
+            for (size_t i = 0; i < hits.size(); i++) {
+                from = seek(from, postings.end(), hits[i].doc);
+                if (from == postings.end()) {
+                    break;
+                }
+                if (from->doc == hits[i].doc) {
+                    scores[i] = max(scores[i], from->weight * factor);
+                }
+            }
+        };
+        for (const auto& word : words) {
+            if (&word.first == rarest) {
+                continue;
+            }
+            scores.assign(hits.size(), 0);
+            size_t count = counts[word.first];
+            auto first = terms.lower_bound(word.first);
+            auto second = next(first);
+            if (second == terms.end() || !matchesTerm(word.first, second->first)) {
+                merge(first->second, first->first.size() == word.first.size() ? 2 : 1);
+            } else if (count > MAX_EXPANSION || hits.size() * PROBE_RATIO < count) {
+                for (size_t i = 0; i < hits.size(); i++) {
+                    scores[i] = scoreWord(hits[i].doc, word.first);
+                }
+            } else {
+                merge(matchWord(word.first), 1);
+            }
+            size_t out = 0;
+            for (size_t i = 0; i < hits.size(); i++) {
+                if (scores[i] > 0) {
+                    hits[out++] = {hits[i].doc, hits[i].weight + scores[i]};
+                }
+            }
+            hits.resize(out);
+        }
+
+        size_t count = min(limit, hits.size());
+        partial_sort(hits.begin(), hits.begin() + count, hits.end(),
+                     [this](const Posting& a, const Posting& b) {
+                         if (a.weight != b.weight) {
+                             return a.weight > b.weight;
+                         }
+                         return bookOf[a.doc] < bookOf[b.doc];
+                     });
+        for (size_t i = 0; i < count; i++) {
+            results.push_back({bookOf[hits[i].doc], hits[i].weight});
+        }
+        return results;
+    }
+
+    size_t termCount() const {
+        return terms.size();
+    }
+};
+
+// Ordered (key, book id) pairs over one book field, for range queries in
+// O(log n + k). Ids make every entry unique, and entries can also be
+// looked up by key alone.
+template <typename Key>
+class BookRangeIndex {
+public:
+    using Entry = pair<Key, PooledString>;
+
+private:
+    struct Order {
+        using is_transparent = void;
+        bool operator()(const Entry& a, const Entry& b) const { return a < b; }
+        bool operator()(const Entry& a, const Key& b) const { return a.first < b; }
+        bool operator()(const Key& a, const Entry& b) const { return a < b.first; }
+    };
+    set<Entry, Order> entries;
+
+public:
+    void insert(const Key& key, PooledString id) {
+        entries.emplace(key, id);
+    }
+
+    void erase(const Key& key, PooledString id) {
+        entries.erase(Entry(key, id));
+    }
+
+    void clear() {
+        entries.clear();
+    }
+
+    size_t size() const {
+        return entries.size();
+    }
+
+    // Where an ascending walk from first, or from resume if given, starts;
+    // for merging several indexes in step
+    using Cursor = typename set<Entry, Order>::const_iterator;
+
+    Cursor start(const Key& first, const optional<Entry>& resume) const {
+        return resume ? entries.lower_bound(*resume) : entries.lower_bound(first);
+    }
+
+    Cursor end() const {
+        return entries.end();
+    }
+
+    // Visit entries with keys in [first, last] in ascending order, starting
+    // at resume if given, until visit returns false
+    template <typename Visit>
+    void ascending(const Key& first, const Key& last, const optional<Entry>& resume, Visit visit) const {
+        auto it = resume ? entries.lower_bound(*resume) : entries.lower_bound(first);
+        for (; it != entries.end() && !(last < it->first); ++it) {
+            if (!visit(*it)) {
+                return;
+            }
+        }
+    }
+
+    // The same in descending order; resume is the first entry to visit
+    template <typename Visit>
+    void descending(const Key& first, const Key& last, const optional<Entry>& resume, Visit visit) const {
+        auto it = resume ? entries.upper_bound(*resume) : entries.upper_bound(last);
+        while (it != entries.begin()) {
+            --it;
+            if (it->first < first || !visit(*it)) {
+                return;
+            }
+        }
+    }
+};
+
+// Category key for the category index: matched without regard to case
+PooledString categoryKey(string_view category) {
+    string folded(category);
+    for (char& c : folded) {
+        c = (char)tolower((unsigned char)c);
+    }
+    return PooledString(folded);
+}
+
+// One fixed-width console row built in a flat buffer. Pages are assembled
+// from these and written in one go instead of streaming every field
+// through iostream manipulators.
+class TableRow {
+    char buffer[192];
+    size_t length = 0;
+
+    void pad(size_t width, size_t written) {
+        for (; written < width && length < sizeof(buffer); written++) {
+            buffer[length++] = ' ';
+        }
+    }
+
+public:
+    // Left-aligned in width characters and cut to width - 1 so columns
+    // never run together. A width of 0 writes the text as it is.
+    TableRow& text(string_view value, size_t width = 0) {
+        size_t count = width ? min(value.size(), width - 1) : value.size();
+        count = min(count, sizeof(buffer) - length);
+        memcpy(buffer + length, value.data(), count);
+        length += count;
+        pad(width, count);
+        return *this;
+    }
+
+    TableRow& money(Money value, size_t width) {
+        char digits[24];
+        return text(string_view(digits, value.write(digits) - digits), width);
+    }
+
+    TableRow& integer(long long value, size_t width) {
+        char digits[24];
+        auto result = to_chars(digits, digits + sizeof(digits), value);
+        return text(string_view(digits, result.ptr - digits), width);
+    }
+
+    TableRow& timestamp(int64_t value) {
+        tm local = localTime(value);
+        length += strftime(buffer + length, sizeof(buffer) - length, "%a %b %e %H:%M:%S %Y", &local);
+        return *this;
+    }
+
+    // Move the row onto the end of page and start a new one
+    void appendTo(string& page) {
+        page.append(buffer, length);
+        page += '\n';
+        length = 0;
+    }
+};
+
+// Which books a catalogue view shows
+struct BookFilter {
+    string category;                                    // empty for every category
+    Money minPrice;
+    Money maxPrice = Money::max();
+    int lowStockAt = -1;                                // quantity at or below this; -1 for any
+
+    bool active() const {
+        return !category.empty() || minPrice > Money() || maxPrice != Money::max() || lowStockAt >= 0;
+    }
+
+    bool matches(const Book& book) const {
+        if (book.price < minPrice || book.price > maxPrice) {
+            return false;
+        }
+        if (lowStockAt >= 0 && book.quantity > lowStockAt) {
+            return false;
+        }
+        if (!category.empty()) {
+            string_view have = book.category;
+            if (have.size() != category.size()) {
+                return false;
+            }
+            for (size_t i = 0; i < have.size(); i++) {
+                if (tolower((unsigned char)have[i]) != tolower((unsigned char)category[i])) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+// Order of a catalogue view
+enum class BookOrder { Catalogue, PriceLow, PriceHigh, StockLow, Title };
+
+// Position in a book index walk: the index key (price in cents or stock)
+// and book id
+using BookResume = optional<pair<int64_t, PooledString>>;
+
+// Position in a paged catalogue view. Each page only touches the rows it
+// shows where it can:
+//   unfiltered catalogue order   scan on from where the previous page ended
+//   price and stock orders       walk the range index from the page's first entry
+// Other views collect the matching slots once, from a range index when
+// filtered, and sort only as far as the furthest page visited.
+struct BookCursor {
+    BookFilter filter;
+    BookOrder order = BookOrder::Catalogue;
+    size_t page = 0;
+    vector<size_t> pageStarts{0};       // first catalogue order entry of each page visited
+    size_t nextStart = 0;               // first catalogue order entry after the current page
+    vector<BookResume> pageEntries{{}}; // first index entry of each page visited
+    BookResume nextEntry;               // first index entry after the current page
+    vector<uint32_t> matches;           // matching slots
+    size_t sortedPrefix = 0;            // how many of matches are in final order
+    size_t matchedFrom = SIZE_MAX;      // catalogue size matches was built from
+
+    bool walksIndex() const {
+        return order == BookOrder::PriceLow || order == BookOrder::PriceHigh || order == BookOrder::StockLow;
+    }
+
+    void restart() {
+        page = 0;
+        pageStarts.assign(1, 0);
+        nextStart = 0;
+        pageEntries.assign(1, BookResume());
+        nextEntry.reset();
+        matches.clear();
+        sortedPrefix = 0;
+        matchedFrom = SIZE_MAX;
+    }
+};
+
+// Durable file writes, shared by the journal and the snapshot files
+int openForWriting(const string& path, bool append) {
+    #ifdef _WIN32
+        return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_BINARY | (append ? _O_APPEND : _O_TRUNC), 0644);
+    #else
+        return ::open(path.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+    #endif
+}
+
+void closeFile(int handle) {
+    #ifdef _WIN32
+        _close(handle);
+    #else
+        ::close(handle);
+    #endif
+}
+
+bool writeAll(int handle, const char* data, size_t size) {
+    METRIC_ADD(BytesWritten, size);
+    while (size > 0) {
+    #ifdef _WIN32
+        int written = _write(handle, data, (unsigned int)size);
+    #else
+        ssize_t written = ::write(handle, data, size);
+    #endif
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+bool syncFile(int handle) {
+    METRIC_TIME(Fsync);
+    METRIC_ADD(Fsyncs, 1);
+    #ifdef _WIN32
+        return _commit(handle) == 0;
+    #else
+        return fsync(handle) == 0;
+    #endif
+}
+
+// Make a rename or a newly created file in path's directory durable
+bool syncDirectory(const string& path) {
+    #ifdef _WIN32
+        (void)path;     // MoveFileEx with MOVEFILE_WRITE_THROUGH has already waited
+        return true;
+    #else
+        size_t slash = path.rfind('/');
+        string directory = slash == string::npos ? "." : path.substr(0, max<size_t>(slash, 1));
+        int handle = ::open(directory.c_str(), O_RDONLY);
+        if (handle < 0) {
+            return false;
+        }
+        bool synced = syncFile(handle);
+        ::close(handle);
+        return synced;
+    #endif
+}
+
+// Rename from over to, replacing it in one step
+bool replaceFile(const string& from, const string& to) {
+    #ifdef _WIN32
+        return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+    #else
+        return ::rename(from.c_str(), to.c_str()) == 0;
+    #endif
+}
+
+// Cut an open file back to size bytes
+bool cutFile(int handle, uint64_t size) {
+    #ifdef _WIN32
+        return _chsize_s(handle, (long long)size) == 0;
+    #else
+        return ::ftruncate(handle, (off_t)size) == 0;
+    #endif
+}
+
+bool truncateFile(const string& path, uint64_t size) {
+    #ifdef _WIN32
+        int handle = _open(path.c_str(), _O_WRONLY | _O_BINARY);
+        if (handle < 0) {
+            return false;
+        }
+        bool cut = cutFile(handle, size);
+        _close(handle);
+        return cut;
+    #else
+        return ::truncate(path.c_str(), (off_t)size) == 0;
+    #endif
+}
+
+// Replaces a file all at once. Writes go to <path>.tmp; commit() fsyncs
+// it, renames it over the file and syncs the directory, so after a crash
+// the file has either its old or its new contents, never part of each.
+// A temporary that is never committed is removed.
+class AtomicFile {
+private:
+    string path;
+    string temporary;
+    int fd;
+    string buffer;
+    bool ok;
+
+    void flushBuffer() {
+        ok = ok && writeAll(fd, buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+public:
+    explicit AtomicFile(const string& fileName)
+        : path(fileName), temporary(fileName + ".tmp"), fd(openForWriting(temporary, false)), ok(fd >= 0) {}
+
+    ~AtomicFile() {
+        if (fd >= 0) {
+            closeFile(fd);
+            remove(temporary.c_str());
+        }
+    }
+
+    AtomicFile(const AtomicFile&) = delete;
+    AtomicFile& operator=(const AtomicFile&) = delete;
+
+    bool isOpen() const {
+        return fd >= 0;
+    }
+
+    void write(const void* data, size_t size) {
+        buffer.append(static_cast<const char*>(data), size);
+        if (buffer.size() >= (1 << 20)) {
+            flushBuffer();
+        }
+    }
+
+    void write(string_view text) {
+        write(text.data(), text.size());
+    }
+
+    // Overwrite bytes already written, e.g. a header filled in at the end
+    void writeAt(uint64_t offset, const void* data, size_t size) {
+        flushBuffer();
+        if (!ok) {
+            return;
+        }
+        #ifdef _WIN32
+            __int64 end = _lseeki64(fd, 0, SEEK_CUR);
+            ok = _lseeki64(fd, (__int64)offset, SEEK_SET) >= 0 && writeAll(fd, static_cast<const char*>(data), size)
+                 && _lseeki64(fd, end, SEEK_SET) >= 0;
+        #else
+            METRIC_ADD(BytesWritten, size);
+            ok = pwrite(fd, data, size, (off_t)offset) == (ssize_t)size;
+        #endif
+    }
+
+    bool commit() {
+        if (fd < 0) {
+            return false;
+        }
+        flushBuffer();
+        ok = ok && syncFile(fd);
+        closeFile(fd);
+        fd = -1;
+        ok = ok && replaceFile(temporary, path) && syncDirectory(path);
+        if (!ok) {
+            remove(temporary.c_str());
+        }
+        return ok;
+    }
+};
+
+// Streaming checksum over the body of a binary snapshot, eight bytes at a time
+class SnapshotChecksum {
+private:
+    uint64_t hash;
+    uint64_t total;
+    unsigned char tail[8];
+    size_t tailLength;
+
+    void mix(uint64_t word) {
+        hash = ((hash << 5) | (hash >> 59)) ^ word;
+        hash *= 0x9E3779B97F4A7C15ULL;
+    }
+
+public:
+    SnapshotChecksum() : hash(0xCBF29CE484222325ULL), total(0), tailLength(0) {}
+
+    void update(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        total += size;
+        while (tailLength > 0 && size > 0) {
+            tail[tailLength++] = *bytes++;
+            size--;
+            if (tailLength == 8) {
+                uint64_t word;
+                memcpy(&word, tail, 8);
+                mix(word);
+                tailLength = 0;
+            }
+        }
+        while (size >= 8) {
+            uint64_t word;
+            memcpy(&word, bytes, 8);
+            mix(word);
+            bytes += 8;
+            size -= 8;
+        }
+        memcpy(tail, bytes, size);
+        tailLength = size;
+    }
+
+    uint64_t value() const {
+        SnapshotChecksum copy = *this;
+        if (copy.tailLength > 0) {
+            uint64_t word = 0;
+            memcpy(&word, copy.tail, copy.tailLength);
+            copy.mix(word);
+        }
+        copy.mix(total);
+        return copy.hash;
+    }
+};
+
+// Versioned binary snapshot files (books.bin, sales-<k>.bin).
+//   header   magic, version, byte-order mark, record count, heap size, checksum
+//   columns  one per field, each padded to 8 bytes; a string field is a
+//            column of 32-bit lengths into the string heap
+//   heap     the string bytes, one string column after another
+// The checksum covers everything after the header. A sales file's
+// sealedCount is the number of its shard's sales before its first, which
+// are in cold segments; 0 in files from before there were any.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t recordCount;
+    uint64_t heapSize;
+    uint64_t checksum;
+    uint64_t sealedCount;
+};
+
+// Version 3 stores prices and sale totals as int64 cents; versions 1 and 2
+// had them as doubles. Version 2 stores dates as int64 epoch seconds;
+// version 1 had them as strings among the string columns.
+const uint32_t SNAPSHOT_VERSION = 3;
+const uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+
+// Writes a snapshot through an AtomicFile; the file only replaces the old
+// one once finish() has written all of it
+class SnapshotWriter {
+private:
+    AtomicFile out;
+    SnapshotHeader header;
+    SnapshotChecksum checksum;
+    size_t records;
+    vector<function<string_view(size_t)>> stringColumns;
+
+    void write(const void* data, size_t size) {
+        out.write(data, size);
+        checksum.update(data, size);
+    }
+
+    void pad(size_t size) {
+        static const char zeros[8] = {0};
+        if (size % 8 != 0) {
+            write(zeros, 8 - size % 8);
+        }
+    }
+
+public:
+    SnapshotWriter(const string& path, const char* magic, size_t recordCount, uint64_t sealedCount = 0)
+        : out(path), records(recordCount) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, magic, 8);
+        header.version = SNAPSHOT_VERSION;
+        header.byteOrder = SNAPSHOT_BYTE_ORDER;
+        header.recordCount = recordCount;
+        header.sealedCount = sealedCount;
+        out.write(&header, sizeof(header));
+    }
+
+    bool isOpen() const {
+        return out.isOpen();
+    }
+
+    // Write the lengths column now; the strings go to the heap in finish()
+    void stringColumn(function<string_view(size_t)> field) {
+        vector<uint32_t> lengths(records);
+        for (size_t i = 0; i < records; i++) {
+            lengths[i] = (uint32_t)field(i).size();
+            header.heapSize += lengths[i];
+        }
+        write(lengths.data(), lengths.size() * sizeof(uint32_t));
+        pad(lengths.size() * sizeof(uint32_t));
+        stringColumns.push_back(field);
+    }
+
+    template <typename T>
+    void column(function<T(size_t)> field) {
+        vector<T> values(records);
+        for (size_t i = 0; i < records; i++) {
+            values[i] = field(i);
+        }
+        write(values.data(), values.size() * sizeof(T));
+        pad(values.size() * sizeof(T));
+    }
+
+    bool finish() {
+        string chunk;
+        for (const auto& field : stringColumns) {
+            for (size_t i = 0; i < records; i++) {
+                string_view value = field(i);
+                chunk.append(value.data(), value.size());
+                if (chunk.size() >= (1 << 20)) {
+                    write(chunk.data(), chunk.size());
+                    chunk.clear();
+                }
+            }
+        }
+        write(chunk.data(), chunk.size());
+        header.checksum = checksum.value();
+        out.writeAt(0, &header, sizeof(header));
+        return out.commit();
+    }
+};
+
+// Walks one string column of a snapshot in record order
+class SnapshotStrings {
+private:
+    const uint32_t* lengths;
+    const char* heap;
+    uint64_t offset;
+    uint64_t heapSize;
+
+public:
+    SnapshotStrings(const uint32_t* columnLengths, const char* heapStart, uint64_t start, uint64_t size)
+        : lengths(columnLengths), heap(heapStart), offset(start), heapSize(size) {}
+
+    string_view next() {
+        uint64_t length = min<uint64_t>(*lengths++, heapSize - offset);
+        string_view value(heap + offset, length);
+        offset += length;
+        return value;
+    }
+
+    // Heap offset just past this column's strings
+    uint64_t end(size_t records) const {
+        uint64_t total = offset;
+        for (size_t i = 0; i < records; i++) {
+            total += lengths[i];
+        }
+        return min(total, heapSize);
+    }
+};
+
+class SnapshotReader {
+private:
+    MappedFile file;
+    SnapshotHeader header;
+    const char* body;
+    size_t bodySize;
+    size_t position;
+    const char* heap;
+    uint64_t heapPosition;
+
+public:
+    SnapshotReader() : body(nullptr), bodySize(0), position(0), heap(nullptr), heapPosition(0) {}
+
+    // Map the file and check its header and checksum; columnBytes is the
+    // size every column takes for the record count and version found in
+    // the header
+    bool open(const string& path, const char* magic, function<size_t(size_t, uint32_t)> columnBytes,
+              string& error) {
+        if (!file.open(path)) {
+            error = "cannot open " + path;
+            return false;
+        }
+        string_view data = file.view();
+        if (data.size() < sizeof(header)) {
+            error = path + " is truncated";
+            return false;
+        }
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, magic, 8) != 0) {
+            error = path + " is not a snapshot of this kind";
+            return false;
+        }
+        if (header.version < 1 || header.version > SNAPSHOT_VERSION) {
+            error = path + " has unsupported version " + to_string(header.version);
+            return false;
+        }
+        if (header.byteOrder != SNAPSHOT_BYTE_ORDER) {
+            error = path + " was written with a different byte order";
+            return false;
+        }
+        body = data.data() + sizeof(header);
+        bodySize = data.size() - sizeof(header);
+        if (header.recordCount > bodySize || columnBytes(header.recordCount, header.version) + header.heapSize != bodySize) {
+            error = path + " has the wrong size for its header";
+            return false;
+        }
+        SnapshotChecksum checksum;
+        checksum.update(body, bodySize);
+        if (checksum.value() != header.checksum) {
+            error = path + " failed its checksum";
+            return false;
+        }
+        heap = body + bodySize - header.heapSize;
+        return true;
+    }
+
+    size_t size() const {
+        return header.recordCount;
+    }
+
+    uint32_t version() const {
+        return header.version;
+    }
+
+    uint64_t sealedCount() const {
+        return header.sealedCount;
+    }
+
+    // String columns must be taken in the order they were written
+    SnapshotStrings stringColumn() {
+        SnapshotStrings strings(column<uint32_t>(), heap, heapPosition, header.heapSize);
+        heapPosition = SnapshotStrings(strings).end(header.recordCount);
+        return strings;
+    }
+
+    template <typename T>
+    const T* column() {
+        const T* values = reinterpret_cast<const T*>(body + position);
+        position += (header.recordCount * sizeof(T) + 7) / 8 * 8;
+        return values;
+    }
+
+    // Bytes taken by the columns of a snapshot
+    static size_t stringColumnBytes(size_t records) {
+        return columnBytes<uint32_t>(records);
+    }
+
+    template <typename T>
+    static size_t columnBytes(size_t records) {
+        return (records * sizeof(T) + 7) / 8 * 8;
+    }
+};
+
+class BinarySnapshot {
+private:
+    // Both files have four string columns, the amount (int64 cents, a double
+    // before version 3), an int32 and the date: an int64 column since
+    // version 2, a fifth string column before that
+    static size_t columnBytes(size_t n, uint32_t version) {
+        size_t bytes = 4 * SnapshotReader::stringColumnBytes(n) + SnapshotReader::columnBytes<int64_t>(n)
+                       + SnapshotReader::columnBytes<int32_t>(n);
+        return bytes + (version == 1 ? SnapshotReader::stringColumnBytes(n) : SnapshotReader::columnBytes<int64_t>(n));
+    }
+
+public:
+    static bool writeBooks(const string& path, const vector<Book>& books) {
+        SnapshotWriter writer(path, "GBBOOKS", books.size());
+        if (!writer.isOpen()) {
+            return false;
+        }
+        writer.stringColumn([&books](size_t i) { return string_view(books[i].id); });
+        writer.stringColumn([&books](size_t i) { return string_view(books[i].title); });
+        writer.stringColumn([&books](size_t i) { return string_view(books[i].author); });
+        writer.stringColumn([&books](size_t i) { return string_view(books[i].category); });
+        writer.column<int64_t>([&books](size_t i) { return books[i].price.cents(); });
+        writer.column<int32_t>([&books](size_t i) { return (int32_t)books[i].quantity; });
+        writer.column<int64_t>([&books](size_t i) { return books[i].dateAdded; });
+        return writer.finish();
+    }
+
+    static bool readBooks(const string& path, vector<Book>& books, string& error) {
+        SnapshotReader reader;
+        if (!reader.open(path, "GBBOOKS", columnBytes, error)) {
+            return false;
+        }
+        bool legacy = reader.version() == 1;
+        SnapshotStrings ids = reader.stringColumn();
+        SnapshotStrings titles = reader.stringColumn();
+        SnapshotStrings authors = reader.stringColumn();
+        SnapshotStrings categories = reader.stringColumn();
+        optional<SnapshotStrings> legacyDates;
+        if (legacy) {
+            legacyDates = reader.stringColumn();
+        }
+        bool doubles = reader.version() < 3;
+        const double* legacyPrices = doubles ? reader.column<double>() : nullptr;
+        const int64_t* prices = doubles ? nullptr : reader.column<int64_t>();
+        const int32_t* quantities = reader.column<int32_t>();
+        const int64_t* dates = legacy ? nullptr : reader.column<int64_t>();
+
+        books.resize(reader.size());
+        for (size_t i = 0; i < reader.size(); i++) {
+            Book& book = books[i];
+            book.id.assign(ids.next());
+            book.title.assign(titles.next());
+            book.author.assign(authors.next());
+            book.category.assign(categories.next());
+            book.dateAdded = 0;
+            if (legacy) {
+                parseTimestamp(legacyDates->next(), book.dateAdded);
+            } else {
+                book.dateAdded = dates[i];
+            }
+            book.price = doubles ? Money::fromDouble(legacyPrices[i]) : Money::fromCents(prices[i]);
+            book.quantity = quantities[i];
+        }
+        return true;
+    }
+
+    // The first count sales; later ones may be appended meanwhile. sealed
+    // sales of the shard came before them; see SnapshotHeader.
+    static bool writeSales(const string& path, const SalesHistory& sales, size_t count, size_t sealed) {
+        SnapshotWriter writer(path, "GBSALES", count, sealed);
+        if (!writer.isOpen()) {
+            return false;
+        }
+        writer.stringColumn([&sales](size_t i) { return string_view(sales[i].saleId); });
+        writer.stringColumn([&sales](size_t i) { return string_view(sales[i].bookId); });
+        writer.stringColumn([&sales](size_t i) { return string_view(sales[i].bookTitle); });
+        writer.stringColumn([&sales](size_t i) { return string_view(sales[i].customerName); });
+        writer.column<int64_t>([&sales](size_t i) { return sales[i].totalAmount.cents(); });
+        writer.column<int32_t>([&sales](size_t i) { return (int32_t)sales[i].quantity; });
+        writer.column<int64_t>([&sales](size_t i) { return sales[i].date; });
+        return writer.finish();
+    }
+
+    static bool readSales(const string& path, SalesHistory& sales, size_t& sealed, string& error) {
+        SnapshotReader reader;
+        if (!reader.open(path, "GBSALES", columnBytes, error)) {
+            return false;
+        }
+        sealed = reader.sealedCount();
+        bool legacy = reader.version() == 1;
+        SnapshotStrings saleIds = reader.stringColumn();
+        SnapshotStrings bookIds = reader.stringColumn();
+        SnapshotStrings titles = reader.stringColumn();
+        optional<SnapshotStrings> legacyDates;
+        if (legacy) {
+            legacyDates = reader.stringColumn();
+        }
+        SnapshotStrings customers = reader.stringColumn();
+        bool doubles = reader.version() < 3;
+        const double* legacyAmounts = doubles ? reader.column<double>() : nullptr;
+        const int64_t* amounts = doubles ? nullptr : reader.column<int64_t>();
+        const int32_t* quantities = reader.column<int32_t>();
+        const int64_t* dates = legacy ? nullptr : reader.column<int64_t>();
+
+        sales.resize(reader.size());
+        for (size_t i = 0; i < reader.size(); i++) {
+            Sale& sale = sales[i];
+            sale.saleId.assign(saleIds.next());
+            sale.bookId.assign(bookIds.next());
+            sale.bookTitle.assign(titles.next());
+            sale.date = 0;
+            if (legacy) {
+                parseTimestamp(legacyDates->next(), sale.date);
+            } else {
+                sale.date = dates[i];
+            }
+            sale.customerName.assign(customers.next());
+            sale.totalAmount = doubles ? Money::fromDouble(legacyAmounts[i]) : Money::fromCents(amounts[i]);
+            sale.quantity = quantities[i];
+        }
+        return true;
+    }
+};
+
+// Varints for the segment files: seven bits a byte, low bits first.
+// Signed values are zigzag coded so small negatives stay short.
+void appendVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char)(value | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+void appendSigned(string& out, int64_t value) {
+    appendVarint(out, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+}
+
+// Reading stops with false at 'end' or after ten bytes
+bool readVarint(const char*& pos, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+        uint8_t byte = (uint8_t)*pos++;
+        value |= uint64_t(byte & 0x7F) << shift;
+        if (byte < 0x80) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool readSigned(const char*& pos, const char* end, int64_t& value) {
+    uint64_t raw;
+    if (!readVarint(pos, end, raw)) {
+        return false;
+    }
+    value = (int64_t)(raw >> 1) ^ -(int64_t)(raw & 1);
+    return true;
+}
+
+// The n of a sale ID written as "S<n>", which is how nearly all of them
+// look; false for anything that would not be written back the same
+bool parseSaleNumber(const string& saleId, uint64_t& number) {
+    if (saleId.size() < 2 || saleId.size() > 19 || saleId[0] != 'S' || (saleId[1] == '0' && saleId.size() > 2)) {
+        return false;
+    }
+    for (size_t i = 1; i < saleId.size(); i++) {
+        if (saleId[i] < '0' || saleId[i] > '9') {
+            return false;
+        }
+    }
+    return parseNumber(string_view(saleId).substr(1), number);
+}
+
+// Cold sales segments (sales-<k>-<first>.seg): sales of shard k sealed out
+// of memory, from the shard's first'th sale on, nearly all made in one
+// calendar month. Written once and never changed; the file is mapped and
+// read a block at a time.
+//   header      magic, version, byte-order mark, first sale and count,
+//               time range, totals, highest sale number, section offsets,
+//               checksum
+//   dictionary  book ids, titles and customers, each in the order the
+//               sales first used them, as varint lengths and bytes
+//   summary     units and revenue per book, then revenue per day
+//   index       per block: offset, size, sales, first time, checksum
+//   blocks      up to BLOCK_ROWS sales in time order, one column after
+//               another as varints: time deltas, book, customer,
+//               quantity, amount, title, sale id
+// The header checksum covers the dictionary, summary and index, which are
+// read when the segment is opened; each block has its own, checked when it
+// is decoded, so opening a segment reads none of the blocks.
+struct SegmentHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t firstSale;
+    uint64_t saleCount;
+    int64_t minTime;
+    int64_t maxTime;
+    int64_t units;
+    int64_t revenue;        // in cents
+    uint64_t highestSaleNumber;
+    uint64_t summaryOffset;
+    uint64_t indexOffset;
+    uint64_t blocksOffset;
+    uint64_t blockCount;
+    uint64_t checksum;
+};
+
+struct SegmentBlock {
+    uint64_t offset;        // from the first block
+    uint64_t size;
+    uint64_t rows;
+    int64_t firstTime;
+    uint64_t checksum;
+};
+
+const uint32_t SEGMENT_VERSION = 1;
+
+class SegmentFile {
+public:
+    static const size_t BLOCK_ROWS = 4096;
+
+    // One decoded block, a vector per column
+    struct Rows {
+        vector<int64_t> time;
+        vector<uint32_t> book;
+        vector<uint32_t> customer;
+        vector<int32_t> quantity;
+        vector<int64_t> amount;
+        vector<uint32_t> title;
+        vector<string> saleId;
+    };
+
+    // How much of a block to decode: the columns come in this order
+    enum class Columns { Time, Totals, All };
+
+private:
+    string path;
+    MappedFile file;
+    SegmentHeader header;
+    const char* blocks;
+    vector<SegmentBlock> index;
+    vector<size_t> blockStarts;     // position of each block's first sale
+    vector<string_view> bookIds;
+    vector<string_view> titles;
+    vector<string_view> customers;
+    string_view summary;
+    mutable atomic<bool> warned;
+
+    static bool readStrings(const char*& pos, const char* end, vector<string_view>& strings) {
+        uint64_t count;
+        if (!readVarint(pos, end, count) || count > (uint64_t)(end - pos)) {
+            return false;
+        }
+        strings.resize(count);
+        for (auto& value : strings) {
+            uint64_t length;
+            if (!readVarint(pos, end, length) || length > (uint64_t)(end - pos)) {
+                return false;
+            }
+            value = string_view(pos, length);
+            pos += length;
+        }
+        return true;
+    }
+
+    static void appendStrings(string& out, const vector<PooledString>& strings) {
+        appendVarint(out, strings.size());
+        for (const auto& value : strings) {
+            appendVarint(out, value.size());
+            out.append(value.data(), value.size());
+        }
+    }
+
+    static vector<PooledString> pooled(const vector<string_view>& strings) {
+        vector<PooledString> values;
+        values.reserve(strings.size());
+        for (string_view value : strings) {
+            values.emplace_back(value);
+        }
+        return values;
+    }
+
+    size_t blockOf(size_t position) const {
+        return upper_bound(blockStarts.begin(), blockStarts.end(), position) - blockStarts.begin() - 1;
+    }
+
+    Sale saleOf(const Rows& rows, size_t i) const {
+        Sale sale;
+        sale.saleId = rows.saleId[i];
+        sale.bookId.assign(bookIds[rows.book[i]]);
+        sale.bookTitle.assign(titles[rows.title[i]]);
+        sale.quantity = rows.quantity[i];
+        sale.totalAmount = Money::fromCents(rows.amount[i]);
+        sale.date = rows.time[i];
+        sale.customerName.assign(customers[rows.customer[i]]);
+        return sale;
+    }
+
+public:
+    SegmentFile() : blocks(nullptr), warned(false) {
+        memset(&header, 0, sizeof(header));
+    }
+
+    SegmentFile(const SegmentFile&) = delete;
+    SegmentFile& operator=(const SegmentFile&) = delete;
+
+    // Write sales [begin, end) of a shard's history, whose first is the
+    // shard's firstSale'th, as a segment
+    static bool write(const string& path, uint64_t firstSale, const SalesHistory& sales, size_t begin, size_t end) {
+        size_t n = end - begin;
+        SegmentHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "GBSEGMT", 8);
+        header.version = SEGMENT_VERSION;
+        header.byteOrder = SNAPSHOT_BYTE_ORDER;
+        header.firstSale = firstSale;
+        header.saleCount = n;
+        header.minTime = n > 0 ? INT64_MAX : 0;
+        header.maxTime = n > 0 ? INT64_MIN : 0;
+
+        // Codes in order of first use, and the totals for the summary
+        unordered_map<PooledString, uint32_t> bookCodes, titleCodes, customerCodes;
+        vector<PooledString> bookList, titleList, customerList;
+        auto encode = [](unordered_map<PooledString, uint32_t>& codes, vector<PooledString>& list, PooledString value) {
+            auto entry = codes.emplace(value, (uint32_t)list.size());
+            if (entry.second) {
+                list.push_back(value);
+            }
+            return entry.first->second;
+        };
+        vector<uint32_t> bookOf(n), titleOf(n), customerOf(n);
+        vector<int64_t> bookUnits, bookRevenue;
+        map<string, int64_t> dayRevenue;
+        DayKeys days;
+        for (size_t i = 0; i < n; i++) {
+            const Sale& sale = sales[begin + i];
+            bookOf[i] = encode(bookCodes, bookList, sale.bookId);
+            titleOf[i] = encode(titleCodes, titleList, sale.bookTitle);
+            customerOf[i] = encode(customerCodes, customerList, sale.customerName);
+            bookUnits.resize(bookList.size());
+            bookRevenue.resize(bookList.size());
+            bookUnits[bookOf[i]] += sale.quantity;
+            bookRevenue[bookOf[i]] += sale.totalAmount.cents();
+            dayRevenue[days.of(sale.date)] += sale.totalAmount.cents();
+            header.minTime = min(header.minTime, sale.date);
+            header.maxTime = max(header.maxTime, sale.date);
+            header.units += sale.quantity;
+            header.revenue += sale.totalAmount.cents();
+            uint64_t number;
+            if (parseSaleNumber(sale.saleId, number)) {
+                header.highestSaleNumber = max(header.highestSaleNumber, number);
+            }
+        }
+
+        string body;
+        appendStrings(body, bookList);
+        appendStrings(body, titleList);
+        appendStrings(body, customerList);
+        header.summaryOffset = sizeof(header) + body.size();
+        for (size_t code = 0; code < bookList.size(); code++) {
+            appendSigned(body, bookUnits[code]);
+            appendSigned(body, bookRevenue[code]);
+        }
+        appendVarint(body, dayRevenue.size());
+        for (const auto& day : dayRevenue) {
+            appendVarint(body, day.first.size());
+            body += day.first;
+            appendSigned(body, day.second);
+        }
+        body.append((8 - body.size() % 8) % 8, '\0');
+        header.indexOffset = sizeof(header) + body.size();
+
+        // Rows in time order, sales made at the same time in the order
+        // they were recorded
+        vector<uint32_t> order(n);
+        for (size_t i = 0; i < n; i++) {
+            order[i] = (uint32_t)i;
+        }
+        stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return sales[begin + a].date < sales[begin + b].date;
+        });
+        string data;
+        vector<SegmentBlock> index;
+        for (size_t first = 0; first < n; first += BLOCK_ROWS) {
+            size_t last = min(n, first + BLOCK_ROWS);
+            SegmentBlock block;
+            block.offset = data.size();
+            block.rows = last - first;
+            block.firstTime = sales[begin + order[first]].date;
+            int64_t previous = block.firstTime;
+            for (size_t i = first; i < last; i++) {
+                const Sale& sale = sales[begin + order[i]];
+                appendVarint(data, (uint64_t)(sale.date - previous));
+                previous = sale.date;
+            }
+            for (size_t i = first; i < last; i++) {
+                appendVarint(data, bookOf[order[i]]);
+            }
+            for (size_t i = first; i < last; i++) {
+                appendVarint(data, customerOf[order[i]]);
+            }
+            for (size_t i = first; i < last; i++) {
+                appendSigned(data, sales[begin + order[i]].quantity);
+            }
+            for (size_t i = first; i < last; i++) {
+                appendSigned(data, sales[begin + order[i]].totalAmount.cents());
+            }
+            for (size_t i = first; i < last; i++) {
+                appendVarint(data, titleOf[order[i]]);
+            }
+            // "S<n>" ids as the difference from the last one, shifted up
+            // a bit; any other id as its length, with that bit set, and
+            // its bytes
+            uint64_t previousNumber = 0;
+            for (size_t i = first; i < last; i++) {
+                const string& saleId = sales[begin + order[i]].saleId;
+                uint64_t number;
+                if (parseSaleNumber(saleId, number) && number < (uint64_t(1) << 61)) {
+                    int64_t delta = (int64_t)(number - previousNumber);
+                    appendVarint(data, ((uint64_t)delta << 1 ^ (uint64_t)(delta >> 63)) << 1);
+                    previousNumber = number;
+                } else {
+                    appendVarint(data, (uint64_t)saleId.size() << 1 | 1);
+                    data += saleId;
+                }
+            }
+            block.size = data.size() - block.offset;
+            SnapshotChecksum checksum;
+            checksum.update(data.data() + block.offset, block.size);
+            block.checksum = checksum.value();
+            index.push_back(block);
+        }
+        body.append(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(SegmentBlock));
+        header.blocksOffset = sizeof(header) + body.size();
+        header.blockCount = index.size();
+        SnapshotChecksum checksum;
+        checksum.update(body.data(), body.size());
+        header.checksum = checksum.value();
+
+        AtomicFile out(path);
+        out.write(&header, sizeof(header));
+        out.write(body);
+        out.write(data);
+        return out.commit();
+    }
+
+    // Map the file and check its header, dictionary and index
+    bool open(const string& fileName, string& error) {
+        path = fileName;
+        if (!file.open(path)) {
+            error = "cannot open " + path;
+            return false;
+        }
+        string_view data = file.view();
+        if (data.size() < sizeof(header)) {
+            error = path + " is truncated";
+            return false;
+        }
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, "GBSEGMT", 8) != 0) {
+            error = path + " is not a sales segment";
+            return false;
+        }
+        if (header.version < 1 || header.version > SEGMENT_VERSION) {
+            error = path + " has unsupported version " + to_string(header.version);
+            return false;
+        }
+        if (header.byteOrder != SNAPSHOT_BYTE_ORDER) {
+            error = path + " was written with a different byte order";
+            return false;
+        }
+        if (header.summaryOffset < sizeof(header) || header.summaryOffset > header.indexOffset ||
+            header.indexOffset > header.blocksOffset || header.blocksOffset > data.size() ||
+            header.blockCount != (header.blocksOffset - header.indexOffset) / sizeof(SegmentBlock) ||
+            (header.blocksOffset - header.indexOffset) % sizeof(SegmentBlock) != 0) {
+            error = path + " has the wrong size for its header";
+            return false;
+        }
+        SnapshotChecksum checksum;
+        checksum.update(data.data() + sizeof(header), header.blocksOffset - sizeof(header));
+        if (checksum.value() != header.checksum) {
+            error = path + " failed its checksum";
+            return false;
+        }
+        const char* pos = data.data() + sizeof(header);
+        const char* end = data.data() + header.summaryOffset;
+        if (!readStrings(pos, end, bookIds) || !readStrings(pos, end, titles) || !readStrings(pos, end, customers)) {
+            error = path + " has a damaged dictionary";
+            return false;
+        }
+        summary = data.substr(header.summaryOffset, header.indexOffset - header.summaryOffset);
+        index.resize(header.blockCount);
+        memcpy(index.data(), data.data() + header.indexOffset, index.size() * sizeof(SegmentBlock));
+        blocks = data.data() + header.blocksOffset;
+        size_t blockBytes = data.size() - header.blocksOffset;
+        size_t rows = 0;
+        blockStarts.clear();
+        for (const auto& block : index) {
+            if (block.offset > blockBytes || block.size > blockBytes - block.offset || block.rows == 0 ||
+                block.rows > BLOCK_ROWS) {
+                error = path + " has a damaged index";
+                return false;
+            }
+            blockStarts.push_back(rows);
+            rows += block.rows;
+        }
+        if (rows != header.saleCount) {
+            error = path + " has a damaged index";
+            return false;
+        }
+        return true;
+    }
+
+    const string& fileName() const {
+        return path;
+    }
+
+    size_t fileBytes() const {
+        return file.view().size();
+    }
+
+    // The segment holds the shard's sales [first(), end())
+    size_t first() const {
+        return header.firstSale;
+    }
+
+    size_t end() const {
+        return header.firstSale + header.saleCount;
+    }
+
+    size_t size() const {
+        return header.saleCount;
+    }
+
+    int64_t minTime() const {
+        return header.minTime;
+    }
+
+    int64_t maxTime() const {
+        return header.maxTime;
+    }
+
+    int64_t units() const {
+        return header.units;
+    }
+
+    Money revenue() const {
+        return Money::fromCents(header.revenue);
+    }
+
+    uint64_t highestSaleNumber() const {
+        return header.highestSaleNumber;
+    }
+
+    // Whether any sale in it may have been made in [from, to)
+    bool overlaps(int64_t from, int64_t to) const {
+        return size() > 0 && header.minTime < to && header.maxTime >= from && from < to;
+    }
+
+    // Decode block b up to the columns asked for. A damaged block reads as
+    // sales of nothing at its first time, so positions still line up, and
+    // a warning is printed the first time.
+    void decodeBlock(size_t b, Rows& rows, Columns wanted) const {
+        const SegmentBlock& block = index[b];
+        size_t n = block.rows;
+        const char* pos = blocks + block.offset;
+        const char* end = pos + block.size;
+        SnapshotChecksum checksum;
+        checksum.update(pos, block.size);
+        bool ok = checksum.value() == block.checksum;
+
+        rows.time.resize(n);
+        int64_t previous = block.firstTime;
+        for (size_t i = 0; ok && i < n; i++) {
+            uint64_t delta;
+            ok = readVarint(pos, end, delta);
+            previous += (int64_t)delta;
+            rows.time[i] = previous;
+        }
+        auto codes = [&](vector<uint32_t>& column, size_t limit) {
+            column.resize(n);
+            for (size_t i = 0; ok && i < n; i++) {
+                uint64_t code;
+                ok = readVarint(pos, end, code) && code < limit;
+                column[i] = (uint32_t)code;
+            }
+        };
+        if (wanted != Columns::Time) {
+            codes(rows.book, bookIds.size());
+            codes(rows.customer, customers.size());
+            rows.quantity.resize(n);
+            for (size_t i = 0; ok && i < n; i++) {
+                int64_t quantity;
+                ok = readSigned(pos, end, quantity);
+                rows.quantity[i] = (int32_t)quantity;
+            }
+            rows.amount.resize(n);
+            for (size_t i = 0; ok && i < n; i++) {
+                ok = readSigned(pos, end, rows.amount[i]);
+            }
+        }
+        if (wanted == Columns::All) {
+            codes(rows.title, titles.size());
+            rows.saleId.resize(n);
+            uint64_t previousNumber = 0;
+            for (size_t i = 0; ok && i < n; i++) {
+                uint64_t tag;
+                ok = readVarint(pos, end, tag);
+                if (!ok) {
+                    break;
+                }
+                if (tag & 1) {
+                    uint64_t length = tag >> 1;
+                    ok = length <= (uint64_t)(end - pos);
+                    if (ok) {
+                        rows.saleId[i].assign(pos, length);
+                        pos += length;
+                    }
+                } else {
+                    uint64_t zigzag = tag >> 1;
+                    previousNumber += (uint64_t)((int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1));
+                    rows.saleId[i] = "S";
+                    appendNumber(rows.saleId[i], previousNumber);
+                }
+            }
+        }
+        if (ok) {
+            return;
+        }
+        if (!warned.exchange(true)) {
+            cout << "✗ Warning: " << path << " is damaged; some of its sales read as empty.\n";
+        }
+        fill(rows.time.begin(), rows.time.end(), block.firstTime);
+        if (wanted != Columns::Time) {
+            fill(rows.book.begin(), rows.book.end(), 0);
+            fill(rows.customer.begin(), rows.customer.end(), 0);
+            fill(rows.quantity.begin(), rows.quantity.end(), 0);
+            fill(rows.amount.begin(), rows.amount.end(), 0);
+        }
+        if (wanted == Columns::All) {
+            fill(rows.title.begin(), rows.title.end(), 0);
+            fill(rows.saleId.begin(), rows.saleId.end(), string());
+        }
+    }
+
+    // First position in time order of a sale made at or after 'when'.
+    // The index finds the block; only its times are decoded.
+    size_t positionOf(int64_t when) const {
+        if (size() == 0 || when <= header.minTime) {
+            return 0;
+        }
+        if (when > header.maxTime) {
+            return size();
+        }
+        size_t b = lower_bound(index.begin(), index.end(), when, [](const SegmentBlock& block, int64_t time) {
+            return block.firstTime < time;
+        }) - index.begin();
+        if (b == 0) {
+            return 0;
+        }
+        Rows rows;
+        decodeBlock(b - 1, rows, Columns::Time);
+        return blockStarts[b - 1] + (lower_bound(rows.time.begin(), rows.time.end(), when) - rows.time.begin());
+    }
+
+    // Positions [first, last) of the sales made in [from, to)
+    pair<size_t, size_t> timeRange(int64_t from, int64_t to) const {
+        size_t first = positionOf(from);
+        return {first, positionOf(max(from, to))};
+    }
+
+    int64_t timeAt(size_t position) const {
+        if (position == 0) {
+            return header.minTime;
+        }
+        if (position + 1 == size()) {
+            return header.maxTime;
+        }
+        size_t b = blockOf(position);
+        Rows rows;
+        decodeBlock(b, rows, Columns::Time);
+        return rows.time[position - blockStarts[b]];
+    }
+
+    Sale saleAt(size_t position) const {
+        size_t b = blockOf(position);
+        Rows rows;
+        decodeBlock(b, rows, Columns::All);
+        return saleOf(rows, position - blockStarts[b]);
+    }
+
+    // Every sale, in time order
+    template <typename Visit>
+    void forEachSale(Visit visit) const {
+        Rows rows;
+        for (size_t b = 0; b < index.size(); b++) {
+            decodeBlock(b, rows, Columns::All);
+            for (size_t i = 0; i < rows.time.size(); i++) {
+                visit(saleOf(rows, i));
+            }
+        }
+    }
+
+    // Decode the sales into empty columns, with the same book and customer
+    // codes as the dictionary
+    void load(SalesColumns& columns) const {
+        vector<PooledString> books = pooled(bookIds);
+        vector<PooledString> names = pooled(customers);
+        columns.presetCodes(books, names);
+        Rows rows;
+        Sale sale;
+        for (size_t b = 0; b < index.size(); b++) {
+            decodeBlock(b, rows, Columns::Totals);
+            for (size_t i = 0; i < rows.time.size(); i++) {
+                sale.bookId = books[rows.book[i]];
+                sale.customerName = names[rows.customer[i]];
+                sale.quantity = rows.quantity[i];
+                sale.totalAmount = Money::fromCents(rows.amount[i]);
+                sale.date = rows.time[i];
+                columns.appendUnseen(sale);
+            }
+        }
+    }
+
+    // Add the summary's figures to running aggregates, without reading
+    // the sales themselves
+    void summarizeInto(SalesAggregates& aggregates) const {
+        const char* pos = summary.data();
+        const char* end = pos + summary.size();
+        aggregates.addTotals(size(), units(), revenue());
+        bool ok = true;
+        for (size_t code = 0; ok && code < bookIds.size(); code++) {
+            int64_t bookUnits, bookRevenue;
+            ok = readSigned(pos, end, bookUnits) && readSigned(pos, end, bookRevenue);
+            if (ok) {
+                aggregates.addBook(PooledString(bookIds[code]), bookUnits, Money::fromCents(bookRevenue));
+            }
+        }
+        uint64_t dayCount = 0;
+        ok = ok && readVarint(pos, end, dayCount);
+        for (uint64_t d = 0; ok && d < dayCount; d++) {
+            uint64_t length;
+            int64_t dayRevenue;
+            ok = readVarint(pos, end, length) && length <= (uint64_t)(end - pos);
+            if (ok) {
+                string day(pos, length);
+                pos += length;
+                ok = readSigned(pos, end, dayRevenue);
+                if (ok) {
+                    aggregates.addDay(day, Money::fromCents(dayRevenue));
+                }
+            }
+        }
+        if (!ok && !warned.exchange(true)) {
+            cout << "✗ Warning: " << path << " has a damaged summary.\n";
+        }
+    }
+};
+
+// The sales of a shard still held in memory, in the order they were made,
+// and their columns
+struct HotSales {
+    SalesHistory sales;
+    SalesColumns columns;
+};
+
+// A shard's sealed segments, oldest first
+using ColdSegments = vector<shared_ptr<const SegmentFile>>;
+
+// One partition of the sales history: the sales of the books whose id
+// hashes to it, in the order they were made. The oldest are sealed into
+// cold segments and the rest are hot in memory; the running totals cover
+// both. lock guards changes to all of it, and hot sales and columns below
+// a view's rows are read without it. Sealing swaps in new hot sales and a
+// longer segment list and retires the old ones, so snapshots still
+// reading them keep them.
+struct SalesShard {
+    mutable mutex lock;
+    unique_ptr<HotSales> hot;
+    unique_ptr<const ColdSegments> cold;
+    size_t sealed;          // sales before the hot ones, in the segments
+    SalesAggregates aggregates;
+
+    SalesShard() : hot(new HotSales()), cold(new ColdSegments()), sealed(0) {}
+
+    // Sales recorded, sealed or not
+    size_t size() const {
+        return sealed + hot->sales.size();
+    }
+
+    void record(const Sale& sale, EpochReclaimer& epochs) {
+        hot->sales.push_back(sale);
+        hot->columns.append(sale, epochs);
+        aggregates.apply(sale);
+    }
+
+    // The cold sales count from their segments' summaries
+    void rebuildDerived() {
+        hot->columns.rebuild(hot->sales);
+        aggregates.rebuild(hot->sales);
+        for (const auto& segment : *cold) {
+            segment->summarizeInto(aggregates);
+        }
+    }
+};
+
+// Append-only journal of catalogue changes and sales.
+// Every record holds the full new state of what it touches, so replaying
+// the journal over the last snapshot files restores the exact state.
+//   A|<book line>   book added or updated
+//   D|<book id>     book deleted
+//   Q|<book id>|<quantity>   stock level changed
+//   S|<sale line>   sale recorded
+//   B|<count>|...   sales already in each sales shard's file when the journal
+//                   was started; a journal from before the history was
+//                   sharded has a single count for all of it
+class SalesJournal {
+private:
+    string path;
+    int fd;
+    string pending;
+    size_t recordCount;
+
+    // Group commit state; tickets number the appended records
+    mutable mutex stateMutex;
+    condition_variable flushed;
+    bool flushing;
+    uint64_t appendedTicket;
+    uint64_t durableTicket;
+    // A batch that fails to reach the disk goes back to the front of the
+    // queue and the file is cut back to durableBytes before the next try,
+    // so a failure never leaves a gap in the records
+    uint64_t durableBytes;
+    uint64_t failures;          // failed batches so far
+    bool torn;                  // the last batch failed
+
+public:
+    SalesJournal()
+        : fd(-1), recordCount(0), flushing(false), appendedTicket(0), durableTicket(0), durableBytes(0),
+          failures(0), torn(false) {}
+
+    ~SalesJournal() {
+        close();
+    }
+
+    bool open(const string& fileName) {
+        close();
+        path = fileName;
+        fd = openForWriting(path, true);
+    #ifdef _WIN32
+        __int64 end = fd >= 0 ? _lseeki64(fd, 0, SEEK_END) : 0;
+    #else
+        off_t end = fd >= 0 ? ::lseek(fd, 0, SEEK_END) : 0;
+    #endif
+        durableBytes = end > 0 ? (uint64_t)end : 0;
+        torn = false;
+        return fd >= 0;
+    }
+
+    void close() {
+        if (fd >= 0) {
+            closeFile(fd);
+            fd = -1;
+        }
+    }
+
+    // Queue a record (or several '\n'-separated ones, counted by lines);
+    // nothing reaches the disk until commit().
+    // Returns a ticket that commit(ticket) waits on.
+    uint64_t append(const string& record, size_t lines = 1) {
+        lock_guard<mutex> lock(stateMutex);
+        pending += record;
+        pending += '\n';
+        recordCount += lines;
+        return ++appendedTicket;
+    }
+
+    // Make every record up to ticket durable (all queued records by
+    // default). Concurrent callers are group-committed: one thread writes
+    // and fsyncs everything queued so far while the others wait for it.
+    // Returns false if a write failed before the records got to disk; they
+    // stay queued and go out with a later commit.
+    bool commit(uint64_t ticket = UINT64_MAX) {
+        unique_lock<mutex> lock(stateMutex);
+        if (ticket == UINT64_MAX) {
+            ticket = appendedTicket;
+        }
+        uint64_t failuresSeen = failures;
+        while (durableTicket < ticket && failures == failuresSeen) {
+            if (flushing) {
+                flushed.wait(lock);
+                continue;
+            }
+            flushing = true;
+            string batch;
+            batch.swap(pending);
+            uint64_t batchEnd = appendedTicket;
+            uint64_t start = durableBytes;
+            bool retrying = torn;
+            lock.unlock();
+
+            // After a failure the file may end in part of the failed batch
+            bool ok = fd >= 0 && (!retrying || cutFile(fd, start)) && writeAll(fd, batch.data(), batch.size())
+                      && syncFile(fd);
+
+            lock.lock();
+            flushing = false;
+            torn = !ok;
+            if (ok) {
+                durableTicket = batchEnd;
+                durableBytes = start + batch.size();
+            } else {
+                pending.insert(0, batch);
+                failures++;
+            }
+            flushed.notify_all();
+        }
+        return durableTicket >= ticket;
+    }
+
+    static string baseRecord(const vector<size_t>& salesInShards) {
+        string record = "B";
+        for (size_t count : salesInShards) {
+            record += "|" + to_string(count);
+        }
+        return record;
+    }
+
+    // Start a fresh journal after the snapshot files have been rewritten.
+    // Callers must stop other threads from appending while this runs.
+    bool reset(const vector<size_t>& salesInShards) {
+        commit();
+        {
+            lock_guard<mutex> lock(stateMutex);
+            close();
+            ofstream file(path, ios::trunc);
+            file.close();
+            recordCount = 0;
+            pending.clear();
+            if (!open(path)) {
+                return false;
+            }
+        }
+        return commit(append(baseRecord(salesInShards)));
+    }
+
+    // Move the records so far to retiredPath and start a fresh journal that
+    // follows salesAtCut sales in each shard. If retiredPath is still there from a
+    // checkpoint that never finished, the records are appended to it, so
+    // the retired file always holds everything since the last complete
+    // snapshot. Callers must stop other threads from appending while this
+    // runs, and remove retiredPath once newer snapshot files are on disk.
+    bool rotate(const string& retiredPath, const vector<size_t>& salesAtCut) {
+        if (!commit()) {
+            return false;
+        }
+        {
+            lock_guard<mutex> lock(stateMutex);
+            close();
+            bool moved;
+            if (ifstream(retiredPath).is_open()) {
+                MappedFile records;
+                int retired = openForWriting(retiredPath, true);
+                moved = retired >= 0 && records.open(path)
+                        && writeAll(retired, records.view().data(), records.view().size()) && syncFile(retired);
+                if (retired >= 0) {
+                    closeFile(retired);
+                }
+                moved = moved && remove(path.c_str()) == 0;
+            } else {
+                moved = replaceFile(path, retiredPath);
+            }
+            bool reopened = open(path) && syncDirectory(path);
+            if (!moved || !reopened) {
+                return false;
+            }
+            recordCount = 0;
+        }
+        return commit(append(baseRecord(salesAtCut)));
+    }
+
+    // Records written since the last reset or rotation (including replayed ones)
+    size_t size() const {
+        lock_guard<mutex> lock(stateMutex);
+        return recordCount;
+    }
+
+    void setSize(size_t records) {
+        lock_guard<mutex> lock(stateMutex);
+        recordCount = records;
+    }
+};
+
+// Password hashing: PBKDF2-HMAC-SHA256 (RFC 8018) over a self-contained
+// SHA-256 (FIPS 180-4)
+class Sha256 {
+public:
+    static const size_t DIGEST_SIZE = 32;
+    static const size_t BLOCK_SIZE = 64;
+
+private:
+    uint32_t state[8];
+    unsigned char buffer[BLOCK_SIZE];
+    size_t buffered;
+    uint64_t length;
+
+    static uint32_t rotr(uint32_t x, int n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    void compress(const unsigned char* block) {
+        static const uint32_t K[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+                   (uint32_t)block[4 * i + 2] << 8 | (uint32_t)block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+public:
+    Sha256()
+        : state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19},
+          buffered(0), length(0) {}
+
+    void update(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        length += size;
+        if (buffered > 0) {
+            size_t take = min(size, BLOCK_SIZE - buffered);
+            memcpy(buffer + buffered, bytes, take);
+            buffered += take;
+            bytes += take;
+            size -= take;
+            if (buffered < BLOCK_SIZE) {
+                return;
+            }
+            compress(buffer);
+            buffered = 0;
+        }
+        for (; size >= BLOCK_SIZE; bytes += BLOCK_SIZE, size -= BLOCK_SIZE) {
+            compress(bytes);
+        }
+        memcpy(buffer, bytes, size);
+        buffered = size;
+    }
+
+    void finish(unsigned char digest[DIGEST_SIZE]) {
+        uint64_t bits = length * 8;
+        static const unsigned char padding[BLOCK_SIZE] = {0x80};
+        update(padding, buffered < 56 ? 56 - buffered : 120 - buffered);
+        unsigned char lengthBytes[8];
+        for (int i = 0; i < 8; i++) {
+            lengthBytes[i] = (unsigned char)(bits >> (56 - 8 * i));
+        }
+        update(lengthBytes, 8);
+        for (int i = 0; i < 8; i++) {
+            digest[4 * i] = (unsigned char)(state[i] >> 24);
+            digest[4 * i + 1] = (unsigned char)(state[i] >> 16);
+            digest[4 * i + 2] = (unsigned char)(state[i] >> 8);
+            digest[4 * i + 3] = (unsigned char)state[i];
+        }
+    }
+};
+
+// HMAC-SHA256 with both padded keys absorbed once up front, so each
+// message costs only the compressions of the message itself
+class HmacSha256 {
+private:
+    Sha256 inner;
+    Sha256 outer;
+
+public:
+    explicit HmacSha256(string_view key) {
+        unsigned char block[Sha256::BLOCK_SIZE] = {0};
+        if (key.size() > Sha256::BLOCK_SIZE) {
+            Sha256 hashed;
+            hashed.update(key.data(), key.size());
+            hashed.finish(block);
+        } else {
+            memcpy(block, key.data(), key.size());
+        }
+        unsigned char pad[Sha256::BLOCK_SIZE];
+        for (size_t i = 0; i < Sha256::BLOCK_SIZE; i++) {
+            pad[i] = block[i] ^ 0x36;
+        }
+        inner.update(pad, sizeof(pad));
+        for (size_t i = 0; i < Sha256::BLOCK_SIZE; i++) {
+            pad[i] = block[i] ^ 0x5c;
+        }
+        outer.update(pad, sizeof(pad));
+    }
+
+    void compute(const void* message, size_t size, unsigned char mac[Sha256::DIGEST_SIZE]) const {
+        Sha256 innerHash = inner;
+        innerHash.update(message, size);
+        unsigned char innerDigest[Sha256::DIGEST_SIZE];
+        innerHash.finish(innerDigest);
+        Sha256 outerHash = outer;
+        outerHash.update(innerDigest, sizeof(innerDigest));
+        outerHash.finish(mac);
+    }
+};
+
+// One 32-byte block of PBKDF2-HMAC-SHA256, which is all a password hash needs
+void pbkdf2Sha256(string_view password, string_view salt, uint32_t iterations,
+                  unsigned char key[Sha256::DIGEST_SIZE]) {
+    HmacSha256 mac(password);
+    string first(salt);
+    first.append("\0\0\0\1", 4);
+    unsigned char block[Sha256::DIGEST_SIZE];
+    mac.compute(first.data(), first.size(), block);
+    memcpy(key, block, sizeof(block));
+    for (uint32_t i = 1; i < iterations; i++) {
+        mac.compute(block, sizeof(block), block);
+        for (size_t j = 0; j < sizeof(block); j++) {
+            key[j] ^= block[j];
+        }
+    }
+}
+
+// Compares in time that depends only on the lengths, not on where the
+// first difference is
+bool constantTimeEquals(string_view a, string_view b) {
+    unsigned char difference = a.size() != b.size();
+    for (size_t i = 0; i < min(a.size(), b.size()); i++) {
+        difference |= (unsigned char)(a[i] ^ b[i]);
+    }
+    return difference == 0;
+}
+
+string toHex(const unsigned char* bytes, size_t size) {
+    static const char DIGITS[] = "0123456789abcdef";
+    string text;
+    for (size_t i = 0; i < size; i++) {
+        text += DIGITS[bytes[i] >> 4];
+        text += DIGITS[bytes[i] & 15];
+    }
+    return text;
+}
+
+bool fromHex(string_view text, string& bytes) {
+    if (text.size() % 2 != 0) {
+        return false;
+    }
+    bytes.clear();
+    for (size_t i = 0; i < text.size(); i += 2) {
+        unsigned int value = 0;
+        if (from_chars(text.data() + i, text.data() + i + 2, value, 16).ptr != text.data() + i + 2) {
+            return false;
+        }
+        bytes += (char)value;
+    }
+    return true;
+}
+
+// Stored credentials look like "pbkdf2_sha256$<iterations>$<salt>$<key>"
+// with salt and key in hex. Anything else is a plaintext password from an
+// older users.txt, still accepted until it is rehashed.
+const string CREDENTIAL_PREFIX = "pbkdf2_sha256$";
+const size_t SALT_BYTES = 16;
+
+string hashPassword(string_view password, uint32_t iterations) {
+    static thread_local random_device entropy;
+    unsigned char salt[SALT_BYTES];
+    for (size_t i = 0; i < SALT_BYTES; i += 4) {
+        uint32_t word = entropy();
+        memcpy(salt + i, &word, 4);
+    }
+    unsigned char key[Sha256::DIGEST_SIZE];
+    pbkdf2Sha256(password, string_view(reinterpret_cast<const char*>(salt), SALT_BYTES), iterations, key);
+    return CREDENTIAL_PREFIX + to_string(iterations) + "$" + toHex(salt, SALT_BYTES) + "$" + toHex(key, sizeof(key));
+}
+
+// Iteration count of a stored credential; 0 for a plaintext one
+uint32_t credentialCost(string_view credential) {
+    uint32_t iterations = 0;
+    if (credential.substr(0, CREDENTIAL_PREFIX.size()) == CREDENTIAL_PREFIX) {
+        string_view rest = credential.substr(CREDENTIAL_PREFIX.size());
+        parseNumber(rest.substr(0, rest.find('$')), iterations);
+    }
+    return iterations;
+}
+
+bool verifyPassword(string_view credential, string_view password) {
+    if (credential.substr(0, CREDENTIAL_PREFIX.size()) != CREDENTIAL_PREFIX) {
+        return constantTimeEquals(credential, password);
+    }
+    string_view rest = credential.substr(CREDENTIAL_PREFIX.size());
+    size_t saltStart = rest.find('$') + 1;
+    size_t keyStart = rest.find('$', saltStart) + 1;
+    string salt;
+    string expected;
+    uint32_t iterations;
+    if (saltStart == 0 || keyStart == 0 || !parseNumber(rest.substr(0, saltStart - 1), iterations) ||
+        iterations == 0 || !fromHex(rest.substr(saltStart, keyStart - 1 - saltStart), salt) ||
+        !fromHex(rest.substr(keyStart), expected)) {
+        return false;
+    }
+    unsigned char key[Sha256::DIGEST_SIZE];
+    pbkdf2Sha256(password, salt, iterations, key);
+    return constantTimeEquals(string_view(reinterpret_cast<const char*>(key), sizeof(key)), expected);
+}
+
+// Fixed set of threads running queued tasks, for CPU-heavy work that should
+// not hold up the thread that asks for it. Queued tasks are finished before
+// the pool is destroyed.
+class WorkerPool {
+private:
+    vector<thread> workers;
+    deque<function<void()>> tasks;
+    bool stopping;
+    mutex stateMutex;
+    condition_variable wake;
+
+public:
+    explicit WorkerPool(size_t threads) : stopping(false) {
+        for (size_t i = 0; i < max<size_t>(threads, 1); i++) {
+            workers.emplace_back([this] {
+                unique_lock<mutex> lock(stateMutex);
+                while (true) {
+                    wake.wait(lock, [this] { return stopping || !tasks.empty(); });
+                    if (tasks.empty()) {
+                        return;
+                    }
+                    function<void()> task = move(tasks.front());
+                    tasks.pop_front();
+                    lock.unlock();
+                    task();
+                    lock.lock();
+                }
+            });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    template <typename Task>
+    auto submit(Task task) -> future<decltype(task())> {
+        auto job = make_shared<packaged_task<decltype(task())()>>(move(task));
+        future<decltype(task())> result = job->get_future();
+        {
+            lock_guard<mutex> lock(stateMutex);
+            tasks.push_back([job] { (*job)(); });
+        }
+        wake.notify_one();
+        return result;
+    }
+};
+
+// A book's new stock level; -1 once the book has been deleted
+struct StockEvent {
+    PooledString bookId;
+    int quantity;
+};
+
+// One line of the reorder file
+struct ReorderSuggestion {
+    PooledString bookId;
+    int quantity;
+    int reorderQuantity;
+};
+
+// Follows stock levels through a stream of change events and keeps the
+// books at or below a threshold in an ordered set, lowest stock first.
+// Publishing only queues the event; a background worker applies each one
+// in O(log n) and, when a book falls to the threshold, appends a reorder
+// suggestion to the reorder file, one write per batch of events:
+//   <timestamp>|<book id>|<stock>|<suggested order quantity>
+class StockWatcher {
+private:
+    string path;
+    int threshold;
+    int restockLevel;
+    set<pair<int, PooledString>> lowStock;
+    unordered_map<PooledString, int> lowLevels;     // stock of each book in lowStock
+    vector<StockEvent> queued;
+    size_t suggestionsWritten;
+    bool stopping;
+    mutable mutex stateMutex;
+    mutex fileMutex;
+    condition_variable wake;
+    thread worker;
+
+    // Events that arrive this soon after the first share one batch
+    static constexpr chrono::milliseconds BATCH_WINDOW{200};
+
+    // Apply one event; returns true if the book just dropped to the threshold
+    // or ran out. Caller holds stateMutex.
+    bool apply(const StockEvent& event) {
+        auto known = lowLevels.find(event.bookId);
+        int previous = known == lowLevels.end() ? INT_MAX : known->second;
+        if (known != lowLevels.end()) {
+            lowStock.erase({known->second, event.bookId});
+            lowLevels.erase(known);
+        }
+        if (event.quantity < 0 || event.quantity > threshold) {
+            return false;
+        }
+        lowStock.insert({event.quantity, event.bookId});
+        lowLevels[event.bookId] = event.quantity;
+        return previous > threshold || (event.quantity == 0 && previous > 0);
+    }
+
+    ReorderSuggestion suggest(PooledString bookId, int quantity) const {
+        return {bookId, quantity, max(restockLevel - quantity, 1)};
+    }
+
+    bool write(const vector<ReorderSuggestion>& suggestions) {
+        lock_guard<mutex> lock(fileMutex);
+        string batch;
+        string now = to_string((int64_t)time(0));
+        for (const auto& suggestion : suggestions) {
+            batch += now + "|" + suggestion.bookId.str() + "|" + to_string(suggestion.quantity) + "|"
+                     + to_string(suggestion.reorderQuantity) + "\n";
+        }
+        ofstream file(path, ios::app);
+        file << batch;
+        return file.good();
+    }
+
+    void work() {
+        unique_lock<mutex> lock(stateMutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || !queued.empty(); });
+            if (!stopping) {
+                wake.wait_for(lock, BATCH_WINDOW, [this] { return stopping; });
+            }
+            vector<StockEvent> batch;
+            batch.swap(queued);
+            vector<ReorderSuggestion> suggestions;
+            for (const auto& event : batch) {
+                if (apply(event)) {
+                    suggestions.push_back(suggest(event.bookId, event.quantity));
+                }
+            }
+            if (!suggestions.empty()) {
+                lock.unlock();
+                bool written = write(suggestions);
+                lock.lock();
+                if (written) {
+                    suggestionsWritten += suggestions.size();
+                }
+            }
+            if (stopping && queued.empty()) {
+                return;
+            }
+        }
+    }
+
+public:
+    static const int DEFAULT_THRESHOLD = 5;
+    static const int DEFAULT_RESTOCK_LEVEL = 20;
+
+    StockWatcher()
+        : threshold(DEFAULT_THRESHOLD), restockLevel(DEFAULT_RESTOCK_LEVEL), suggestionsWritten(0), stopping(false) {}
+
+    ~StockWatcher() {
+        shutdown();
+    }
+
+    // Start watching; lowBooks holds (stock, id) for every book already at
+    // or below the threshold. Books that start out low are not suggested
+    // again until they recover and drop once more.
+    void start(const string& reorderPath, const vector<pair<int, PooledString>>& lowBooks) {
+        lock_guard<mutex> lock(stateMutex);
+        path = reorderPath;
+        for (const auto& book : lowBooks) {
+            apply({book.second, book.first});
+        }
+        stopping = false;
+        worker = thread(&StockWatcher::work, this);
+    }
+
+    // Queue a stock change; cheap enough to call with stock locks held
+    void publish(PooledString bookId, int quantity) {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            if (!worker.joinable() || stopping) {
+                return;
+            }
+            queued.push_back({bookId, quantity});
+        }
+        wake.notify_one();
+    }
+
+    // Apply and write out everything queued, then stop the worker
+    void shutdown() {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            if (!worker.joinable()) {
+                return;
+            }
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    int getThreshold() const {
+        lock_guard<mutex> lock(stateMutex);
+        return threshold;
+    }
+
+    int getRestockLevel() const {
+        lock_guard<mutex> lock(stateMutex);
+        return restockLevel;
+    }
+
+    // Change the threshold; lowBooks is every book at or below the new one
+    void configure(int newThreshold, int newRestockLevel, const vector<pair<int, PooledString>>& lowBooks) {
+        lock_guard<mutex> lock(stateMutex);
+        threshold = newThreshold;
+        restockLevel = newRestockLevel;
+        lowStock.clear();
+        lowLevels.clear();
+        for (const auto& book : lowBooks) {
+            apply({book.second, book.first});
+        }
+    }
+
+    size_t lowCount() const {
+        lock_guard<mutex> lock(stateMutex);
+        return lowStock.size();
+    }
+
+    size_t suggestionCount() const {
+        lock_guard<mutex> lock(stateMutex);
+        return suggestionsWritten;
+    }
+
+    // The n books with the least stock, as (stock, id)
+    vector<pair<int, PooledString>> lowest(size_t n) const {
+        lock_guard<mutex> lock(stateMutex);
+        vector<pair<int, PooledString>> result;
+        for (auto it = lowStock.begin(); it != lowStock.end() && result.size() < n; ++it) {
+            result.push_back(*it);
+        }
+        return result;
+    }
+
+    // Suggest a reorder for every low book now; returns how many were written
+    size_t writeReorderList() {
+        vector<ReorderSuggestion> suggestions;
+        {
+            lock_guard<mutex> lock(stateMutex);
+            for (const auto& book : lowStock) {
+                suggestions.push_back(suggest(book.second, book.first));
+            }
+        }
+        if (suggestions.empty() || !write(suggestions)) {
+            return 0;
+        }
+        lock_guard<mutex> lock(stateMutex);
+        suggestionsWritten += suggestions.size();
+        return suggestions.size();
+    }
+
+    const string& file() const {
+        return path;
+    }
+};
+
+// Runs a flush function on a background thread, when asked to and every
+// interval in any case. Requests that arrive while a flush is running are
+// folded into the next one, and nobody waits for the disk unless they ask
+// to with drain().
+class BackgroundFlusher {
+private:
+    function<void()> flush;
+    chrono::seconds interval;
+    uint64_t requested;     // requests made so far
+    uint64_t completed;     // requests covered by a finished flush
+    bool stopping;
+    mutex stateMutex;
+    condition_variable wake;
+    condition_variable finished;
+    thread worker;
+
+    void work() {
+        unique_lock<mutex> lock(stateMutex);
+        while (true) {
+            wake.wait_for(lock, interval, [this] { return stopping || requested > completed; });
+            if (stopping && requested == completed) {
+                return;
+            }
+            uint64_t covered = requested;
+            lock.unlock();
+            flush();
+            lock.lock();
+            completed = covered;
+            finished.notify_all();
+        }
+    }
+
+public:
+    BackgroundFlusher() : interval(60), requested(0), completed(0), stopping(false) {}
+
+    ~BackgroundFlusher() {
+        stop();
+    }
+
+    void start(function<void()> flushFunction, chrono::seconds every) {
+        stop();
+        flush = move(flushFunction);
+        interval = every;
+        stopping = false;
+        worker = thread([this] { work(); });
+    }
+
+    // Ask for a flush and return at once
+    void request() {
+        {
+            lock_guard<mutex> lock(stateMutex);
+            requested++;
+        }
+        wake.notify_one();
+    }
+
+    // Flush and wait for it to finish. Runs on the calling thread once the
+    // worker has stopped.
+    void drain() {
+        unique_lock<mutex> lock(stateMutex);
+        if (!worker.joinable()) {
+            lock.unlock();
+            if (flush) {
+                flush();
+            }
+            return;
+        }
+        uint64_t ticket = ++requested;
+        wake.notify_one();
+        finished.wait(lock, [this, ticket] { return completed >= ticket; });
+    }
+
+    // Finish any flush already asked for, then stop the worker
+    void stop() {
+        if (!worker.joinable()) {
+            return;
+        }
+        {
+            lock_guard<mutex> lock(stateMutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+};
+
+// Zipf-distributed ranks 0..n-1: rank k comes up with probability
+// proportional to 1 / (k + 1)^skew. Skew 0 is uniform; around 1 gives the
+// usual shape of a few bestsellers and a long tail.
+class ZipfDistribution {
+private:
+    vector<double> cdf;
+
+public:
+    ZipfDistribution(size_t n, double skew) : cdf(max<size_t>(n, 1)) {
+        double total = 0;
+        for (size_t k = 0; k < cdf.size(); k++) {
+            total += skew == 0 ? 1.0 : 1.0 / pow((double)(k + 1), skew);
+            cdf[k] = total;
+        }
+        for (auto& value : cdf) {
+            value /= total;
+        }
+    }
+
+    size_t operator()(mt19937_64& rng) const {
+        double u = (double)(rng() >> 11) * (1.0 / 9007199254740992.0);
+        size_t rank = lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        return min(rank, cdf.size() - 1);
+    }
+};
+
+// Deterministic catalogue and sales history for benchmarks: the same size,
+// skew and seed always give the same records. Title words, authors,
+// categories, customers and the books that sell are all Zipf-distributed.
+class SyntheticData {
+private:
+    size_t bookCount;
+    double skew;
+    uint64_t seed;
+
+public:
+    static const size_t VOCABULARY = 5000;
+    static const size_t CATEGORIES = 20;
+
+    SyntheticData(size_t books, double skewness, uint64_t randomSeed)
+        : bookCount(max<size_t>(books, 1)), skew(skewness), seed(randomSeed) {}
+
+    // The k-th word of the made-up vocabulary, e.g. "kalo", "mirasu"
+    static string word(size_t k) {
+        static const char* SYLLABLES[] = {"ka", "lo", "mi", "ra", "su", "te", "no", "vi",
+                                          "da", "pe", "zu", "ho", "ni", "ge", "ba", "fu"};
+        string result;
+        do {
+            result += SYLLABLES[k % 16];
+            k /= 16;
+        } while (k > 0 || result.size() < 4);
+        return result;
+    }
+
+    static string bookId(size_t index) {
+        return "B" + to_string(index);
+    }
+
+    void generateBooks(vector<Book>& books) const {
+        mt19937_64 rng(seed);
+        ZipfDistribution words(VOCABULARY, skew);
+        ZipfDistribution authors(max<size_t>(bookCount / 10, 1), skew);
+        ZipfDistribution categories(CATEGORIES, skew);
+        books.clear();
+        books.resize(bookCount);
+        for (size_t i = 0; i < bookCount; i++) {
+            Book& book = books[i];
+            book.id = bookId(i);
+            size_t titleWords = 1 + rng() % 4;
+            string title;
+            for (size_t w = 0; w < titleWords; w++) {
+                string next = word(words(rng));
+                next[0] = (char)toupper((unsigned char)next[0]);
+                title += (w ? " " : "") + next;
+            }
+            book.title = title;
+            book.author = "Author " + to_string(authors(rng));
+            book.category = "Category " + to_string(categories(rng));
+            book.price = Money::fromCents(100 + rng() % 9900);
+            book.quantity = 10000 + (int)(rng() % 10000);   // enough that benchmark sales never run out
+            book.dateAdded = 1700000000 + (int64_t)(rng() % 31536000);
+        }
+    }
+
+    void generateSales(const vector<Book>& books, size_t count, SalesHistory& sales) const {
+        mt19937_64 rng(seed + 1);
+        ZipfDistribution sold(books.size(), skew);
+        ZipfDistribution customers(max<size_t>(count / 5, 1), skew);
+        int64_t date = 1700000000;
+        sales.clear();
+        sales.resize(books.empty() ? 0 : count);
+        for (size_t i = 0; i < sales.size(); i++) {
+            const Book& book = books[sold(rng)];
+            Sale& sale = sales[i];
+            sale.saleId = "S" + to_string(i + 1);
+            sale.bookId = book.id;
+            sale.bookTitle = book.title;
+            sale.quantity = 1 + (int)(rng() % 3);
+            sale.totalAmount = sale.quantity * book.price;
+            date += rng() % 120;
+            sale.date = date;
+            sale.customerName = "Customer " + to_string(customers(rng));
+        }
+    }
+
+    // Book ids to look up or sell, most popular most often
+    vector<string> workloadIds(size_t count) const {
+        mt19937_64 rng(seed + 2);
+        ZipfDistribution popular(bookCount, skew);
+        vector<string> ids(count);
+        for (auto& id : ids) {
+            id = bookId(popular(rng));
+        }
+        return ids;
+    }
+
+    // Search queries: a word prefix, sometimes followed by a second word
+    vector<string> workloadQueries(size_t count) const {
+        mt19937_64 rng(seed + 3);
+        ZipfDistribution words(VOCABULARY, skew);
+        vector<string> queries(count);
+        for (auto& query : queries) {
+            string first = word(words(rng));
+            query = first.substr(0, 3 + rng() % (first.size() - 2));
+            if (rng() % 4 == 0) {
+                query += " " + word(words(rng));
+            }
+        }
+        // Every tenth query is cut short as if still being typed: one or
+        // two letters, or a word and the first digit of a number
+        for (size_t i = 9; i < count; i += 10) {
+            if (i / 10 % 2 == 0) {
+                queries[i] = queries[i].substr(0, 1 + i / 20 % 2);
+            } else {
+                queries[i] = word(words(rng)) + " " + to_string(1 + rng() % 9);
+            }
+        }
+        return queries;
+    }
+};
+
+// What --bench measures and where the results go
+struct BenchmarkOptions {
+    vector<size_t> sizes = {1000, 10000, 100000, 1000000};
+    double skew = 0.99;
+    uint64_t seed = 42;
+    int repeat = 3;
+    string jsonPath;        // "-" for stdout, empty for no JSON
+};
+
+// Timings of one operation at one data size. Latencies are per timed
+// operation; items counts the records or requests they handled in total.
+struct BenchmarkResult {
+    size_t records;
+    string operation;
+    size_t ops;
+    size_t items;
+    double seconds;
+    double p50Ns;
+    double p90Ns;
+    double p99Ns;
+    double maxNs;
+
+    static BenchmarkResult from(size_t records, const string& operation, vector<double>& latenciesNs,
+                                size_t itemsPerOp) {
+        BenchmarkResult result = {records, operation, latenciesNs.size(), latenciesNs.size() * itemsPerOp,
+                                  0.0, 0.0, 0.0, 0.0, 0.0};
+        if (latenciesNs.empty()) {
+            return result;
+        }
+        for (double ns : latenciesNs) {
+            result.seconds += ns / 1e9;
+        }
+        auto percentile = [&latenciesNs](double p) {
+            // Nearest rank, so the p50 of two samples is the lower one
+            size_t rank = (size_t)max(1.0, ceil(p * latenciesNs.size())) - 1;
+            nth_element(latenciesNs.begin(), latenciesNs.begin() + rank, latenciesNs.end());
+            return latenciesNs[rank];
+        };
+        result.p50Ns = percentile(0.50);
+        result.p90Ns = percentile(0.90);
+        result.p99Ns = percentile(0.99);
+        result.maxNs = *max_element(latenciesNs.begin(), latenciesNs.end());
+        return result;
+    }
+
+    double itemsPerSecond() const {
+        return seconds > 0 ? items / seconds : 0.0;
+    }
+};
+
+// Keeps benchmark loops from being optimized away
+volatile long benchmarkSink = 0;
+
+class BookshopManager {
+private:
+    vector<Book> books;
+    BookIndex bookIndex;
+    CatalogueOrder catalogueOrder;
+    SearchIndex searchIndex;
+    // Range indexes for the catalogue views; categoryIndex is ordered by
+    // price within each category
+    BookRangeIndex<Money> priceIndex;
+    BookRangeIndex<pair<PooledString, Money>> categoryIndex;
+    // The sales history, split by book id; see shardOf(). Changing the
+    // shard count needs the sales files split up again.
+    static const size_t SALES_SHARDS = 8;
+    array<SalesShard, SALES_SHARDS> shards;
+    // The stock index is split the same way, so a sale only locks its own
+    // shard's part; walkStock() merges the parts back into one order
+    struct StockIndexShard {
+        mutex lock;
+        BookRangeIndex<int> index;
+    };
+    array<StockIndexShard, SALES_SHARDS> stockIndexes;
+    atomic<size_t> totalSales;
+    // Past versions of the catalogue for reports; see Snapshot. epochs
+    // frees versions, and time indexes the shards have replaced, once no
+    // snapshot can see them. It goes first, while what it frees is still
+    // there.
+    CatalogueVersions catalogueVersions;
+    mutable EpochReclaimer epochs;
+    bool isLoggedIn;
+    string currentUser;
+    string currentRole;
+    
+    // File names for data storage, inside the data directory. Each sales
+    // shard has its own file, see salesShardFile(), and its sealed sales
+    // are in segments, see segmentFile(); SALES_FILE and SALES_SNAPSHOT
+    // held the whole history before it was sharded.
+    const string DATA_DIRECTORY;
+    const string BOOKS_FILE;
+    const string SALES_FILE;
+    const string USERS_FILE;
+    const string JOURNAL_FILE;
+    const string RETIRED_JOURNAL_FILE;
+    const string BOOKS_SNAPSHOT;
+    const string SALES_SNAPSHOT;
+    const string REORDER_FILE;
+    const string METRICS_FILE;
+
+    // Snapshots are kept in the binary format once books.bin or a sales
+    // .bin file exists
+    bool binarySnapshots;
+
+    // Sales in each shard's file, so checkpoints only rewrite the shards
+    // that have new sales; SIZE_MAX forces a rewrite. Guarded by
+    // checkpointMutex once loading is done.
+    vector<size_t> persistedSales;
+    // The sales were loaded from a pre-shard sales.bin or sales.txt, which
+    // goes once a checkpoint has written every shard file
+    bool legacySalesFiles;
+
+    // Sales made before the current calendar month and the hotMonths - 1
+    // before it are sealed into cold segments by checkpoints, so memory
+    // holds only those months; 0 keeps every sale in memory
+    static const int DEFAULT_HOT_MONTHS = 1;
+    const int hotMonths;
+
+    // Journal records allowed before they are folded into the snapshot files
+    const size_t JOURNAL_COMPACT_THRESHOLD = 10000;
+    SalesJournal journal;
+
+    // Checkpoints run on the flusher thread: when the journal reaches the
+    // threshold, every FLUSH_INTERVAL if anything changed, and on exit.
+    // checkpointMutex lets only one run at a time.
+    const chrono::seconds FLUSH_INTERVAL{60};
+    BackgroundFlusher flusher;
+    mutex checkpointMutex;
+    atomic<bool> usersDirty;
+
+    // Concurrency for checkouts from many threads. Sales hold the catalogue
+    // lock shared and anything that adds, removes or rewrites books holds it
+    // exclusively. Stock levels are guarded by striped locks keyed on the
+    // book id, and each sales shard's lock guards its part of the history,
+    // so sales in different shards never wait for each other. Lock order:
+    // catalogueMutex, stock stripes, shard locks (several of either only in
+    // ascending index order).
+    // Each part of stockIndexes has its own lock, taken alone by stock
+    // changes and all together, in ascending order, by walks in stock
+    // order; no stripe or shard lock is taken while one is held. Reports
+    // read a Snapshot and hold no lock while they scan.
+    shared_mutex catalogueMutex;
+    array<mutex, 256> stockLocks;
+    atomic<uint64_t> nextSaleNumber;
+    static const size_t MAX_CART_LINES = 100;
+
+    // Low-stock alerts, fed by every change to a book's stock
+    StockWatcher stockWatcher;
+
+    // Periodic metrics file for scraping
+    const chrono::seconds METRICS_DUMP_INTERVAL{10};
+    MetricsDumper metricsDumper;
+
+    // Users by name. Logins copy a user out under usersMutex and check the
+    // password on authPool, so slow hashing never holds the lock or keeps
+    // other terminals waiting.
+    unordered_map<string, User> users;
+    mutable mutex usersMutex;
+    WorkerPool authPool;
+    // Cost for new password hashes; weaker ones are rehashed at login
+    const uint32_t PASSWORD_ITERATIONS = 100000;
+
+    // Books and sales may load on a background thread while the menu is
+    // already up; awaitData() blocks until they are in
+    thread loader;
+    mutex loadMutex;
+    condition_variable loadDone;
+    atomic<bool> dataLoaded;
+
+public:
+    // dataDirectory is prefixed to every data file name, e.g. "data/".
+    // With loadInBackground the constructor returns once the users are in,
+    // and books and sales keep loading; see awaitData().
+    explicit BookshopManager(const string& dataDirectory = "", bool loadInBackground = false,
+                             int hotWindowMonths = DEFAULT_HOT_MONTHS)
+        : totalSales(0), isLoggedIn(false), currentUser(""), currentRole(""),
+          DATA_DIRECTORY(dataDirectory), BOOKS_FILE(dataDirectory + "books.txt"), SALES_FILE(dataDirectory + "sales.txt"),
+          USERS_FILE(dataDirectory + "users.txt"), JOURNAL_FILE(dataDirectory + "journal.txt"),
+          RETIRED_JOURNAL_FILE(dataDirectory + "journal.old"), BOOKS_SNAPSHOT(dataDirectory + "books.bin"), SALES_SNAPSHOT(dataDirectory + "sales.bin"),
+          REORDER_FILE(dataDirectory + "reorders.txt"), METRICS_FILE(dataDirectory + "metrics.prom"),
+          binarySnapshots(false), persistedSales(SALES_SHARDS, 0), legacySalesFiles(false), hotMonths(hotWindowMonths),
+          usersDirty(false), nextSaleNumber(1),
+          authPool(max(1u, min(4u, thread::hardware_concurrency()))), dataLoaded(false) {
+        loadUsers();
+        initializeDefaultUsers();
+        if (loadInBackground) {
+            loader = thread([this] { loadData(); });
+        } else {
+            loadData();
+        }
+    }
+
+    ~BookshopManager() {
+        shutdown();
+    }
+
+    // Stop background work, writing out anything it still holds
+    void shutdown() {
+        if (loader.joinable()) {
+            loader.join();
+        }
+        flusher.stop();
+        stockWatcher.shutdown();
+        metricsDumper.stop();
+    }
+
+    // Wait for books and sales to finish loading
+    void awaitData() {
+        if (dataLoaded) {
+            return;
+        }
+        cout << "\nLoading books and sales, please wait...\n";
+        cout.flush();
+        unique_lock<mutex> lock(loadMutex);
+        loadDone.wait(lock, [this] { return dataLoaded.load(); });
+    }
+
+    // Keep METRICS_FILE up to date until shutdown()
+    void startMetricsDump() {
+        metricsDumper.start(METRICS_FILE, METRICS_DUMP_INTERVAL);
+    }
+
+    // Add the default users that are not on file, hashing their passwords
+    // in parallel
+    void initializeDefaultUsers() {
+        static const User DEFAULTS[] = {{"admin", "admin123", "admin"},
+                                        {"staff", "staff123", "staff"},
+                                        {"manager", "manager123", "manager"}};
+        vector<pair<User, future<string>>> added;
+        for (const User& user : DEFAULTS) {
+            if (!users.count(user.username)) {
+                string password = user.credential;
+                added.push_back({user, authPool.submit([this, password] {
+                    return hashPassword(password, PASSWORD_ITERATIONS);
+                })});
+            }
+        }
+        lock_guard<mutex> lock(usersMutex);
+        for (auto& entry : added) {
+            entry.first.credential = entry.second.get();
+            users.emplace(entry.first.username, entry.first);
+            usersDirty = true;
+        }
+    }
+
+    // Get current date and time as seconds since the epoch
+    static int64_t getCurrentTimestamp() {
+        return (int64_t)time(0);
+    }
+
+    // Clear screen function
+    void clearScreen() {
+        #ifdef _WIN32
+            system("cls");
+        #else
+            system("clear");
+        #endif
+    }
+
+    // Input validation functions
+    int getValidatedInt(const string& prompt, int min = 0, int max = INT_MAX) {
+        int value;
+        while (true) {
+            cout << prompt;
+            if (cin >> value && value >= min && value <= max) {
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                return value;
+            } else {
+                cout << "Invalid input! Please enter a number between " << min << " and " << max << ".\n";
+                cin.clear();
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            }
+        }
+    }
+
+    Money getValidatedMoney(const string& prompt, Money min = Money()) {
+        string text;
+        Money value;
+        while (true) {
+            cout << prompt;
+            if (cin >> text && Money::parse(text, value) && value >= min) {
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');
+                return value;
+            } else {
+                cout << "Invalid input! Please enter an amount >= " << min << ".\n";
+                cin.clear();
+                cin.ignore(numeric_limits<streamsize>::max(), '\n');
+            }
+        }
+    }
+
+    string getValidatedString(const string& prompt) {
+        string value;
+        while (true) {
+            cout << prompt;
+            getline(cin, value);
+            if (!value.empty()) {
+                return value;
+            }
+            cout << "Input cannot be empty! Please try again.\n";
+        }
+    }
+
+    // Book lookup functions
+    vector<Book>::iterator findBook(string_view id) {
+        METRIC_ADD(BookLookups, 1);
+        METRIC_TIME_SAMPLED(BookLookup, 6);
+        long slot = bookIndex.find(id, books);
+        return slot < 0 ? books.end() : books.begin() + slot;
+    }
+
+    void addToRangeIndexes(const Book& book) {
+        priceIndex.insert(book.price, book.id);
+        categoryIndex.insert({categoryKey(book.category), book.price}, book.id);
+        StockIndexShard& stock = stockIndexes[shardOf(book.id)];
+        lock_guard<mutex> guard(stock.lock);
+        stock.index.insert(book.quantity, book.id);
+    }
+
+    void removeFromRangeIndexes(const Book& book) {
+        priceIndex.erase(book.price, book.id);
+        categoryIndex.erase({categoryKey(book.category), book.price}, book.id);
+        StockIndexShard& stock = stockIndexes[shardOf(book.id)];
+        lock_guard<mutex> guard(stock.lock);
+        stock.index.erase(book.quantity, book.id);
+    }
+
+    void insertBook(const Book& book) {
+        books.push_back(book);
+        if (!bookIndex.insert(book.id, (uint32_t)(books.size() - 1), books)) {
+            books.pop_back();
+            return;
+        }
+        catalogueOrder.push();
+        searchIndex.add(book);
+        addToRangeIndexes(book);
+        catalogueVersions.commit(book, false, epochs);
+    }
+
+    void replaceBook(vector<Book>::iterator it, const Book& book) {
+        removeFromRangeIndexes(*it);
+        *it = book;
+        searchIndex.add(book);
+        addToRangeIndexes(book);
+        catalogueVersions.commit(book, false, epochs);
+    }
+
+    // The last book moves into the hole, so a delete costs the same at any
+    // catalogue size; catalogueOrder keeps the order books were added in
+    void eraseBook(vector<Book>::iterator it) {
+        catalogueVersions.commit(*it, true, epochs);
+        searchIndex.remove(it->id);
+        removeFromRangeIndexes(*it);
+        bookIndex.erase(it->id, books);
+        catalogueOrder.erase((uint32_t)(it - books.begin()));
+        if (it != books.end() - 1) {
+            *it = move(books.back());
+        }
+        books.pop_back();
+    }
+
+    // Copy of the books in catalogue order, for the snapshot writers
+    vector<Book> booksInCatalogueOrder() const {
+        vector<Book> ordered;
+        ordered.reserve(books.size());
+        catalogueOrder.forEach([&](uint32_t slot) { ordered.push_back(books[slot]); });
+        return ordered;
+    }
+
+    // Change a stock level; callers hold the book's stock stripe once other
+    // threads may be selling
+    void setStock(Book& book, int quantity) {
+        StockIndexShard& stock = stockIndexes[shardOf(book.id)];
+        lock_guard<mutex> guard(stock.lock);
+        stock.index.erase(book.quantity, book.id);
+        book.quantity = quantity;
+        stock.index.insert(book.quantity, book.id);
+    }
+
+    // Visit the (stock, id) entries of every shard with at most last copies
+    // in ascending order, starting at resume if given, until visit returns
+    // false. The shards' parts are merged in step under all their locks.
+    template <typename Visit>
+    void walkStock(int last, const optional<pair<int, PooledString>>& resume, Visit visit) {
+        using Cursor = BookRangeIndex<int>::Cursor;
+        array<unique_lock<mutex>, SALES_SHARDS> guards;
+        array<Cursor, SALES_SHARDS> cursors;
+        for (size_t k = 0; k < SALES_SHARDS; k++) {
+            guards[k] = unique_lock<mutex>(stockIndexes[k].lock);
+            cursors[k] = stockIndexes[k].index.start(INT_MIN, resume);
+        }
+        while (true) {
+            size_t next = SALES_SHARDS;
+            for (size_t k = 0; k < SALES_SHARDS; k++) {
+                if (cursors[k] != stockIndexes[k].index.end() && cursors[k]->first <= last
+                    && (next == SALES_SHARDS || *cursors[k] < *cursors[next])) {
+                    next = k;
+                }
+            }
+            if (next == SALES_SHARDS || !visit(*cursors[next])) {
+                return;
+            }
+            ++cursors[next];
+        }
+    }
+
+    // (stock, id) of every book with at most threshold copies, lowest first
+    vector<pair<int, PooledString>> booksAtOrBelow(int threshold) {
+        vector<pair<int, PooledString>> result;
+        walkStock(threshold, {}, [&](const pair<int, PooledString>& entry) {
+            result.push_back(entry);
+            return true;
+        });
+        return result;
+    }
+
+    void rebuildBookIndexes() {
+        bookIndex.rebuild(books);
+        catalogueOrder.rebuild(books.size());
+        searchIndex.rebuild(books);
+        priceIndex.clear();
+        categoryIndex.clear();
+        for (auto& stock : stockIndexes) {
+            lock_guard<mutex> guard(stock.lock);
+            stock.index.clear();
+        }
+        for (const auto& book : books) {
+            addToRangeIndexes(book);
+        }
+        catalogueVersions.rebuild(books, epochs);
+    }
+
+    // Add a sale to its shard's history, columns and running totals;
+    // callers hold the shard's lock once other threads may be selling
+    void recordSale(const Sale& sale) {
+        shardFor(sale.bookId).record(sale, epochs);
+        totalSales++;
+    }
+
+    // Split a generated history into the shards; for the benchmarks, before
+    // any sales are made
+    void adoptSales(const SalesHistory& history) {
+        for (const auto& sale : history) {
+            shardFor(sale.bookId).hot->sales.push_back(sale);
+        }
+        parallelParts(SALES_SHARDS, SALES_SHARDS, [this](size_t, size_t first, size_t last) {
+            for (size_t k = first; k < last; k++) {
+                shards[k].rebuildDerived();
+            }
+        });
+        totalSales = history.size();
+    }
+
+    // Sales in each shard, sealed or not; callers hold the shard locks or
+    // keep sellers out
+    vector<size_t> shardSizes() const {
+        vector<size_t> sizes;
+        for (const auto& shard : shards) {
+            sizes.push_back(shard.size());
+        }
+        return sizes;
+    }
+
+    vector<unique_lock<mutex>> lockAllShards() const {
+        vector<unique_lock<mutex>> locks;
+        for (const auto& shard : shards) {
+            locks.emplace_back(shard.lock);
+        }
+        return locks;
+    }
+
+    // Every sale of a shard, the sealed ones read back from their segments;
+    // callers hold the shard's lock
+    template <typename Visit>
+    static void forEachRecordedSale(const SalesShard& shard, Visit visit) {
+        for (const auto& segment : *shard.cold) {
+            segment->forEachSale(visit);
+        }
+        for (const auto& sale : shard.hot->sales) {
+            visit(sale);
+        }
+    }
+
+    static SalesAggregates recomputeAggregates(const SalesShard& shard) {
+        SalesAggregates expected;
+        forEachRecordedSale(shard, [&expected](const Sale& sale) { expected.apply(sale); });
+        return expected;
+    }
+
+    // Check the running totals against a full recomputation, which reads
+    // every sealed sale back from its segment
+    bool checkAggregates() {
+        METRIC_TIME(Report);
+        METRIC_ADD(RecordsScanned, totalSales);
+        vector<string> problems;
+        for (size_t k = 0; k < SALES_SHARDS; k++) {
+            lock_guard<mutex> history(shards[k].lock);
+            vector<string> shardProblems;
+            shards[k].aggregates.verify(recomputeAggregates(shards[k]), shardProblems);
+            for (const auto& problem : shardProblems) {
+                problems.push_back("shard " + to_string(k) + ": " + problem);
+            }
+        }
+        if (problems.empty()) {
+            cout << "✓ Sales aggregates match a full recomputation over "
+                 << totalSales << " sales.\n";
+            return true;
+        }
+        cout << "✗ Sales aggregates are inconsistent:\n";
+        for (const auto& problem : problems) {
+            cout << "  - " << problem << "\n";
+        }
+        return false;
+    }
+
+    // File I/O functions
+    // Books and sales are parsed in parallel, then the journal is replayed
+    // over both and the background workers that need them are started
+    void loadData() {
+        {
+            METRIC_TIME(LoadData);
+            binarySnapshots = fileExists(BOOKS_SNAPSHOT) || fileExists(SALES_SNAPSHOT);
+            for (size_t k = 0; k < SALES_SHARDS; k++) {
+                binarySnapshots = binarySnapshots || fileExists(salesShardFile(k, true));
+            }
+            thread bookLoader([this] { loadBooks(); });
+            loadSales();
+            bookLoader.join();
+            bool unfinishedCheckpoint = replayJournal();
+            initializeSaleCounter();
+            METRIC_ADD(RecordsLoaded, books.size() + totalSales);
+            if (unfinishedCheckpoint || legacySalesFiles || salesToSeal()) {
+                checkpoint();
+            }
+        }
+        hashPlaintextPasswords();
+        stockWatcher.start(REORDER_FILE, booksAtOrBelow(StockWatcher::DEFAULT_THRESHOLD));
+        flusher.start([this] { flushDirtyState(); }, FLUSH_INTERVAL);
+        {
+            lock_guard<mutex> lock(loadMutex);
+            dataLoaded = true;
+        }
+        loadDone.notify_all();
+    }
+
+    // Continue numbering after the highest "S<n>" sale ID on file; each
+    // segment notes its own
+    void initializeSaleCounter() {
+        uint64_t highest = 0;
+        for (const auto& shard : shards) {
+            for (const auto& sale : shard.hot->sales) {
+                uint64_t number = 0;
+                if (sale.saleId.size() > 1 && parseNumber(string_view(sale.saleId).substr(1), number)) {
+                    highest = max(highest, number);
+                }
+            }
+            for (const auto& segment : *shard.cold) {
+                highest = max(highest, segment->highestSaleNumber());
+            }
+        }
+        nextSaleNumber = max<uint64_t>(highest, totalSales) + 1;
+    }
+
+    size_t stockStripe(string_view bookId) const {
+        return std::hash<string_view>()(bookId) % stockLocks.size();
+    }
+
+    // Stripes nest in shards: every book on stripe s is in shard
+    // s % SALES_SHARDS
+    size_t shardOf(string_view bookId) const {
+        return stockStripe(bookId) % SALES_SHARDS;
+    }
+
+    SalesShard& shardFor(string_view bookId) {
+        return shards[shardOf(bookId)];
+    }
+
+    string salesShardFile(size_t shard, bool binary) const {
+        return DATA_DIRECTORY + "sales-" + to_string(shard) + (binary ? ".bin" : ".txt");
+    }
+
+    // The segment holding a shard's sales from its first'th on. The next
+    // one starts where it ends, so a shard's segments are found by
+    // following them from 0 to the sealed count in the shard's file.
+    string segmentFile(size_t shard, size_t first) const {
+        return DATA_DIRECTORY + "sales-" + to_string(shard) + "-" + to_string(first) + ".seg";
+    }
+
+    mutex& stockLockFor(string_view bookId) {
+        return stockLocks[stockStripe(bookId)];
+    }
+
+    // Write everything that changed to disk and wait for it
+    void saveData() {
+        awaitData();
+        METRIC_TIME(SaveData);
+        flusher.drain();
+    }
+
+    // Record parsing and formatting shared by the snapshot files and the journal
+    bool parseBookLine(string_view line, Book& book) {
+        string_view fields[7];
+        if (splitFields(line, fields, 7) != 7 || fields[0].empty()) {
+            return false;
+        }
+        book.id.assign(fields[0]);
+        book.title.assign(fields[1]);
+        book.author.assign(fields[2]);
+        book.category.assign(fields[3]);
+        return Money::parse(fields[4], book.price) && parseNumber(fields[5], book.quantity) &&
+               parseTimestamp(fields[6], book.dateAdded);
+    }
+
+    // Fields joined with '|', numbers written without the locale or iostreams
+    string formatBookLine(const Book& book) {
+        string line;
+        line.reserve(96);
+        line += book.id;
+        line += '|';
+        line += book.title;
+        line += '|';
+        line += book.author;
+        line += '|';
+        line += book.category;
+        line += '|';
+        book.price.appendTo(line);
+        line += '|';
+        appendNumber(line, book.quantity);
+        line += '|';
+        appendNumber(line, book.dateAdded);
+        return line;
+    }
+
+    bool parseSaleLine(string_view line, Sale& sale) {
+        string_view fields[7];
+        if (splitFields(line, fields, 7) != 7 || fields[0].empty()) {
+            return false;
+        }
+        sale.saleId.assign(fields[0]);
+        sale.bookId.assign(fields[1]);
+        sale.bookTitle.assign(fields[2]);
+        sale.customerName.assign(fields[6]);
+        return parseNumber(fields[3], sale.quantity) && Money::parse(fields[4], sale.totalAmount) &&
+               parseTimestamp(fields[5], sale.date);
+    }
+
+    string formatSaleLine(const Sale& sale) {
+        string line;
+        line.reserve(96);
+        line += sale.saleId;
+        line += '|';
+        line += sale.bookId;
+        line += '|';
+        line += sale.bookTitle;
+        line += '|';
+        appendNumber(line, sale.quantity);
+        line += '|';
+        sale.totalAmount.appendTo(line);
+        line += '|';
+        appendNumber(line, sale.date);
+        line += '|';
+        line += sale.customerName;
+        return line;
+    }
+
+    static bool fileExists(const string& path) {
+        ifstream file(path);
+        return file.is_open();
+    }
+
+    void loadBooks() {
+        books.clear();
+        if (fileExists(BOOKS_SNAPSHOT)) {
+            string error;
+            if (BinarySnapshot::readBooks(BOOKS_SNAPSHOT, books, error)) {
+                rebuildBookIndexes();
+                return;
+            }
+            cout << "✗ Warning: " << error << "; loading " << BOOKS_FILE << " instead.\n";
+            books.clear();
+        }
+        loadBooksText();
+    }
+
+    void loadBooksText() {
+        MappedFile file;
+        if (file.open(BOOKS_FILE)) {
+            string_view text = file.view();
+            books.reserve(count(text.begin(), text.end(), '\n') + 1);
+            forEachLine(text, true, [this](string_view line) {
+                if (!line.empty()) {
+                    Book book;
+                    if (parseBookLine(line, book)) {
+                        books.push_back(move(book));
+                    }
+                }
+            });
+        }
+        rebuildBookIndexes();
+    }
+
+    bool saveBooks(const vector<Book>& catalogue, bool binary) {
+        if (!binary) {
+            return saveBooksText(catalogue);
+        }
+        if (!BinarySnapshot::writeBooks(BOOKS_SNAPSHOT, catalogue)) {
+            cout << "\n✗ Warning: could not write " << BOOKS_SNAPSHOT << "!\n";
+            return false;
+        }
+        return true;
+    }
+
+    bool saveBooksText(const vector<Book>& catalogue) {
+        AtomicFile file(BOOKS_FILE);
+        for (const auto& book : catalogue) {
+            file.write(formatBookLine(book) + "\n");
+        }
+        if (!file.commit()) {
+            cout << "\n✗ Warning: could not write " << BOOKS_FILE << "!\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Each shard's file is read on its own thread. A sales.bin or
+    // sales.txt from before the history was sharded takes precedence; its
+    // sales are split up here and it is replaced at the next checkpoint.
+    // Sealed sales stay in their segments, which are only mapped; their
+    // summaries go into the running totals.
+    void loadSales() {
+        legacySalesFiles = fileExists(SALES_SNAPSHOT) || fileExists(SALES_FILE);
+        if (legacySalesFiles) {
+            SalesHistory history;
+            string error;
+            size_t sealed = 0;
+            if (!fileExists(SALES_SNAPSHOT) || !BinarySnapshot::readSales(SALES_SNAPSHOT, history, sealed, error)) {
+                if (!error.empty()) {
+                    cout << "✗ Warning: " << error << "; loading " << SALES_FILE << " instead.\n";
+                }
+                history.clear();
+                loadSalesText(SALES_FILE, history, sealed);
+            }
+            for (const auto& sale : history) {
+                shardFor(sale.bookId).hot->sales.push_back(sale);
+            }
+            fill(persistedSales.begin(), persistedSales.end(), SIZE_MAX);
+        }
+        parallelParts(SALES_SHARDS, SALES_SHARDS, [this](size_t, size_t first, size_t last) {
+            for (size_t k = first; k < last; k++) {
+                if (!legacySalesFiles) {
+                    loadSalesShard(k);
+                }
+                shards[k].rebuildDerived();
+            }
+        });
+        size_t count = 0;
+        for (const auto& shard : shards) {
+            count += shard.size();
+        }
+        totalSales = count;
+    }
+
+    void loadSalesShard(size_t k) {
+        SalesShard& shard = shards[k];
+        SalesHistory& sales = shard.hot->sales;
+        string snapshot = salesShardFile(k, true);
+        if (fileExists(snapshot)) {
+            string error;
+            if (BinarySnapshot::readSales(snapshot, sales, shard.sealed, error)) {
+                persistedSales[k] = shard.size();
+                loadSegments(k);
+                return;
+            }
+            cout << "✗ Warning: " << error << "; loading " << salesShardFile(k, false) << " instead.\n";
+            sales.clear();
+            persistedSales[k] = SIZE_MAX;
+            loadSalesText(salesShardFile(k, false), sales, shard.sealed);
+            loadSegments(k);
+            return;
+        }
+        loadSalesText(salesShardFile(k, false), sales, shard.sealed);
+        persistedSales[k] = shard.size();
+        loadSegments(k);
+    }
+
+    // Map the segments of shard k's sealed sales, following them from the
+    // first to the sealed count the shard's file gave. A segment past that
+    // count was left by a checkpoint that stopped before the file was
+    // rewritten, and the next one to seal overwrites it.
+    void loadSegments(size_t k) {
+        SalesShard& shard = shards[k];
+        unique_ptr<ColdSegments> cold(new ColdSegments());
+        size_t found = 0;
+        while (found < shard.sealed) {
+            shared_ptr<SegmentFile> segment = make_shared<SegmentFile>();
+            string error;
+            if (!segment->open(segmentFile(k, found), error)) {
+                cout << "✗ Warning: " << error << "; sales " << found << " to " << shard.sealed
+                     << " of shard " << k << " are missing.\n";
+                break;
+            }
+            if (segment->first() != found || segment->end() > shard.sealed) {
+                cout << "✗ Warning: " << segment->fileName() << " does not follow on from the segments before it.\n";
+                break;
+            }
+            found = segment->end();
+            cold->push_back(segment);
+        }
+        shard.cold.reset(cold.release());
+    }
+
+    // Sale lines, after a "#sealed|<n>" line if the shard has sealed sales
+    void loadSalesText(const string& path, SalesHistory& sales, size_t& sealed) {
+        sealed = 0;
+        MappedFile file;
+        if (file.open(path)) {
+            forEachLine(file.view(), true, [this, &sales, &sealed](string_view line) {
+                if (line.substr(0, 8) == "#sealed|") {
+                    parseNumber(line.substr(8), sealed);
+                } else if (!line.empty()) {
+                    Sale sale;
+                    if (parseSaleLine(line, sale)) {
+                        sales.push_back(move(sale));
+                    }
+                }
+            });
+        }
+    }
+
+    static vector<size_t> allShards() {
+        vector<size_t> which;
+        for (size_t k = 0; k < SALES_SHARDS; k++) {
+            which.push_back(k);
+        }
+        return which;
+    }
+
+    // Save the first counts[k] sales of each shard k in 'which', the shards
+    // on their own threads. Recorded sales never change, so this needs no
+    // lock while later ones are appended.
+    bool saveSales(const vector<size_t>& which, const vector<size_t>& counts, bool binary) {
+        vector<char> written(which.size());
+        parallelParts(which.size(), which.size(), [&](size_t, size_t first, size_t last) {
+            for (size_t i = first; i < last; i++) {
+                written[i] = saveSalesShard(which[i], counts[which[i]], binary);
+            }
+        });
+        return count(written.begin(), written.end(), 0) == 0;
+    }
+
+    // Only the hot sales are written; the file notes how many were sealed
+    // before them. Sealing happens on the same thread as this, so neither
+    // changes while it runs.
+    bool saveSalesShard(size_t k, size_t count, bool binary) {
+        const SalesHistory& sales = shards[k].hot->sales;
+        size_t sealed = shards[k].sealed;
+        string path = salesShardFile(k, binary);
+        bool saved;
+        if (binary) {
+            saved = BinarySnapshot::writeSales(path, sales, count - sealed, sealed);
+        } else {
+            AtomicFile file(path);
+            if (sealed > 0) {
+                file.write("#sealed|" + to_string(sealed) + "\n");
+            }
+            for (size_t i = 0; i < count - sealed; i++) {
+                file.write(formatSaleLine(sales[i]) + "\n");
+            }
+            saved = file.commit();
+        }
+        if (!saved) {
+            cout << "\n✗ Warning: could not write " << path << "!\n";
+        }
+        return saved;
+    }
+
+    // Snapshot format conversion
+    // Switch to binary snapshots and write them all from the current state
+    void importText() {
+        {
+            lock_guard<mutex> serial(checkpointMutex);
+            unique_lock<shared_mutex> catalogue(catalogueMutex);
+            binarySnapshots = true;
+            fill(persistedSales.begin(), persistedSales.end(), SIZE_MAX);
+        }
+        checkpoint();
+        cout << "✓ Wrote " << books.size() << " books to " << BOOKS_SNAPSHOT << " and "
+             << totalSales << " sales to " << salesShardFile(0, true) << " .. "
+             << salesShardFile(SALES_SHARDS - 1, true) << "\n";
+    }
+
+    // Write the current state to the text files, whatever format is in use
+    void exportText() {
+        saveBooksText(booksInCatalogueOrder());
+        saveSales(allShards(), shardSizes(), false);
+        cout << "✓ Wrote " << books.size() << " books to " << BOOKS_FILE << " and "
+             << totalSales << " sales to " << salesShardFile(0, false) << " .. "
+             << salesShardFile(SALES_SHARDS - 1, false) << "\n";
+    }
+
+    // Journal functions
+    // Re-apply everything recorded since the last complete snapshot, from
+    // the retired journal of an unfinished checkpoint and then the current
+    // one, and keep the journal open for appending. Returns true if there
+    // was a retired journal, which the caller should checkpoint away.
+    bool replayJournal() {
+        // Sales already in each shard's file when the journal was started.
+        // A journal from before sharding counts them over the whole history.
+        bool wholeHistory = true;
+        size_t baseSales = totalSales;
+        size_t journalSales = 0;
+        vector<size_t> shardBase(SALES_SHARDS, 0);
+        vector<size_t> shardJournalSales(SALES_SHARDS, 0);
+        size_t records = 0;
+        bool retiredFound = false;
+
+        for (const string& name : {RETIRED_JOURNAL_FILE, JOURNAL_FILE}) {
+            MappedFile file;
+            if (!file.open(name)) {
+                continue;
+            }
+            retiredFound = retiredFound || name == RETIRED_JOURNAL_FILE;
+            // A trailing partial line is a torn write: forEachLine skips
+            // it, and it is cut off below so later records start on a
+            // line of their own
+            string_view text = file.view();
+            size_t whole = text.rfind('\n') + 1;
+            // "T|n" opens a transaction of the next n records, which are
+            // applied together once the last of them is read. One cut short
+            // by a crash is dropped and cut off with the torn line.
+            vector<string_view> transaction;
+            size_t transactionLines = 0;
+            size_t transactionStart = 0;
+            auto applyRecord = [&](string_view line) {
+                string_view payload = line.substr(2);
+                switch (line[0]) {
+                    case 'B': {
+                        string_view counts[SALES_SHARDS + 1];
+                        size_t fields = splitFields(payload, counts, SALES_SHARDS + 1);
+                        wholeHistory = fields != SALES_SHARDS;
+                        if (wholeHistory) {
+                            parseNumber(payload, baseSales);
+                            journalSales = 0;
+                        } else {
+                            for (size_t k = 0; k < SALES_SHARDS; k++) {
+                                parseNumber(counts[k], shardBase[k]);
+                                shardJournalSales[k] = 0;
+                            }
+                        }
+                        break;
+                    }
+                    case 'A': {
+                        Book book;
+                        if (parseBookLine(payload, book)) {
+                            auto it = findBook(book.id);
+                            if (it != books.end()) {
+                                replaceBook(it, book);
+                            } else {
+                                insertBook(book);
+                            }
+                        }
+                        break;
+                    }
+                    case 'D': {
+                        auto it = findBook(payload);
+                        if (it != books.end()) {
+                            eraseBook(it);
+                        }
+                        break;
+                    }
+                    case 'Q': {
+                        size_t sep = payload.rfind('|');
+                        if (sep == string_view::npos) {
+                            break;
+                        }
+                        auto it = findBook(payload.substr(0, sep));
+                        int quantity;
+                        if (it != books.end() && parseNumber(payload.substr(sep + 1), quantity)) {
+                            setStock(*it, quantity);
+                        }
+                        break;
+                    }
+                    case 'S': {
+                        // Sales already in the shard files, or seen earlier in a
+                        // retired journal, are skipped
+                        Sale sale;
+                        bool parsed = parseSaleLine(payload, sale);
+                        if (parsed) {
+                            size_t k = shardOf(sale.bookId);
+                            bool missing = wholeHistory ? baseSales + journalSales >= totalSales
+                                                        : shardBase[k] + shardJournalSales[k] >= shards[k].size();
+                            if (missing) {
+                                recordSale(sale);
+                            }
+                            shardJournalSales[k]++;
+                        }
+                        journalSales++;
+                        break;
+                    }
+                }
+            };
+            forEachLine(text, false, [&](string_view line) {
+                if (line.size() < 2 || line[1] != '|') {
+                    return;
+                }
+                records++;
+                if (transactionLines > 0) {
+                    transaction.push_back(line);
+                    if (transaction.size() == transactionLines) {
+                        for (string_view record : transaction) {
+                            applyRecord(record);
+                        }
+                        transaction.clear();
+                        transactionLines = 0;
+                    }
+                } else if (line[0] == 'T') {
+                    if (parseNumber(line.substr(2), transactionLines) && transactionLines > 0) {
+                        transactionStart = line.data() - text.data();
+                    }
+                } else {
+                    applyRecord(line);
+                }
+            });
+            if (transactionLines > 0) {
+                records -= transaction.size() + 1;
+                whole = transactionStart;
+            }
+            if (whole < text.size()) {
+                file.close();
+                truncateFile(name, whole);
+            }
+        }
+
+        journal.open(JOURNAL_FILE);
+        if (records == 0) {
+            journal.reset(shardSizes());
+        } else {
+            journal.setSize(records);
+        }
+        return retiredFound;
+    }
+
+    // Write the journal's pending records; once it grows large, have the
+    // flusher fold it into the snapshot files. Returns false if the records
+    // are not on disk; they stay queued for the next commit.
+    bool commitJournal() {
+        bool written = journal.commit();
+        if (!written) {
+            cout << "\n✗ Warning: could not write to " << JOURNAL_FILE << "!\n";
+        }
+        if (journal.size() >= JOURNAL_COMPACT_THRESHOLD) {
+            flusher.request();
+        }
+        return written;
+    }
+
+    // Fold the journal into fresh snapshot files. Updates are held off only
+    // while the journal is retired and the catalogue copied; the files are
+    // then written from that copy and from the sales below the cut, only
+    // for the shards with new sales, and the retired journal is removed
+    // once they are on disk. Sales older than the hot window are sealed
+    // into segments first, and their shards' files rewritten without them.
+    // A crash at any point leaves files that replay to the state at the
+    // crash.
+    bool checkpoint() {
+        METRIC_TIME(Compaction);
+        lock_guard<mutex> serial(checkpointMutex);
+        vector<Book> catalogue;
+        vector<size_t> salesAtCut;
+        bool binary;
+        {
+            METRIC_TIME(CheckpointPause);
+            unique_lock<shared_mutex> catalogueLock(catalogueMutex);
+            auto history = lockAllShards();
+            salesAtCut = shardSizes();
+            if (!journal.rotate(RETIRED_JOURNAL_FILE, salesAtCut)) {
+                cout << "\n✗ Warning: could not start a new " << JOURNAL_FILE << "!\n";
+                return false;
+            }
+            catalogue = booksInCatalogueOrder();
+            binary = binarySnapshots;
+        }
+        int64_t cutoff = hotWindowStart();
+        parallelParts(SALES_SHARDS, SALES_SHARDS, [&](size_t, size_t first, size_t last) {
+            for (size_t k = first; k < last; k++) {
+                if (sealShard(k, salesAtCut[k], cutoff)) {
+                    persistedSales[k] = SIZE_MAX;
+                }
+            }
+        });
+        vector<size_t> changed;
+        for (size_t k = 0; k < SALES_SHARDS; k++) {
+            if (salesAtCut[k] != persistedSales[k]) {
+                changed.push_back(k);
+            }
+        }
+        if (!saveBooks(catalogue, binary) || !saveSales(changed, salesAtCut, binary)) {
+            return false;
+        }
+        for (size_t k : changed) {
+            persistedSales[k] = salesAtCut[k];
+        }
+        // The old single sales files go once every shard file is written,
+        // and before the retired journal that replays over them
+        if (legacySalesFiles) {
+            remove(SALES_SNAPSHOT.c_str());
+            remove(SALES_FILE.c_str());
+            syncDirectory(SALES_FILE);
+            legacySalesFiles = false;
+        }
+        remove(RETIRED_JOURNAL_FILE.c_str());
+        syncDirectory(RETIRED_JOURNAL_FILE);
+        return true;
+    }
+
+    // Start of the hot window: sales made before it are sealed
+    int64_t hotWindowStart() const {
+        if (hotMonths <= 0) {
+            return INT64_MIN;
+        }
+        tm start = localTime(getCurrentTimestamp());
+        start.tm_mon -= hotMonths - 1;
+        start.tm_mday = 1;
+        start.tm_hour = start.tm_min = start.tm_sec = 0;
+        start.tm_isdst = -1;
+        return makeLocalTime(start);
+    }
+
+    // Whether the oldest hot sale of some shard is older than the window
+    bool salesToSeal() const {
+        int64_t cutoff = hotWindowStart();
+        for (const auto& shard : shards) {
+            lock_guard<mutex> history(shard.lock);
+            if (!shard.hot->sales.empty() && shard.hot->sales[0].date < cutoff) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Seal shard k's oldest hot sales made before cutoff, up to the first
+    // that was not, into new segments of a calendar month each, then swap
+    // in the hot sales left and the longer segment list. Only sales below
+    // count, a checkpoint's cut, are sealed, and they never change, so
+    // nothing is locked until the swap; sales recorded meanwhile are
+    // carried over under the lock. Returns true if any were sealed.
+    // Checkpoints are the only callers, one at a time.
+    bool sealShard(size_t k, size_t count, int64_t cutoff) {
+        SalesShard& shard = shards[k];
+        const HotSales& hot = *shard.hot;
+        size_t sealed = shard.sealed;
+        size_t end = 0;
+        while (sealed + end < count && hot.sales[end].date < cutoff) {
+            end++;
+        }
+        if (end == 0) {
+            return false;
+        }
+
+        // A new segment starts at each sale made in a later month than the
+        // ones before it; a late sale for an earlier month joins the
+        // current one
+        unique_ptr<ColdSegments> cold(new ColdSegments(*shard.cold));
+        CalendarBuckets months(true);
+        for (size_t begin = 0; begin < end;) {
+            int64_t month = months(hot.sales[begin].date);
+            size_t last = begin + 1;
+            while (last < end && months(hot.sales[last].date) <= month) {
+                last++;
+            }
+            string path = segmentFile(k, sealed + begin);
+            shared_ptr<SegmentFile> segment = make_shared<SegmentFile>();
+            string error;
+            if (!SegmentFile::write(path, sealed + begin, hot.sales, begin, last) || !segment->open(path, error)) {
+                cout << "\n✗ Warning: could not write " << path << "!\n";
+                return false;
+            }
+            cold->push_back(segment);
+            begin = last;
+        }
+
+        unique_ptr<HotSales> rest(new HotSales());
+        for (size_t i = end; sealed + i < count; i++) {
+            rest->sales.push_back(hot.sales[i]);
+        }
+        rest->columns.rebuild(rest->sales);
+        HotSales* retiredHot;
+        const ColdSegments* retiredCold;
+        {
+            lock_guard<mutex> history(shard.lock);
+            for (size_t i = count - sealed; i < hot.sales.size(); i++) {
+                rest->sales.push_back(hot.sales[i]);
+                rest->columns.appendUnseen(hot.sales[i]);
+            }
+            retiredHot = shard.hot.release();
+            shard.hot.reset(rest.release());
+            retiredCold = shard.cold.release();
+            shard.cold.reset(cold.release());
+            shard.sealed = sealed + end;
+        }
+        epochs.retire([retiredHot, retiredCold] {
+            delete retiredHot;
+            delete retiredCold;
+        });
+        return true;
+    }
+
+    // The flusher's work: checkpoint if the journal has records beyond its
+    // first or there are sales to seal, and save the users if they changed
+    void flushDirtyState() {
+        if (journal.size() > 1 || salesToSeal()) {
+            checkpoint();
+        }
+        if (usersDirty.exchange(false) && !saveUsers()) {
+            usersDirty = true;
+        }
+    }
+
+    // username|credential|role per line; the first line for a name wins
+    void loadUsers() {
+        lock_guard<mutex> lock(usersMutex);
+        users.clear();
+        MappedFile file;
+        if (file.open(USERS_FILE)) {
+            forEachLine(file.view(), true, [this](string_view line) {
+                string_view fields[3];
+                if (splitFields(line, fields, 3) == 3 && !fields[0].empty()) {
+                    users.emplace(string(fields[0]), User{string(fields[0]), string(fields[1]), string(fields[2])});
+                }
+            });
+        }
+    }
+
+    // Replace plaintext passwords from an older users.txt with hashes.
+    // Logins keep working meanwhile: a plaintext credential is compared as
+    // it is until its hash is in.
+    void hashPlaintextPasswords() {
+        vector<pair<string, future<string>>> hashed;
+        {
+            lock_guard<mutex> lock(usersMutex);
+            for (const auto& entry : users) {
+                if (credentialCost(entry.second.credential) == 0) {
+                    string password = entry.second.credential;
+                    hashed.push_back({entry.first, authPool.submit([this, password] {
+                        return hashPassword(password, PASSWORD_ITERATIONS);
+                    })});
+                }
+            }
+        }
+        for (auto& entry : hashed) {
+            string credential = entry.second.get();
+            lock_guard<mutex> lock(usersMutex);
+            auto it = users.find(entry.first);
+            if (it != users.end() && credentialCost(it->second.credential) == 0) {
+                it->second.credential = credential;
+                usersDirty = true;
+            }
+        }
+    }
+
+    // Written in name order so the file diffs cleanly
+    bool saveUsers() {
+        vector<User> sorted;
+        {
+            lock_guard<mutex> lock(usersMutex);
+            for (const auto& entry : users) {
+                sorted.push_back(entry.second);
+            }
+        }
+        sort(sorted.begin(), sorted.end(), [](const User& a, const User& b) { return a.username < b.username; });
+        AtomicFile file(USERS_FILE);
+        for (const auto& user : sorted) {
+            file.write(user.username + "|" + user.credential + "|" + user.role + "\n");
+        }
+        if (!file.commit()) {
+            cout << "\n✗ Warning: could not write " << USERS_FILE << "!\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Authentication functions
+    bool login() {
+        clearScreen();
+        cout << "\n" << string(60, '=') << "\n";
+        cout << "           GENIUS BOOKS - LOGIN SYSTEM\n";
+        cout << string(60, '=') << "\n\n";
+        
+        string username, password;
+        cout << "Enter Username: ";
+        getline(cin, username);
+        cout << "Enter Password: ";
+        getline(cin, password);
+        
+        User user;
+        if (authenticate(username, password, user)) {
+            isLoggedIn = true;
+            currentUser = username;
+            currentRole = user.role;
+            cout << "\n✓ Login successful! Welcome, " << username << "!\n";
+            cout << "Role: " << user.role << "\n";
+            cout << "Press Enter to continue...";
+            cin.get();
+            return true;
+        }
+        
+        cout << "\n✗ Invalid username or password!\n";
+        cout << "Press Enter to continue...";
+        cin.get();
+        return false;
+    }
+
+    // Check a password on the worker pool. Unknown names cost a full hash
+    // too, so response times do not tell which names exist. A credential
+    // weaker than PASSWORD_ITERATIONS is rehashed once the password is known.
+    bool authenticate(const string& username, const string& password, User& user) {
+        bool known;
+        {
+            lock_guard<mutex> lock(usersMutex);
+            auto it = users.find(username);
+            known = it != users.end();
+            if (known) {
+                user = it->second;
+            }
+        }
+        string credential = known ? user.credential
+                                  : CREDENTIAL_PREFIX + to_string(PASSWORD_ITERATIONS) + "$00$00";
+        bool verified = authPool.submit([&credential, &password] { return verifyPassword(credential, password); }).get();
+        if (!known || !verified) {
+            return false;
+        }
+        if (credentialCost(credential) < PASSWORD_ITERATIONS) {
+            string rehashed = authPool.submit([this, &password] { return hashPassword(password, PASSWORD_ITERATIONS); }).get();
+            lock_guard<mutex> lock(usersMutex);
+            auto it = users.find(username);
+            if (it != users.end() && it->second.credential == credential) {
+                it->second.credential = rehashed;
+                usersDirty = true;
+            }
+        }
+        return true;
+    }
+
+    void logout() {
+        isLoggedIn = false;
+        currentUser = "";
+        currentRole = "";
+        cout << "\n✓ Logged out successfully!\n";
+        cout << "Press Enter to continue...";
+        cin.get();
+    }
+
+    // Book management functions
+    static constexpr size_t PAGE_ROWS = 20;
+
+    static void appendBookHeader(string& page) {
+        TableRow row;
+        row.text("ID", 8).text("Title", 25).text("Author", 20).text("Category", 15)
+           .text("Price", 10).text("Qty", 8).text("Date Added").appendTo(page);
+        page.append(80, '-');
+        page += '\n';
+    }
+
+    static void appendBookRow(string& page, const Book& book) {
+        TableRow row;
+        row.text(book.id, 8).text(book.title, 25).text(book.author, 20).text(book.category, 15)
+           .money(book.price, 10).integer(book.quantity, 8).timestamp(book.dateAdded).appendTo(page);
+    }
+
+    bool bookComesFirst(BookOrder order, uint32_t a, uint32_t b) const {
+        const Book& x = books[a];
+        const Book& y = books[b];
+        switch (order) {
+            case BookOrder::PriceLow:
+                if (x.price != y.price) return x.price < y.price;
+                break;
+            case BookOrder::PriceHigh:
+                if (x.price != y.price) return x.price > y.price;
+                break;
+            case BookOrder::StockLow:
+                if (x.quantity != y.quantity) return x.quantity < y.quantity;
+                break;
+            case BookOrder::Title:
+                if (x.title != y.title) return x.title < y.title;
+                break;
+            case BookOrder::Catalogue:
+                break;
+        }
+        return catalogueOrder.rank(a) < catalogueOrder.rank(b);
+    }
+
+    // Walk the books matching filter through the range index that serves
+    // it best: stock for StockLow or a low-stock filter, price within the
+    // category when one is set, otherwise price. PriceHigh walks price
+    // downwards. visit(key, book) gets the index key and returns false to
+    // stop. Caller holds catalogueMutex (shared).
+    template <typename Visit>
+    void scanBookRange(const BookFilter& filter, BookOrder order, const BookResume& resume, Visit visit) {
+        auto check = [&](int64_t key, PooledString id) {
+            auto it = findBook(id);
+            return it == books.end() || !filter.matches(*it) || visit(key, *it);
+        };
+        bool priceOrder = order == BookOrder::PriceLow || order == BookOrder::PriceHigh;
+        bool downwards = order == BookOrder::PriceHigh;
+
+        if (order == BookOrder::StockLow || (!priceOrder && filter.category.empty() && filter.lowStockAt >= 0)) {
+            optional<pair<int, PooledString>> from;
+            if (resume) {
+                from.emplace((int)resume->first, resume->second);
+            }
+            walkStock(filter.lowStockAt >= 0 ? filter.lowStockAt : INT_MAX, from,
+                      [&](const auto& entry) { return check(entry.first, entry.second); });
+            return;
+        }
+
+        if (!filter.category.empty()) {
+            PooledString category = categoryKey(filter.category);
+            optional<pair<pair<PooledString, Money>, PooledString>> from;
+            if (resume) {
+                from.emplace(make_pair(category, Money::fromCents(resume->first)), resume->second);
+            }
+            pair<PooledString, Money> first(category, filter.minPrice);
+            pair<PooledString, Money> last(category, filter.maxPrice);
+            auto onEntry = [&](const auto& entry) { return check(entry.first.second.cents(), entry.second); };
+            if (downwards) {
+                categoryIndex.descending(first, last, from, onEntry);
+            } else {
+                categoryIndex.ascending(first, last, from, onEntry);
+            }
+            return;
+        }
+
+        optional<pair<Money, PooledString>> from;
+        if (resume) {
+            from.emplace(Money::fromCents(resume->first), resume->second);
+        }
+        auto onEntry = [&](const auto& entry) { return check(entry.first.cents(), entry.second); };
+        if (downwards) {
+            priceIndex.descending(filter.minPrice, filter.maxPrice, from, onEntry);
+        } else {
+            priceIndex.ascending(filter.minPrice, filter.maxPrice, from, onEntry);
+        }
+    }
+
+    // Format the cursor's current page of books into page and report
+    // whether another page follows. Caller holds catalogueMutex (shared).
+    size_t renderBookPage(BookCursor& cursor, string& page, bool& more) {
+        size_t shown = 0;
+        more = false;
+        if (cursor.order == BookOrder::Catalogue && !cursor.filter.active()) {
+            cursor.nextStart = catalogueOrder.walk(cursor.pageStarts.back(), [&](uint32_t slot) {
+                if (shown == PAGE_ROWS) {
+                    more = true;
+                    return false;
+                }
+                appendBookRow(page, books[slot]);
+                shown++;
+                return true;
+            });
+            return shown;
+        }
+
+        if (cursor.walksIndex()) {
+            cursor.nextEntry.reset();
+            scanBookRange(cursor.filter, cursor.order, cursor.pageEntries.back(),
+                          [&](int64_t key, const Book& book) {
+                              if (shown == PAGE_ROWS) {
+                                  cursor.nextEntry.emplace(key, book.id);
+                                  more = true;
+                                  return false;
+                              }
+                              appendBookRow(page, book);
+                              shown++;
+                              return true;
+                          });
+            return shown;
+        }
+
+        if (cursor.matchedFrom != books.size()) {
+            cursor.matches.clear();
+            if (cursor.filter.active()) {
+                scanBookRange(cursor.filter, cursor.order, BookResume(), [&](int64_t, const Book& book) {
+                    cursor.matches.push_back((uint32_t)(&book - books.data()));
+                    return true;
+                });
+                if (cursor.order == BookOrder::Catalogue) {
+                    sort(cursor.matches.begin(), cursor.matches.end(), [this](uint32_t a, uint32_t b) {
+                        return catalogueOrder.rank(a) < catalogueOrder.rank(b);
+                    });
+                }
+            } else {
+                cursor.matches.resize(books.size());
+                for (size_t slot = 0; slot < books.size(); slot++) {
+                    cursor.matches[slot] = (uint32_t)slot;
+                }
+            }
+            cursor.sortedPrefix = cursor.order == BookOrder::Catalogue ? cursor.matches.size() : 0;
+            cursor.matchedFrom = books.size();
+        }
+        size_t begin = min(cursor.page * PAGE_ROWS, cursor.matches.size());
+        size_t end = min(begin + PAGE_ROWS, cursor.matches.size());
+        if (end > cursor.sortedPrefix) {
+            BookOrder order = cursor.order;
+            partial_sort(cursor.matches.begin() + cursor.sortedPrefix, cursor.matches.begin() + end,
+                         cursor.matches.end(),
+                         [&](uint32_t a, uint32_t b) { return bookComesFirst(order, a, b); });
+            cursor.sortedPrefix = end;
+        }
+        for (size_t i = begin; i < end; i++) {
+            appendBookRow(page, books[cursor.matches[i]]);
+        }
+        more = end < cursor.matches.size();
+        return end - begin;
+    }
+
+    // Blank input keeps the current value
+    bool promptOptionalNumber(const string& prompt, double& value) {
+        string line;
+        cout << prompt;
+        if (!getline(cin, line) || line.empty()) {
+            return true;
+        }
+        double parsed;
+        if (!parseNumber(string_view(line), parsed) || parsed < 0) {
+            cout << "Invalid number, keeping the current value.\n";
+            return false;
+        }
+        value = parsed;
+        return true;
+    }
+
+    bool promptOptionalMoney(const string& prompt, Money& value) {
+        string line;
+        cout << prompt;
+        if (!getline(cin, line) || line.empty()) {
+            return true;
+        }
+        Money parsed;
+        if (!Money::parse(line, parsed) || parsed < Money()) {
+            cout << "Invalid amount, keeping the current value.\n";
+            return false;
+        }
+        value = parsed;
+        return true;
+    }
+
+    void promptBookFilter(BookFilter& filter) {
+        cout << "\nCategory (blank for any): ";
+        getline(cin, filter.category);
+        promptOptionalMoney("Minimum price (blank keeps current): ", filter.minPrice);
+        promptOptionalMoney("Maximum price (blank keeps current): ", filter.maxPrice);
+        double lowStock = filter.lowStockAt;
+        promptOptionalNumber("Only stock at or below (blank keeps current): ", lowStock);
+        filter.lowStockAt = lowStock > INT_MAX ? INT_MAX : (int)lowStock;
+    }
+
+    void promptBookOrder(BookOrder& order) {
+        cout << "\nSort by: 1. Catalogue order  2. Price (low-high)  3. Price (high-low)"
+                "  4. Stock (low-high)  5. Title\n";
+        switch (getValidatedInt("Choice: ", 1, 5)) {
+            case 1: order = BookOrder::Catalogue; break;
+            case 2: order = BookOrder::PriceLow; break;
+            case 3: order = BookOrder::PriceHigh; break;
+            case 4: order = BookOrder::StockLow; break;
+            case 5: order = BookOrder::Title; break;
+        }
+    }
+
+    void viewBooks() {
+        awaitData();
+        BookCursor cursor;
+        while (true) {
+            string page;
+            bool more = false;
+            size_t shown, catalogueSize;
+            appendBookHeader(page);
+            {
+                shared_lock<shared_mutex> catalogue(catalogueMutex);
+                shown = renderBookPage(cursor, page, more);
+                catalogueSize = books.size();
+            }
+
+            clearScreen();
+            cout << "\n" << string(80, '=') << "\n";
+            cout << "                    AVAILABLE BOOKS\n";
+            cout << string(80, '=') << "\n";
+
+            if (catalogueSize == 0) {
+                cout << "\nNo books available in the system.\n";
+                cout << "Press Enter to continue...";
+                cin.get();
+                return;
+            }
+
+            if (shown == 0) {
+                page += "No books match the current filter.\n";
+            }
+            cout << page;
+            cout << "\nPage " << cursor.page + 1 << (more ? "" : " (last)")
+                 << "  |  Total Books: " << catalogueSize << (cursor.filter.active() ? "  |  filtered" : "") << "\n";
+            cout << "[n]ext  [p]rev  [s]ort  [f]ilter  [c]lear filter  [q]uit: ";
+
+            string command;
+            if (!getline(cin, command)) {
+                return;
+            }
+            char choice = command.empty() ? 'n' : (char)tolower((unsigned char)command[0]);
+            switch (choice) {
+                case 'n':
+                    if (more) {
+                        cursor.page++;
+                        cursor.pageStarts.push_back(cursor.nextStart);
+                        cursor.pageEntries.push_back(cursor.nextEntry);
+                    } else if (command.empty()) {
+                        return;
+                    }
+                    break;
+                case 'p':
+                    if (cursor.page > 0) {
+                        cursor.page--;
+                        cursor.pageStarts.pop_back();
+                        cursor.pageEntries.pop_back();
+                    }
+                    break;
+                case 's':
+                    promptBookOrder(cursor.order);
+                    cursor.restart();
+                    break;
+                case 'f':
+                    promptBookFilter(cursor.filter);
+                    cursor.restart();
+                    break;
+                case 'c':
+                    cursor.filter = BookFilter();
+                    cursor.restart();
+                    break;
+                case 'q':
+                    return;
+            }
+        }
+    }
+
+    // Catalogue and sales operations shared by the menu and batch mode.
+    // Each validates its input, applies the change in memory and queues the
+    // journal records; the caller decides when to commitJournal().
+    bool validTextField(string_view value, const string& name, string& error) {
+        if (value.empty()) {
+            error = name + " cannot be empty";
+            return false;
+        }
+        if (value.find_first_of("|\r\n") != string::npos) {
+            error = name + " cannot contain '|' or line breaks";
+            return false;
+        }
+        return true;
+    }
+
+    bool validateBook(const Book& book, string& error) {
+        if (!validTextField(book.id, "Book ID", error) ||
+            !validTextField(book.title, "Title", error) ||
+            !validTextField(book.author, "Author", error) ||
+            !validTextField(book.category, "Category", error)) {
+            return false;
+        }
+        if (book.price < Money::fromCents(1)) {
+            error = "Price must be at least 0.01";
+            return false;
+        }
+        if (book.quantity < 0) {
+            error = "Quantity cannot be negative";
+            return false;
+        }
+        return true;
+    }
+
+    bool applyAddBook(Book book, string& error) {
+        if (!validateBook(book, error)) {
+            return false;
+        }
+        unique_lock<shared_mutex> catalogue(catalogueMutex);
+        if (findBook(book.id) != books.end()) {
+            error = "Book ID already exists";
+            return false;
+        }
+        book.dateAdded = getCurrentTimestamp();
+        insertBook(book);
+        journal.append("A|" + formatBookLine(book));
+        stockWatcher.publish(book.id, book.quantity);
+        return true;
+    }
+
+    bool applyUpdateBook(const string& bookId, const BookChanges& changes, string& error) {
+        unique_lock<shared_mutex> catalogue(catalogueMutex);
+        auto it = findBook(bookId);
+        if (it == books.end()) {
+            error = "Book not found";
+            return false;
+        }
+        Book updated = *it;
+        if (changes.title) updated.title = *changes.title;
+        if (changes.author) updated.author = *changes.author;
+        if (changes.category) updated.category = *changes.category;
+        if (changes.price) updated.price = *changes.price;
+        if (changes.quantity) updated.quantity = *changes.quantity;
+        if (!validateBook(updated, error)) {
+            return false;
+        }
+        bool restocked = updated.quantity != it->quantity;
+        replaceBook(it, updated);
+        journal.append("A|" + formatBookLine(updated));
+        if (restocked) {
+            stockWatcher.publish(updated.id, updated.quantity);
+        }
+        return true;
+    }
+
+    bool applyDeleteBook(const string& bookId, string& error) {
+        unique_lock<shared_mutex> catalogue(catalogueMutex);
+        auto it = findBook(bookId);
+        if (it == books.end()) {
+            error = "Book not found";
+            return false;
+        }
+        journal.append("D|" + it->id.str());
+        stockWatcher.publish(it->id, -1);
+        eraseBook(it);
+        return true;
+    }
+
+    // Safe to call from many threads at once: the stock check and decrement
+    // happen under the book's stock stripe, so a book is never oversold
+    bool applySale(const string& bookId, int quantity, const string& customerName, Sale& sale, string& error) {
+        METRIC_TIME(Sale);
+        bool sold = sellBook(bookId, quantity, customerName, sale, error);
+        if (sold) {
+            METRIC_ADD(SalesMade, 1);
+        } else {
+            METRIC_ADD(SalesRejected, 1);
+        }
+        return sold;
+    }
+
+    bool sellBook(const string& bookId, int quantity, const string& customerName, Sale& sale, string& error) {
+        if (!validTextField(customerName, "Customer name", error)) {
+            return false;
+        }
+        shared_lock<shared_mutex> catalogue(catalogueMutex);
+        auto it = findBook(bookId);
+        if (it == books.end()) {
+            error = "Book not found";
+            return false;
+        }
+
+        lock_guard<mutex> stock(stockLockFor(bookId));
+        if (it->quantity == 0) {
+            error = "Book is out of stock";
+            return false;
+        }
+        if (quantity < 1 || quantity > it->quantity) {
+            error = "Quantity must be between 1 and " + to_string(it->quantity);
+            return false;
+        }
+
+        sale.saleId = "S" + to_string(nextSaleNumber++);
+        sale.bookId = bookId;
+        sale.bookTitle = it->title;
+        sale.quantity = quantity;
+        sale.totalAmount = quantity * it->price;
+        sale.date = getCurrentTimestamp();
+        sale.customerName = customerName;
+
+        // Update book quantity
+        setStock(*it, it->quantity - quantity);
+        stockWatcher.publish(it->id, it->quantity);
+
+        // Stock and sale go into one journal append so they are written together
+        lock_guard<mutex> history(shardFor(sale.bookId).lock);
+        recordSale(sale);
+        journal.append("Q|" + it->id.str() + "|" + to_string(it->quantity) + "\nS|" + formatSaleLine(sale), 2);
+        return true;
+    }
+
+    // Sale entry point for concurrent terminals: returns once the sale is on
+    // disk. Checkouts that finish together share one journal write and fsync.
+    // If the write fails the sale is still made, and false says it is not
+    // on disk yet.
+    bool checkout(const string& bookId, int quantity, const string& customerName, Sale& sale, string& error) {
+        if (!applySale(bookId, quantity, customerName, sale, error)) {
+            return false;
+        }
+        if (!commitJournal()) {
+            error = "Could not write the sale to " + JOURNAL_FILE;
+            return false;
+        }
+        return true;
+    }
+
+    // Sell every line of a cart or none of them. Lines for the same book
+    // are combined. All stock is checked before any is taken, and the
+    // stock changes and sales go into the journal as one transaction.
+    bool applyCart(const vector<CartLine>& cart, const string& customerName, vector<Sale>& sold, string& error) {
+        METRIC_TIME(Sale);
+        bool done = sellCart(cart, customerName, sold, error);
+        if (done) {
+            METRIC_ADD(SalesMade, sold.size());
+        } else {
+            METRIC_ADD(SalesRejected, 1);
+        }
+        return done;
+    }
+
+    bool sellCart(const vector<CartLine>& cart, const string& customerName, vector<Sale>& sold, string& error) {
+        sold.clear();
+        if (!validTextField(customerName, "Customer name", error)) {
+            return false;
+        }
+        if (cart.empty() || cart.size() > MAX_CART_LINES) {
+            error = "A cart needs between 1 and " + to_string(MAX_CART_LINES) + " lines";
+            return false;
+        }
+        vector<CartLine> lines;
+        for (const auto& line : cart) {
+            if (line.quantity < 1) {
+                error = "Quantity for " + line.bookId + " must be at least 1";
+                return false;
+            }
+            auto same = find_if(lines.begin(), lines.end(),
+                                [&line](const CartLine& other) { return other.bookId == line.bookId; });
+            if (same == lines.end()) {
+                lines.push_back(line);
+            } else {
+                same->quantity += line.quantity;
+            }
+        }
+
+        shared_lock<shared_mutex> catalogue(catalogueMutex);
+        vector<vector<Book>::iterator> items;
+        vector<size_t> stripes;
+        for (const auto& line : lines) {
+            auto it = findBook(line.bookId);
+            if (it == books.end()) {
+                error = "Book " + line.bookId + " not found";
+                return false;
+            }
+            items.push_back(it);
+            stripes.push_back(stockStripe(line.bookId));
+        }
+        // Stripes are taken in ascending order so two carts never wait on
+        // each other
+        sort(stripes.begin(), stripes.end());
+        stripes.erase(unique(stripes.begin(), stripes.end()), stripes.end());
+        vector<unique_lock<mutex>> stock;
+        for (size_t stripe : stripes) {
+            stock.emplace_back(stockLocks[stripe]);
+        }
+
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (items[i]->quantity == 0) {
+                error = "Book " + lines[i].bookId + " is out of stock";
+                return false;
+            }
+            if (lines[i].quantity > items[i]->quantity) {
+                error = "Only " + to_string(items[i]->quantity) + " of " + lines[i].bookId + " in stock";
+                return false;
+            }
+        }
+
+        int64_t now = getCurrentTimestamp();
+        string records = "T|" + to_string(lines.size() * 2);
+        for (size_t i = 0; i < lines.size(); i++) {
+            Book& book = *items[i];
+            Sale sale;
+            sale.saleId = "S" + to_string(nextSaleNumber++);
+            sale.bookId = book.id;
+            sale.bookTitle = book.title;
+            sale.quantity = lines[i].quantity;
+            sale.totalAmount = lines[i].quantity * book.price;
+            sale.date = now;
+            sale.customerName = customerName;
+            sold.push_back(sale);
+
+            setStock(book, book.quantity - lines[i].quantity);
+            stockWatcher.publish(book.id, book.quantity);
+            records += "\nQ|" + book.id.str() + "|" + to_string(book.quantity);
+        }
+
+        // The shards the cart touches are locked in ascending order too
+        vector<size_t> touched;
+        for (const auto& line : lines) {
+            touched.push_back(shardOf(line.bookId));
+        }
+        sort(touched.begin(), touched.end());
+        touched.erase(unique(touched.begin(), touched.end()), touched.end());
+        vector<unique_lock<mutex>> history;
+        for (size_t k : touched) {
+            history.emplace_back(shards[k].lock);
+        }
+        for (const auto& sale : sold) {
+            recordSale(sale);
+            records += "\nS|" + formatSaleLine(sale);
+        }
+        journal.append(records, lines.size() * 2 + 1);
+        return true;
+    }
+
+    // Cart entry point for terminals: returns once the whole cart is on
+    // disk. As with checkout(), a failed write leaves the cart sold, with
+    // its sales in sold, and returns false.
+    bool checkoutCart(const vector<CartLine>& cart, const string& customerName, vector<Sale>& sold, string& error) {
+        if (!applyCart(cart, customerName, sold, error)) {
+            return false;
+        }
+        if (!commitJournal()) {
+            error = "Could not write the sale to " + JOURNAL_FILE;
+            return false;
+        }
+        return true;
+    }
+
+    void addBook() {
+        awaitData();
+        clearScreen();
+        cout << "\n" << string(60, '=') << "\n";
+        cout << "                ADD NEW BOOK\n";
+        cout << string(60, '=') << "\n\n";
+        
+        Book newBook;
+        newBook.id = getValidatedString("Enter Book ID: ");
+        
+        // Check if book ID already exists
+        if (findBook(newBook.id) != books.end()) {
+            cout << "\n✗ Book ID already exists! Please use a different ID.\n";
+            cout << "Press Enter to continue...";
+            cin.get();
+            return;
+        }
+        
+        newBook.title = getValidatedString("Enter Book Title: ");
+        newBook.author = getValidatedString("Enter Author Name: ");
+        newBook.category = getValidatedString("Enter Category: ");
+        newBook.price = getValidatedMoney("Enter Price: $", Money::fromCents(1));
+        newBook.quantity = getValidatedInt("Enter Quantity: ", 0);
+        
+        string error;
+        if (applyAddBook(newBook, error)) {
+            commitJournal();
+            cout << "\n✓ Book added successfully!\n";
+        } else {
+            cout << "\n✗ " << error << "!\n";
+        }
+        cout << "Press Enter to continue...";
+        cin.get();
+    }
+
+    void updateBook() {
+        awaitData();
+        clearScreen();
+        cout << "\n" << string(60, '=') << "\n";
+        cout << "                UPDATE BOOK\n";
+        cout << string(60, '=') << "\n\n";
+        
+        string bookId = getValidatedString("Enter Book ID to update: ");
+        
+        auto it = findBook(bookId);
+        
+        if (it == books.end()) {
+            cout << "\n✗ Book not found!\n";
+            cout << "Press Enter to continue...";
+            cin.get();
+            return;
+        }
+        
+        cout << "\nCurrent Book Details:\n";
+        cout << "ID: " << it->id << "\n";
+        cout << "Title: " << it->title << "\n";
+        cout << "Author: " << it->author << "\n";
+        cout << "Category: " << it->category << "\n";
+        cout << "Price: $" << it->price << "\n";
+        cout << "Quantity: " << it->quantity << "\n\n";
+        
+        int choice = getValidatedInt("What would you like to update?\n1. Title\n2. Author\n3. Category\n4. Price\n5. Quantity\n6. All Details\nEnter choice: ", 1, 6);
+        
+        BookChanges changes;
+        switch (choice) {
+            case 1:
+                changes.title = getValidatedString("Enter new title: ");
+                break;
+            case 2:
+                changes.author = getValidatedString("Enter new author: ");
+                break;
+            case 3:
+                changes.category = getValidatedString("Enter new category: ");
+                break;
+            case 4:
+                changes.price = getValidatedMoney("Enter new price: $", Money::fromCents(1));
+                break;
+            case 5:
+                changes.quantity = getValidatedInt("Enter new quantity: ", 0);
+                break;
+            case 6:
+                changes.title = getValidatedString("Enter new title: ");
+                changes.author = getValidatedString("Enter new author: ");
+                changes.category = getValidatedString("Enter new category: ");
+                changes.price = getValidatedMoney("Enter new price: $", Money::fromCents(1));
+                changes.quantity = getValidatedInt("Enter new quantity: ", 0);
+                break;
+        }
+        
+        string error;
+        if (applyUpdateBook(bookId, changes, error)) {
+            commitJournal();
+            cout << "\n✓ Book updated successfully!\n";
+        } else {
+            cout << "\n✗ " << error << "!\n";
+        }
+        cout << "Press Enter to continue...";
+        cin.get();
+    }
+
+    void deleteBook() {
+        awaitData();
+        clearScreen();
+        cout << "\n" << string(60, '=') << "\n";
+        cout << "                DELETE BOOK\n";
+        cout << string(60, '=') << "\n\n";
+        
+        string bookId = getValidatedString("Enter Book ID to delete: ");
+        
+        auto it = findBook(bookId);
+        
+        if (it == books.end()) {
+            cout << "\n✗ Book not found!\n";
+            cout << "Press Enter to continue...";
+            cin.get();
+            return;
+        }
+        
+        cout << "\nBook Details:\n";
+        cout << "ID: " << it->id << "\n";
+        cout << "Title: " << it->title << "\n";
+        cout << "Author: " << it->author << "\n";
+        cout << "Price: $" << it->price << "\n";
+        
+        char confirm;
+        cout << "\nAre you sure you want to delete this book? (y/n): ";
+        cin >> confirm;
+        cin.ignore();
+        
+        string error;
+        if (confirm == 'y' || confirm == 'Y') {
+            if (applyDeleteBook(bookId, error)) {
+                commitJournal();
+                cout << "\n✓ Book deleted successfully!\n";
+            } else {
+                cout << "\n✗ " << error << "!\n";
+            }
+        } else {
+            cout << "\n✗ Deletion cancelled!\n";
+        }
+        
+        cout << "Press Enter to continue...";
+        cin.get();
+    }
+
+    // Sales management functions
+    // Builds a cart one book at a time, then sells it in one transaction
+    // with a single receipt
+    void makeSale() {
+        awaitData();
+        clearScreen();
+        cout << "\n" << string(60, '=') << "\n";
+        cout << "                MAKE SALE\n";
+        cout << string(60, '=') << "\n\n";
         
-        if (books.empty()) {
-            cout << "\nNo books available in the system.\n";
-            cout << "Press Enter to continue...";
-            cin.get();
+        vector<CartLine> cart;
+        while (cart.size() < MAX_CART_LINES) {
+            string bookId = getValidatedString("Enter Book ID: ");
+            auto it = findBook(bookId);
+            
+            if (it == books.end()) {
+                cout << "\n✗ Book not found!\n";
+            } else {
+                int inCart = 0;
+                for (const auto& line : cart) {
+                    inCart += line.bookId == bookId ? line.quantity : 0;
+                }
+                cout << "\nBook Details:\n";
+                cout << "Title: " << it->title << "\n";
+                cout << "Author: " << it->author << "\n";
+                cout << "Price: $" << it->price << "\n";
+                cout << "Available Quantity: " << it->quantity - inCart << "\n\n";
+                
+                if (it->quantity - inCart <= 0) {
+                    cout << "✗ Book is out of stock!\n";
+                } else {
+                    int quantity = getValidatedInt("Enter quantity to sell: ", 1, it->quantity - inCart);
+                    cart.push_back({bookId, quantity});
+                }
+            }
+            
+            if (cart.empty()) {
+                cout << "Press Enter to continue...";
+                cin.get();
+                return;
+            }
+            string answer;
+            cout << "Add another book? (y/n): ";
+            getline(cin, answer);
+            if (answer != "y" && answer != "Y") {
+                break;
+            }
+            cout << "\n";
+        }
+        string customerName = getValidatedString("Enter customer name: ");
+        
+        vector<Sale> sold;
+        string error;
+        if (!checkoutCart(cart, customerName, sold, error)) {
+            if (sold.empty()) {
+                cout << "\n✗ " << error << "! Nothing was sold.\n";
+                cout << "Press Enter to continue...";
+                cin.get();
+                return;
+            }
+            cout << "\n✗ " << error << "; it will be retried with the next change.\n";
+        }
+        
+        Money total;
+        int units = 0;
+        cout << "\n" << string(60, '-') << "\n";
+        cout << "                    SALES RECEIPT\n";
+        cout << string(60, '-') << "\n";
+        cout << "Customer: " << customerName << "\n";
+        cout << "Date: " << formatTimestamp(sold.front().date) << "\n\n";
+        cout << left << setw(8) << "Sale ID" << setw(26) << "Book" << setw(5) << "Qty"
+             << setw(11) << "Unit" << "Amount\n";
+        for (const auto& sale : sold) {
+            cout << left << setw(8) << sale.saleId << setw(26) << string_view(sale.bookTitle).substr(0, 25)
+                 << setw(5) << sale.quantity << setw(11) << sale.totalAmount / sale.quantity
+                 << sale.totalAmount << "\n";
+            total += sale.totalAmount;
+            units += sale.quantity;
+        }
+        cout << "\nItems: " << units << " in " << sold.size() << " line(s)\n";
+        cout << "Total Amount: $" << total << "\n";
+        cout << string(60, '-') << "\n";
+        
+        cout << "\n✓ Sale completed successfully!\n";
+        cout << "Press Enter to continue...";
+        cin.get();
+    }
+
+    static void appendSaleRow(string& page, const Sale& sale) {
+        TableRow row;
+        row.text(sale.saleId, 8).text(sale.bookId, 8).text(sale.bookTitle, 25).integer(sale.quantity, 5)
+           .money(sale.totalAmount, 10).text(sale.customerName, 15).timestamp(sale.date).appendTo(page);
+    }
+
+    // A point-in-time view of the catalogue and the sales history for
+    // reports. Taking one holds the shard locks just long enough to note
+    // where each shard's history ends, so a cart is in it whole or not at
+    // all; every read after that takes no lock while checkouts and
+    // catalogue changes go on. Whatever the view can see is kept until it
+    // goes away.
+    // The catalogue stamp is read under the same locks: a sale runs with
+    // the catalogue lock held shared, so every book a sale in the view
+    // refers to was committed before the stamp was taken. Stock levels
+    // are not versioned; a book found through the view carries the stock
+    // it had at its last catalogue change, not at the cut, so reports
+    // must not read quantity from it.
+    // The history is read as runs, shard by shard: each shard's sealed
+    // segments, oldest first, then its hot sales. Within a shard, runs
+    // hold the sales in the order they were recorded.
+    class Snapshot {
+    private:
+        // A sealed segment, or the shard's hot sales if segment is null
+        struct Run {
+            size_t shard;
+            const SegmentFile* segment;
+        };
+
+        const BookshopManager& manager;
+        EpochReclaimer::Guard pin;
+        uint64_t stamp;
+        vector<const HotSales*> hot;
+        vector<SalesColumns::View> views;
+        vector<Run> runs;
+
+    public:
+        explicit Snapshot(const BookshopManager& owner)
+            : manager(owner), pin(owner.epochs) {
+            vector<const ColdSegments*> cold;
+            {
+                auto history = owner.lockAllShards();
+                stamp = owner.catalogueVersions.stamp();
+                for (const auto& shard : owner.shards) {
+                    hot.push_back(shard.hot.get());
+                    views.push_back(shard.hot->columns.view());
+                    cold.push_back(shard.cold.get());
+                }
+            }
+            for (size_t k = 0; k < SALES_SHARDS; k++) {
+                for (const auto& segment : *cold[k]) {
+                    runs.push_back({k, segment.get()});
+                }
+                runs.push_back({k, nullptr});
+            }
+        }
+
+        size_t runCount() const {
+            return runs.size();
+        }
+
+        // Positions [first, last) in run i's time order of the sales made
+        // in [from, to)
+        pair<size_t, size_t> timeRange(size_t i, int64_t from, int64_t to) const {
+            const Run& run = runs[i];
+            return run.segment ? run.segment->timeRange(from, to) : views[run.shard].timeRange(from, to);
+        }
+
+        size_t positionOf(size_t i, int64_t when) const {
+            const Run& run = runs[i];
+            return run.segment ? run.segment->positionOf(when) : views[run.shard].positionOf(when);
+        }
+
+        int64_t timeAt(size_t i, size_t position) const {
+            const Run& run = runs[i];
+            return run.segment ? run.segment->timeAt(position) : views[run.shard].timeAt(position);
+        }
+
+        Sale saleAt(size_t i, size_t position) const {
+            const Run& run = runs[i];
+            if (run.segment) {
+                return run.segment->saleAt(position);
+            }
+            return hot[run.shard]->sales[views[run.shard].rowInTimeOrder(position)];
+        }
+
+        // Call visit(columns) for every run that may hold sales made in
+        // [from, to), in run order. Segments are decoded into columns of
+        // their own, a few at a time on separate threads, and dropped once
+        // visited, so memory holds no more than a few at once.
+        template <typename Visit>
+        void forEachPart(int64_t from, int64_t to, Visit visit) const {
+            size_t i = 0;
+            while (i < runs.size()) {
+                if (!runs[i].segment) {
+                    visit(views[runs[i++].shard]);
+                    continue;
+                }
+                vector<const SegmentFile*> batch;
+                for (; i < runs.size() && runs[i].segment && batch.size() < hardwareThreads(); i++) {
+                    if (runs[i].segment->overlaps(from, to)) {
+                        batch.push_back(runs[i].segment);
+                    }
+                }
+                vector<SalesColumns> decoded(batch.size());
+                parallelParts(batch.size(), batch.size(), [&](size_t, size_t first, size_t last) {
+                    for (size_t j = first; j < last; j++) {
+                        batch[j]->load(decoded[j]);
+                    }
+                });
+                for (const auto& columns : decoded) {
+                    visit(columns.view());
+                }
+            }
+        }
+
+        size_t saleCount() const {
+            size_t count = 0;
+            for (const auto& run : runs) {
+                count += run.segment ? run.segment->size() : views[run.shard].size();
+            }
+            return count;
+        }
+
+        int64_t units() const {
+            int64_t total = 0;
+            for (const auto& run : runs) {
+                total += run.segment ? run.segment->units() : views[run.shard].units();
+            }
+            return total;
+        }
+
+        Money revenue() const {
+            Money total;
+            for (const auto& run : runs) {
+                total += run.segment ? run.segment->revenue() : views[run.shard].revenue();
+            }
+            return total;
+        }
+
+        // The book as it was, or null if it was not in the catalogue
+        const Book* findBook(PooledString id) const {
+            return manager.catalogueVersions.find(id, stamp);
+        }
+
+        size_t bookCount() const {
+            return manager.catalogueVersions.count(stamp);
+        }
+    };
+
+    SalesSummary summarizeSales() {
+        Snapshot view(*this);
+        return summarizeSales(view);
+    }
+
+    // Full-history figures from each run's columns in turn; scans every
+    // sale, sealed ones included. A book's sales are all in one shard but
+    // may be spread over its runs, and a customer's over every shard, so
+    // both are added up by id or name.
+    static SalesSummary summarizeSales(const Snapshot& view) {
+        METRIC_TIME(Report);
+        SalesSummary summary;
+        vector<PooledString> bookOrder;     // books in the order first seen
+        unordered_map<PooledString, pair<int64_t, int64_t>> bookTotals;    // revenue in cents, units
+        unordered_map<PooledString, Money> customerRevenue;
+        view.forEachPart(INT64_MIN, INT64_MAX, [&](const SalesColumns::View& columns) {
+            if (columns.size() == 0) {
+                return;
+            }
+            SalesTotals part = columns.totals();
+            SalesTotals& totals = summary.totals;
+            totals.minAmount = totals.count == 0 ? part.minAmount : min(totals.minAmount, part.minAmount);
+            totals.maxAmount = totals.count == 0 ? part.maxAmount : max(totals.maxAmount, part.maxAmount);
+            totals.count += part.count;
+            totals.units += part.units;
+            totals.revenue += part.revenue;
+
+            vector<int64_t> bookRevenue;
+            vector<int64_t> bookUnits;
+            columns.revenueByBook(bookRevenue, bookUnits);
+            for (uint32_t code = 0; code < bookRevenue.size(); code++) {
+                auto entry = bookTotals.emplace(columns.bookId(code), make_pair<int64_t, int64_t>(0, 0));
+                if (entry.second) {
+                    bookOrder.push_back(columns.bookId(code));
+                }
+                entry.first->second.first += bookRevenue[code];
+                entry.first->second.second += bookUnits[code];
+            }
+
+            vector<int64_t> revenue;
+            columns.revenueByCustomer(revenue);
+            for (uint32_t code = 0; code < revenue.size(); code++) {
+                customerRevenue[columns.customerName(code)] += Money::fromCents(revenue[code]);
+            }
+        });
+        for (const auto& id : bookOrder) {
+            const pair<int64_t, int64_t>& total = bookTotals[id];
+            if (summary.topBook.empty() || total.first > summary.topBookRevenue.cents()) {
+                summary.topBook = id;
+                summary.topBookRevenue = Money::fromCents(total.first);
+                summary.topBookUnits = total.second;
+            }
+        }
+        for (const auto& entry : customerRevenue) {
+            if (summary.topCustomer.empty() || entry.second > summary.topCustomerRevenue) {
+                summary.topCustomer = entry.first;
+                summary.topCustomerRevenue = entry.second;
+            }
+        }
+        return summary;
+    }
+
+    void printSalesSummary() {
+        SalesSummary summary = summarizeSales();
+        if (summary.totals.count == 0) {
             return;
         }
-        
-        cout << left << setw(8) << "ID" << setw(25) << "Title" << setw(20) << "Author"
-             << setw(15) << "Category" << setw(10) << "Price" << setw(8) << "Qty"
-             << "Date Added\n";
-        cout << string(80, '-') << "\n";
-        
+        cout << "\nSmallest / Largest Sale: $" << summary.totals.minAmount << " / $" << summary.totals.maxAmount << "\n";
+        cout << "Top Book by Revenue: " << summary.topBook
+             << " ($" << summary.topBookRevenue << ", " << summary.topBookUnits << " sold)\n";
+        cout << "Top Customer: " << summary.topCustomer << " ($" << summary.topCustomerRevenue << ")\n";
+    }
+
+    // The best-selling books over every shard. Each book is in one shard
+    // only, so merging the shards' own top n is exact.
+    vector<pair<int64_t, PooledString>> topSellers(size_t n) {
+        vector<pair<int64_t, PooledString>> top;
+        for (const auto& shard : shards) {
+            lock_guard<mutex> history(shard.lock);
+            vector<pair<int64_t, PooledString>> part = shard.aggregates.topSellers(n);
+            top.insert(top.end(), part.begin(), part.end());
+        }
+        sort(top.begin(), top.end(), greater<pair<int64_t, PooledString>>());
+        if (top.size() > n) {
+            top.resize(n);
+        }
+        return top;
+    }
+
+    // Sales in time order over [from, to) across every shard, as (run,
+    // position) pairs for Snapshot::saleAt(): count of them from rank
+    // start on, ties going to the lower run. total is set to the number in
+    // the range. The rank is found by bisecting on time with each run's
+    // time index, so any page costs the same however many sales come
+    // before it; a sealed run decodes only the blocks it lands in.
+    static vector<pair<size_t, size_t>> salesInTimeOrder(const Snapshot& view, int64_t from, int64_t to,
+                                                         size_t start, size_t count, size_t& total) {
+        size_t runs = view.runCount();
+        vector<size_t> first(runs), last(runs), position(runs);
+        int64_t low = INT64_MAX, high = INT64_MIN;
+        total = 0;
+        for (size_t i = 0; i < runs; i++) {
+            tie(first[i], last[i]) = view.timeRange(i, from, to);
+            if (first[i] < last[i]) {
+                total += last[i] - first[i];
+                low = min(low, view.timeAt(i, first[i]));
+                high = max(high, view.timeAt(i, last[i] - 1));
+            }
+        }
+        vector<pair<size_t, size_t>> rows;
+        if (start >= total) {
+            return rows;
+        }
+        // Sales in the range made before 'when', over every run
+        auto before = [&](int64_t when) {
+            size_t n = 0;
+            for (size_t i = 0; i < runs; i++) {
+                if (first[i] < last[i]) {
+                    n += clamp(view.positionOf(i, when), first[i], last[i]) - first[i];
+                }
+            }
+            return n;
+        };
+        // The time of the sale at rank start is the earliest one with more
+        // than start sales at or before it
+        while (low < high) {
+            int64_t middle = low + (high - low) / 2;
+            if (before(middle + 1) > start) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        // Sales at that time run by run; skip those ranked below start
+        size_t skip = start - before(low);
+        vector<int64_t> next(runs);
+        for (size_t i = 0; i < runs; i++) {
+            if (first[i] == last[i]) {
+                position[i] = last[i];
+                continue;
+            }
+            position[i] = clamp(view.positionOf(i, low), first[i], last[i]);
+            size_t same = clamp(view.positionOf(i, low + 1), first[i], last[i]) - position[i];
+            size_t step = min(skip, same);
+            position[i] += step;
+            skip -= step;
+            if (position[i] < last[i]) {
+                next[i] = view.timeAt(i, position[i]);
+            }
+        }
+        // Merge the runs, keeping the time of each one's next sale
+        while (rows.size() < count) {
+            size_t earliest = runs;
+            for (size_t i = 0; i < runs; i++) {
+                if (position[i] < last[i] && (earliest == runs || next[i] < next[earliest])) {
+                    earliest = i;
+                }
+            }
+            if (earliest == runs) {
+                break;
+            }
+            rows.emplace_back(earliest, position[earliest]++);
+            if (position[earliest] < last[earliest]) {
+                next[earliest] = view.timeAt(earliest, position[earliest]);
+            }
+        }
+        return rows;
+    }
+
+    // Ask for a day range; false if the input was not valid
+    bool promptDateRange(int64_t& from, int64_t& to) {
+        string first, last;
+        cout << "\nFrom date (YYYY-MM-DD): ";
+        getline(cin, first);
+        cout << "To date, inclusive (YYYY-MM-DD): ";
+        getline(cin, last);
+        int64_t lastDay;
+        if (!parseDay(first, from) || !parseDay(last, lastDay)) {
+            cout << "Dates must look like 2026-10-17. Press Enter to continue...";
+            cin.get();
+            return false;
+        }
+        to = startOfDay(lastDay, 1);
+        return true;
+    }
+
+    // Pages through the history, or a date range of it, in time order over
+    // every shard, so any page costs the same however many sales there
+    // are. Footer figures come from the running aggregates; the full
+    // summary is only computed on request.
+    void viewSales() {
+        awaitData();
+        size_t page = 0;
+        bool dated = false;
+        int64_t from = 0, to = 0;
+        while (true) {
+            string rows;
+            size_t saleCount, rangeCount, pageCount;
+            int64_t units;
+            Money revenue;
+            {
+                Snapshot view(*this);
+                saleCount = view.saleCount();
+                salesInTimeOrder(view, dated ? from : INT64_MIN, dated ? to : INT64_MAX, 0, 0, rangeCount);
+                pageCount = (rangeCount + PAGE_ROWS - 1) / PAGE_ROWS;
+                page = min(page, pageCount ? pageCount - 1 : 0);
+                TableRow header;
+                header.text("Sale ID", 8).text("Book ID", 8).text("Book Title", 25).text("Qty", 5)
+                      .text("Amount", 10).text("Customer", 15).text("Date").appendTo(rows);
+                rows.append(80, '-');
+                rows += '\n';
+                for (const auto& row : salesInTimeOrder(view, dated ? from : INT64_MIN, dated ? to : INT64_MAX,
+                                                        page * PAGE_ROWS, PAGE_ROWS, rangeCount)) {
+                    appendSaleRow(rows, view.saleAt(row.first, row.second));
+                }
+                units = view.units();
+                revenue = view.revenue();
+            }
+
+            clearScreen();
+            cout << "\n" << string(80, '=') << "\n";
+            cout << "                    SALES HISTORY\n";
+            cout << string(80, '=') << "\n";
+
+            if (saleCount == 0) {
+                cout << "\nNo sales records found.\n";
+                cout << "Press Enter to continue...";
+                cin.get();
+                return;
+            }
+
+            if (rangeCount == 0) {
+                rows += "No sales in this date range.\n";
+            }
+            cout << rows;
+            cout << string(80, '-') << "\n";
+            cout << "Page " << page + 1 << " of " << max<size_t>(pageCount, 1);
+            if (dated) {
+                cout << "  |  " << rangeCount << " sale(s) from " << dayKey(from) << " to " << dayKey(to - 1);
+            }
+            cout << "\n";
+            cout << "Total Sales: $" << revenue << "\n";
+            cout << "Total Transactions: " << saleCount << "\n";
+            cout << "Books Sold: " << units << "\n";
+            cout << "[n]ext  [p]rev  [f]irst  [l]ast  [g]o to page  [d]ate range  [a]ll dates  [r]eport  [q]uit: ";
+
+            string command;
+            if (!getline(cin, command)) {
+                return;
+            }
+            char choice = command.empty() ? 'n' : (char)tolower((unsigned char)command[0]);
+            switch (choice) {
+                case 'n':
+                    if (page + 1 < pageCount) {
+                        page++;
+                    } else if (command.empty()) {
+                        return;
+                    }
+                    break;
+                case 'p':
+                    if (page > 0) {
+                        page--;
+                    }
+                    break;
+                case 'f':
+                    page = 0;
+                    break;
+                case 'l':
+                    page = pageCount ? pageCount - 1 : 0;
+                    break;
+                case 'g':
+                    page = (size_t)getValidatedInt("Page: ", 1, (int)min(max<size_t>(pageCount, 1), (size_t)INT_MAX)) - 1;
+                    break;
+                case 'd':
+                    if (promptDateRange(from, to)) {
+                        dated = true;
+                        page = 0;
+                    }
+                    break;
+                case 'a':
+                    dated = false;
+                    page = 0;
+                    break;
+                case 'r':
+                    printSalesSummary();
+                    cout << "Press Enter to continue...";
+                    cin.get();
+                    break;
+                case 'q':
+                    return;
+            }
+        }
+    }
+
+    void searchBooks() {
+        awaitData();
+        clearScreen();
+        cout << "\n" << string(80, '=') << "\n";
+        cout << "                    SEARCH BOOKS\n";
+        cout << string(80, '=') << "\n\n";
+
+        string query = getValidatedString("Search title, author or category: ");
+
+        vector<SearchResult> results;
+        auto start = chrono::steady_clock::now();
+        {
+            shared_lock<shared_mutex> catalogue(catalogueMutex);
+            results = searchIndex.search(query, 20);
+        }
+        double micros = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+
+        if (results.empty()) {
+            cout << "\nNo books match \"" << query << "\".\n";
+        } else {
+            cout << "\n" << left << setw(8) << "ID" << setw(30) << "Title" << setw(20) << "Author"
+                 << setw(15) << "Category" << setw(10) << "Price" << "Qty\n";
+            cout << string(80, '-') << "\n";
+            for (const auto& result : results) {
+                auto it = findBook(result.bookId);
+                if (it == books.end()) {
+                    continue;
+                }
+                cout << left << setw(8) << it->id << setw(30) << it->title.substr(0, 29)
+                     << setw(20) << it->author.substr(0, 19) << setw(15) << it->category.substr(0, 14)
+                     << setw(10) << it->price << it->quantity << "\n";
+            }
+        }
+        cout << "\n" << results.size() << " result(s) in " << fixed << setprecision(1) << micros << " µs\n";
+        cout << "Press Enter to continue...";
+        cin.get();
+    }
+
+    // Company information
+    // Figures from the running aggregates; nothing here scans the history.
+    // Book details come from a snapshot, so catalogue changes never wait.
+    void printCompanyStatistics() {
+        awaitData();
+        METRIC_TIME(Report);
+        Snapshot view(*this);
+        cout << "Current Statistics:\n";
+        cout << "Total Books in Stock: " << view.bookCount() << "\n";
+        size_t saleCount = 0;
+        int64_t units = 0;
+        Money revenue, todayRevenue;
+        string today = dayKey(getCurrentTimestamp());
+        for (const auto& shard : shards) {
+            lock_guard<mutex> history(shard.lock);
+            saleCount += shard.aggregates.count();
+            units += shard.aggregates.units();
+            revenue += shard.aggregates.revenue();
+            todayRevenue += shard.aggregates.revenueOn(today);
+        }
+        cout << "Total Sales Made: " << saleCount << "\n";
+        cout << "Total Books Sold: " << units << "\n";
+        cout << "Total Revenue: $" << revenue << "\n";
+        cout << "Today's Revenue: $" << todayRevenue << "\n";
+        {
+            lock_guard<mutex> lock(usersMutex);
+            cout << "System Users: " << users.size() << "\n";
+        }
+
+        vector<pair<int64_t, PooledString>> top = topSellers(5);
+        if (!top.empty()) {
+            cout << "\nBestsellers:\n";
+            for (size_t i = 0; i < top.size(); i++) {
+                const Book* book = view.findBook(top[i].second);
+                cout << i + 1 << ". " << top[i].second;
+                if (book) {
+                    cout << " - " << book->title;
+                }
+                cout << " (" << top[i].first << " sold)\n";
+            }
+        }
+    }
+
+    void viewCompanyDetails() {
+        clearScreen();
+        cout << "\n" << string(60, '=') << "\n";
+        cout << "              COMPANY INFORMATION\n";
+        cout << string(60, '=') << "\n\n";
+        
+        cout << "Company Name: GENIUS BOOKS\n";
+        cout << "Established: 2020\n";
+        cout << "Address: 123 Main Street, City Center\n";
+        cout << "Phone: +1 (555) 123-4567\n";
+        cout << "Email: info@geniusbooks.com\n";
+        cout << "Website: www.geniusbooks.com\n\n";
+        
+        cout << "About Us:\n";
+        cout << "GENIUS BOOKS is a leading bookshop in the city, providing\n";
+        cout << "a wide variety of books across all genres. We pride ourselves\n";
+        cout << "on excellent customer service and competitive prices.\n\n";
+        
+        cout << "Our Mission:\n";
+        cout << "To promote reading culture and provide easy access to\n";
+        cout << "quality books for everyone in our community.\n\n";
+        
+        printCompanyStatistics();
+        
+        cout << "\nPress Enter to continue...";
+        cin.get();
+    }
+
+    // Batch mode
+    // Apply one command line; returns false with error set if it was rejected
+    //   ADD|id|title|author|category|price|quantity
+    //   UPDATE|id|field=value|...   (title, author, category, price, quantity)
+    //   DELETE|id
+    //   SALE|book id|quantity|customer name
+    //   CART|customer name|book id|quantity|book id|quantity|...
+    bool applyBatchCommand(string_view line, string& error) {
+        if (line.substr(0, 5) == "CART|") {
+            return applyBatchCart(line, error);
+        }
+        string_view fields[8];
+        size_t count = splitFields(line, fields, 8);
+        string_view command = fields[0];
+
+        if (command == "ADD") {
+            if (count != 7) {
+                error = "ADD needs id|title|author|category|price|quantity";
+                return false;
+            }
+            Book book;
+            book.id.assign(fields[1]);
+            book.title.assign(fields[2]);
+            book.author.assign(fields[3]);
+            book.category.assign(fields[4]);
+            if (!Money::parse(fields[5], book.price) || !parseNumber(fields[6], book.quantity)) {
+                error = "invalid price or quantity";
+                return false;
+            }
+            return applyAddBook(book, error);
+        }
+        if (command == "UPDATE") {
+            if (count < 3) {
+                error = "UPDATE needs id|field=value";
+                return false;
+            }
+            BookChanges changes;
+            vector<string_view> assignments(fields + 2, fields + count);
+            // Everything past the eighth field is still packed into the last one
+            while (assignments.back().find('|') != string_view::npos) {
+                string_view rest = assignments.back();
+                size_t sep = rest.find('|');
+                assignments.back() = rest.substr(0, sep);
+                assignments.push_back(rest.substr(sep + 1));
+            }
+            for (string_view assignment : assignments) {
+                size_t eq = assignment.find('=');
+                if (eq == string_view::npos) {
+                    error = "expected field=value, got '" + string(assignment) + "'";
+                    return false;
+                }
+                string_view field = assignment.substr(0, eq);
+                string_view value = assignment.substr(eq + 1);
+                bool ok = true;
+                if (field == "title") {
+                    changes.title = string(value);
+                } else if (field == "author") {
+                    changes.author = string(value);
+                } else if (field == "category") {
+                    changes.category = string(value);
+                } else if (field == "price") {
+                    Money price;
+                    ok = Money::parse(value, price);
+                    changes.price = price;
+                } else if (field == "quantity") {
+                    int quantity;
+                    ok = parseNumber(value, quantity);
+                    changes.quantity = quantity;
+                } else {
+                    error = "unknown field '" + string(field) + "'";
+                    return false;
+                }
+                if (!ok) {
+                    error = "invalid number for " + string(field);
+                    return false;
+                }
+            }
+            return applyUpdateBook(string(fields[1]), changes, error);
+        }
+        if (command == "DELETE") {
+            if (count != 2) {
+                error = "DELETE needs id";
+                return false;
+            }
+            return applyDeleteBook(string(fields[1]), error);
+        }
+        if (command == "SALE") {
+            int quantity;
+            if (count != 4 || !parseNumber(fields[2], quantity)) {
+                error = "SALE needs book id|quantity|customer name";
+                return false;
+            }
+            Sale sale;
+            return applySale(string(fields[1]), quantity, string(fields[3]), sale, error);
+        }
+        error = "unknown command '" + string(command) + "'";
+        return false;
+    }
+
+    bool applyBatchCart(string_view line, string& error) {
+        vector<string_view> fields(2 + 2 * MAX_CART_LINES + 1);
+        size_t count = splitFields(line, fields.data(), fields.size());
+        if (count < 4 || count % 2 != 0 || count > 2 + 2 * MAX_CART_LINES) {
+            error = "CART needs customer name|book id|quantity|... with at most "
+                    + to_string(MAX_CART_LINES) + " books";
+            return false;
+        }
+        vector<CartLine> cart;
+        for (size_t i = 2; i < count; i += 2) {
+            CartLine item{string(fields[i]), 0};
+            if (!parseNumber(fields[i + 1], item.quantity)) {
+                error = "invalid quantity for " + item.bookId;
+                return false;
+            }
+            cart.push_back(item);
+        }
+        vector<Sale> sold;
+        return applyCart(cart, string(fields[1]), sold, error);
+    }
+
+    // Stream commands from in, persisting once per batchSize lines.
+    // Rejected lines are reported on stderr and do not stop the run.
+    // Returns the number of rejected lines, and at least 1 if the journal
+    // could not be written at the end.
+    size_t runBatch(istream& in, size_t batchSize) {
+        auto start = chrono::steady_clock::now();
+        size_t lineNumber = 0;
+        size_t applied = 0;
+        size_t failed = 0;
+        size_t inBatch = 0;
+        string line;
+        string error;
+
+        while (getline(in, line)) {
+            lineNumber++;
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            error.clear();
+            if (applyBatchCommand(line, error)) {
+                applied++;
+            } else {
+                failed++;
+                cerr << "line " << lineNumber << ": " << error << "\n";
+            }
+            if (++inBatch >= batchSize) {
+                if (!journal.commit()) {
+                    cerr << "✗ could not write to " << JOURNAL_FILE << "\n";
+                }
+                inBatch = 0;
+            }
+        }
+        if (!journal.commit()) {
+            cerr << "✗ could not write to " << JOURNAL_FILE << "\n";
+            failed = max<size_t>(failed, 1);
+        }
+        if (journal.size() >= JOURNAL_COMPACT_THRESHOLD) {
+            flusher.request();
+        }
+
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout << "✓ Batch finished: " << applied << " applied, " << failed << " rejected, "
+             << lineNumber << " lines in " << fixed << setprecision(3) << seconds << " s ("
+             << setprecision(0) << (seconds > 0 ? (applied + failed) / seconds : 0) << " commands/s)\n";
+        return failed;
+    }
+
+    // Network service
+    // Add copies to a book's stock; level is the stock afterwards
+    bool applyRestock(const string& bookId, int copies, int& level, string& error) {
+        shared_lock<shared_mutex> catalogue(catalogueMutex);
+        auto it = findBook(bookId);
+        if (it == books.end()) {
+            error = "Book not found";
+            return false;
+        }
+        lock_guard<mutex> stock(stockLockFor(bookId));
+        if (copies < 1 || copies > INT_MAX - it->quantity) {
+            error = "Quantity must be between 1 and " + to_string(INT_MAX - it->quantity);
+            return false;
+        }
+        setStock(*it, it->quantity + copies);
+        stockWatcher.publish(it->id, it->quantity);
+        level = it->quantity;
+        journal.append("Q|" + it->id.str() + "|" + to_string(level));
+        return true;
+    }
+
+    // Book record as the service sends it; the caller holds the catalogue
+    // lock, and the stock is read under the book's stripe
+    void appendBookLine(string& out, const Book& book) {
+        int quantity;
+        {
+            lock_guard<mutex> stock(stockLockFor(book.id));
+            quantity = book.quantity;
+        }
+        out += book.id;
+        out += '|';
+        out += book.title;
+        out += '|';
+        out += book.author;
+        out += '|';
+        out += book.category;
+        out += '|';
+        book.price.appendTo(out);
+        out += '|';
+        out += to_string(quantity);
+        out += '\n';
+    }
+
+    // Answer one request of the service protocol by appending the response
+    // to out. Returns true if the request queued journal records, which
+    // must be committed before the response is sent.
+    //   PING                         OK|PONG
+    //   LOOKUP|id                    OK|id|title|author|category|price|quantity
+    //   SEARCH|words[|limit]         OK|n, then n book lines as for LOOKUP
+    //   LIST|offset|limit            OK|n, then n book lines
+    //   SELL|id|quantity|customer    OK|sale id|total
+    //   RESTOCK|id|quantity          OK|id|stock afterwards
+    //   REPORT|kind[|top]            OK|n, then n lines: the column names and
+    //                                the rows (kinds as for --report)
+    // Refused requests get ERR|reason.
+    bool handleRequest(string_view line, string& out) {
+        METRIC_ADD(Requests, 1);
+        const size_t MAX_ROWS = 1000;
+        string_view fields[5];
+        size_t count = splitFields(line, fields, 5);
+        string_view command = fields[0];
+        string error;
+
+        if (command == "PING") {
+            out += "OK|PONG\n";
+            return false;
+        }
+        if (command == "LOOKUP" && count == 2) {
+            shared_lock<shared_mutex> catalogue(catalogueMutex);
+            auto it = findBook(fields[1]);
+            if (it != books.end()) {
+                out += "OK|";
+                appendBookLine(out, *it);
+                return false;
+            }
+            error = "Book not found";
+        } else if ((command == "SEARCH" && (count == 2 || count == 3)) || (command == "LIST" && count == 3)) {
+            size_t offset = 0, limit = 20;
+            if ((command == "LIST" && !parseNumber(fields[1], offset)) ||
+                (count == 3 && !parseNumber(fields[2], limit))) {
+                out += "ERR|invalid offset or limit\n";
+                return false;
+            }
+            limit = min(limit, MAX_ROWS);
+            shared_lock<shared_mutex> catalogue(catalogueMutex);
+            vector<const Book*> found;
+            if (command == "LIST") {
+                size_t skipped = 0;
+                catalogueOrder.walk(0, [&](uint32_t slot) {
+                    if (skipped < offset) {
+                        skipped++;
+                        return true;
+                    }
+                    if (found.size() == limit) {
+                        return false;
+                    }
+                    found.push_back(&books[slot]);
+                    return true;
+                });
+            } else {
+                for (const auto& result : searchIndex.search(fields[1], limit)) {
+                    auto it = findBook(result.bookId);
+                    if (it != books.end()) {
+                        found.push_back(&*it);
+                    }
+                }
+            }
+            out += "OK|" + to_string(found.size()) + "\n";
+            for (const Book* book : found) {
+                appendBookLine(out, *book);
+            }
+            return false;
+        } else if (command == "SELL" && count == 4) {
+            int quantity;
+            Sale sale;
+            if (!parseNumber(fields[2], quantity)) {
+                error = "invalid quantity";
+            } else if (applySale(string(fields[1]), quantity, string(fields[3]), sale, error)) {
+                out += "OK|" + sale.saleId + "|" + sale.totalAmount.str() + "\n";
+                return true;
+            }
+        } else if (command == "RESTOCK" && count == 3) {
+            int copies, level;
+            if (!parseNumber(fields[2], copies)) {
+                error = "invalid quantity";
+            } else if (applyRestock(string(fields[1]), copies, level, error)) {
+                out += "OK|" + string(fields[1]) + "|" + to_string(level) + "\n";
+                return true;
+            }
+        } else if (command == "REPORT" && (count == 2 || count == 3)) {
+            static const map<string_view, SalesReport> KINDS = {
+                {"top-books", SalesReport::TopBooks}, {"categories", SalesReport::Categories},
+                {"customers", SalesReport::Customers}, {"daily", SalesReport::Daily}, {"monthly", SalesReport::Monthly}};
+            auto kind = KINDS.find(fields[1]);
+            size_t top = 20;
+            if (kind == KINDS.end()) {
+                error = "unknown report " + string(fields[1]);
+            } else if (count == 3 && !parseNumber(fields[2], top)) {
+                error = "invalid row count";
+            } else {
+                ReportTable table = buildReport(kind->second, INT64_MIN, INT64_MAX, min(top, MAX_ROWS));
+                size_t rows = min(table.rows.size(), MAX_ROWS);
+                out += "OK|" + to_string(rows + 1) + "\n";
+                for (size_t r = 0; r <= rows; r++) {
+                    const vector<string>& cells = r == 0 ? table.columns : table.rows[r - 1];
+                    for (size_t c = 0; c < cells.size(); c++) {
+                        out += cells[c];
+                        out += c + 1 < cells.size() ? '|' : '\n';
+                    }
+                }
+                return false;
+            }
+        } else {
+            error = "unknown request";
+        }
+        out += "ERR|" + error + "\n";
+        return false;
+    }
+
+    // Memory report
+    // Bytes per record with the loaded data, against the same data held
+    // in std::string fields as before the string pool
+    static size_t heapStringBytes(size_t length) {
+        // libstdc++ keeps up to 15 chars inline; longer strings take a malloc
+        // block of length + 1 plus an 8-byte header, rounded up to 16
+        return length <= 15 ? 0 : (length + 1 + 8 + 15) / 16 * 16;
+    }
+
+    void printMemoryReport() {
+        struct StringBook {
+            string id, title, author, category;
+            double price;
+            int quantity;
+            string dateAdded;
+        };
+        struct StringSale {
+            string saleId, bookId, bookTitle;
+            int quantity;
+            double totalAmount;
+            string date, customerName;
+        };
+
+        size_t bookHeapBefore = 0;
         for (const auto& book : books) {
-            cout << left << setw(8) << book.id << setw(25) << book.title.substr(0, 24)
-                 << setw(20) << book.author.substr(0, 19) << setw(15) << book.category.substr(0, 14)
-                 << setw(10) << fixed << setprecision(2) << book.price
-                 << setw(8) << book.quantity << book.dateAdded << "\n";
+            bookHeapBefore += heapStringBytes(book.id.size()) + heapStringBytes(book.title.size())
+                              + heapStringBytes(book.author.size()) + heapStringBytes(book.category.size())
+                              + heapStringBytes(24);    // dates were ctime() text
+        }
+        // Only hot sales are in memory; sealed ones are counted on disk
+        size_t saleHeapBefore = 0;
+        size_t saleHeapAfter = 0;
+        size_t saleCount = 0;
+        size_t sealedCount = 0, segmentCount = 0, segmentBytes = 0;
+        for (const auto& shard : shards) {
+            for (const auto& sale : shard.hot->sales) {
+                saleHeapBefore += heapStringBytes(sale.saleId.size()) + heapStringBytes(sale.bookId.size())
+                                  + heapStringBytes(sale.bookTitle.size()) + heapStringBytes(24)
+                                  + heapStringBytes(sale.customerName.size());
+                saleHeapAfter += heapStringBytes(sale.saleId.size());
+            }
+            saleCount += shard.hot->sales.size();
+            for (const auto& segment : *shard.cold) {
+                sealedCount += segment->size();
+                segmentCount++;
+                segmentBytes += segment->fileBytes();
+            }
+        }
+
+        size_t records = books.size() + saleCount;
+        size_t before = books.size() * sizeof(StringBook) + bookHeapBefore
+                        + saleCount * sizeof(StringSale) + saleHeapBefore;
+        size_t poolBytes = StringPool::shared().bytesUsed();
+        size_t after = books.size() * sizeof(Book) + saleCount * sizeof(Sale) + saleHeapAfter + poolBytes;
+
+        cout << "Books: " << books.size() << ", Sales: " << saleCount << " in memory, " << sealedCount << " sealed\n";
+        cout << "Book record: " << sizeof(StringBook) << " -> " << sizeof(Book) << " bytes\n";
+        cout << "Sale record: " << sizeof(StringSale) << " -> " << sizeof(Sale) << " bytes\n";
+        cout << "String pool: " << StringPool::shared().count() << " strings, " << poolBytes << " bytes\n";
+        if (sealedCount > 0) {
+            cout << "Sealed segments: " << segmentCount << " files, " << segmentBytes << " bytes, "
+                 << fixed << setprecision(1) << (double)segmentBytes / sealedCount << " bytes per sale\n";
+        }
+        if (records > 0) {
+            cout << "Bytes per record including strings: " << before / records
+                 << " -> " << after / records << "\n";
         }
-        
-        cout << "\nTotal Books: " << books.size() << "\n";
-        cout << "Press Enter to continue...";
-        cin.get();
     }
 
-    void addBook() {
-        clearScreen();
-        cout << "\n" << string(60, '=') << "\n";
-        cout << "                ADD NEW BOOK\n";
-        cout << string(60, '=') << "\n\n";
-        
-        Book newBook;
-        newBook.id = getValidatedString("Enter Book ID: ");
-        
-        // Check if book ID already exists
-        for (const auto& book : books) {
-            if (book.id == newBook.id) {
-                cout << "\n✗ Book ID already exists! Please use a different ID.\n";
-                cout << "Press Enter to continue...";
-                cin.get();
-                return;
+    // Checkout stress test
+    // Hammer a few hot books from 1, 2, 4 ... maxThreads threads, then check
+    // that nothing was oversold, every sale is accounted for once, and a
+    // fresh load from disk reproduces the same state. Returns false on any
+    // broken invariant.
+    static bool runCheckoutStressTest(int maxThreads, int salesPerThread) {
+        const int HOT_BOOKS = 4;
+        bool passed = true;
+
+        cout << left << setw(10) << "Threads" << setw(12) << "Sales" << setw(12) << "Rejected"
+             << setw(14) << "Checkouts/s" << "Result\n";
+        cout << string(60, '-') << "\n";
+
+        for (int threads = 1; threads <= maxThreads; threads *= 2) {
+            string dataDirectory = makeScratchDirectory("bookshop-stress");
+            if (dataDirectory.empty()) {
+                return false;
+            }
+            vector<string> problems;
+
+            // Stock for only half the attempted sales, so some must be refused
+            map<string, int> initialStock;
+            int perBook = max(1, threads * salesPerThread / HOT_BOOKS);
+            atomic<long> sold(0);
+            atomic<long> rejected(0);
+            vector<map<string, long>> unitsByThread(threads);
+            double seconds = 0;
+            {
+                BookshopManager manager(dataDirectory);
+                string error;
+                for (int b = 0; b < HOT_BOOKS; b++) {
+                    Book book;
+                    book.id = "HOT" + to_string(b);
+                    book.title = "Hot Book " + to_string(b);
+                    book.author = "Stress";
+                    book.category = "Test";
+                    book.price = Money::fromCents((10 + b) * 100);
+                    book.quantity = perBook;
+                    manager.applyAddBook(book, error);
+                    initialStock[book.id.str()] = perBook;
+                }
+                manager.commitJournal();
+
+                auto start = chrono::steady_clock::now();
+                vector<thread> workers;
+                for (int t = 0; t < threads; t++) {
+                    workers.emplace_back([&, t]() {
+                        mt19937 rng(t + 1);
+                        string customer = "Terminal " + to_string(t);
+                        string saleError;
+                        for (int i = 0; i < salesPerThread; i++) {
+                            string bookId = "HOT" + to_string(rng() % HOT_BOOKS);
+                            int quantity = 1 + rng() % 3;
+                            if (i % 4 == 3) {
+                                // Every fourth checkout is a cart across
+                                // several books, all sold or none
+                                vector<CartLine> cart;
+                                for (int b = rng() % HOT_BOOKS; cart.size() < size_t(1 + i % 3); b = (b + 1) % HOT_BOOKS) {
+                                    cart.push_back({"HOT" + to_string(b), 1 + (int)(rng() % 2)});
+                                }
+                                vector<Sale> cartSales;
+                                if (manager.checkoutCart(cart, customer, cartSales, saleError)) {
+                                    for (const auto& line : cart) {
+                                        unitsByThread[t][line.bookId] += line.quantity;
+                                    }
+                                    sold += cartSales.size();
+                                } else {
+                                    rejected++;
+                                }
+                                continue;
+                            }
+                            Sale sale;
+                            if (manager.checkout(bookId, quantity, customer, sale, saleError)) {
+                                unitsByThread[t][bookId] += quantity;
+                                sold++;
+                            } else {
+                                rejected++;
+                            }
+                        }
+                    });
+                }
+                for (auto& worker : workers) {
+                    worker.join();
+                }
+                seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+                set<string> saleIds;
+                for (const auto& shard : manager.shards) {
+                    forEachRecordedSale(shard, [&](const Sale& sale) {
+                        if (!saleIds.insert(sale.saleId).second) {
+                            problems.push_back("duplicate sale ID " + sale.saleId);
+                        }
+                    });
+                }
+                if ((long)manager.totalSales != sold) {
+                    problems.push_back("recorded sales differ from successful checkouts");
+                }
+                for (const auto& entry : initialStock) {
+                    long units = 0;
+                    for (const auto& perThread : unitsByThread) {
+                        auto it = perThread.find(entry.first);
+                        units += it == perThread.end() ? 0 : it->second;
+                    }
+                    auto book = manager.findBook(entry.first);
+                    if (book->quantity < 0) {
+                        problems.push_back(entry.first + " was oversold");
+                    }
+                    if (entry.second - book->quantity != units ||
+                        manager.shardFor(entry.first).aggregates.bookTotal(PooledString(entry.first)).units != units) {
+                        problems.push_back(entry.first + " stock does not match units sold");
+                    }
+                }
+                vector<string> aggregateProblems;
+                for (const auto& shard : manager.shards) {
+                    if (!shard.aggregates.verify(recomputeAggregates(shard), aggregateProblems)) {
+                        problems.push_back("sales aggregates are inconsistent");
+                    }
+                }
+
+                // Replaying the journal must give back the same state. A
+                // checkpoint still running finishes first, as on exit.
+                manager.shutdown();
+                BookshopManager reloaded(dataDirectory);
+                if (reloaded.shardSizes() != manager.shardSizes()) {
+                    problems.push_back("reloaded sales differ");
+                }
+                for (const auto& entry : initialStock) {
+                    if (reloaded.findBook(entry.first)->quantity != manager.findBook(entry.first)->quantity) {
+                        problems.push_back("reloaded stock differs for " + entry.first);
+                    }
+                }
+            }
+
+            removeScratchDirectory(dataDirectory);
+
+            cout << left << setw(10) << threads << setw(12) << sold.load() << setw(12) << rejected.load()
+                 << setw(14) << fixed << setprecision(0) << (sold + rejected) / seconds
+                 << (problems.empty() ? "PASS" : "FAIL") << "\n";
+            for (const auto& problem : problems) {
+                cout << "  - " << problem << "\n";
             }
+            passed = passed && problems.empty();
         }
-        
-        newBook.title = getValidatedString("Enter Book Title: ");
-        newBook.author = getValidatedString("Enter Author Name: ");
-        newBook.category = getValidatedString("Enter Category: ");
-        newBook.price = getValidatedDouble("Enter Price: $", 0.01);
-        newBook.quantity = getValidatedInt("Enter Quantity: ", 0);
-        newBook.dateAdded = getCurrentDateTime();
-        
-        books.push_back(newBook);
-        saveBooks();
-        
-        cout << "\n✓ Book added successfully!\n";
-        cout << "Press Enter to continue...";
-        cin.get();
+        return passed;
     }
 
-    void updateBook() {
-        clearScreen();
-        cout << "\n" << string(60, '=') << "\n";
-        cout << "                UPDATE BOOK\n";
-        cout << string(60, '=') << "\n\n";
-        
-        string bookId = getValidatedString("Enter Book ID to update: ");
-        
-        auto it = find_if(books.begin(), books.end(),
-                         [&bookId](const Book& book) { return book.id == bookId; });
-        
-        if (it == books.end()) {
-            cout << "\n✗ Book not found!\n";
-            cout << "Press Enter to continue...";
-            cin.get();
-            return;
+    // Snapshot stress test
+    // Sellers check out books on their own, then again while report threads
+    // scan snapshots of a large history and an editor keeps renaming and
+    // recategorising the best sellers, and finally while a checkpoint seals
+    // the old history into segments underneath all of them. Every report is
+    // built twice from one snapshot and must come out the same both times,
+    // its totals must match a full scan, once the readers are gone every
+    // retired version must have been freed, and the reports must read the
+    // same after a reload. Prints checkout latency for each phase; returns
+    // false on any broken invariant.
+    static bool runSnapshotStressTest(int sellers, int salesPerSeller) {
+        const size_t BOOKS = 2000;
+        const size_t HISTORY = 500000;
+        const int REPORTERS = 2;
+        string dataDirectory = makeScratchDirectory("bookshop-snapshots");
+        if (dataDirectory.empty()) {
+            return false;
         }
-        
-        cout << "\nCurrent Book Details:\n";
-        cout << "ID: " << it->id << "\n";
-        cout << "Title: " << it->title << "\n";
-        cout << "Author: " << it->author << "\n";
-        cout << "Category: " << it->category << "\n";
-        cout << "Price: $" << fixed << setprecision(2) << it->price << "\n";
-        cout << "Quantity: " << it->quantity << "\n\n";
-        
-        int choice = getValidatedInt("What would you like to update?\n1. Title\n2. Author\n3. Category\n4. Price\n5. Quantity\n6. All Details\nEnter choice: ", 1, 6);
-        
-        switch (choice) {
-            case 1:
-                it->title = getValidatedString("Enter new title: ");
-                break;
-            case 2:
-                it->author = getValidatedString("Enter new author: ");
-                break;
-            case 3:
-                it->category = getValidatedString("Enter new category: ");
-                break;
-            case 4:
-                it->price = getValidatedDouble("Enter new price: $", 0.01);
-                break;
-            case 5:
-                it->quantity = getValidatedInt("Enter new quantity: ", 0);
-                break;
-            case 6:
-                it->title = getValidatedString("Enter new title: ");
-                it->author = getValidatedString("Enter new author: ");
-                it->category = getValidatedString("Enter new category: ");
-                it->price = getValidatedDouble("Enter new price: $", 0.01);
-                it->quantity = getValidatedInt("Enter new quantity: ", 0);
-                break;
+        vector<string> problems;
+        mutex problemsMutex;
+        auto fail = [&](const string& problem) {
+            lock_guard<mutex> lock(problemsMutex);
+            if (find(problems.begin(), problems.end(), problem) == problems.end()) {
+                problems.push_back(problem);
+            }
+        };
+
+        cout << left << setw(10) << "Phase" << setw(12) << "Checkouts" << setw(12) << "p50 (µs)"
+             << setw(12) << "p99 (µs)" << setw(12) << "max (µs)" << setw(10) << "Reports" << "Edits\n";
+        cout << string(76, '-') << "\n";
+        {
+            BookshopManager manager(dataDirectory);
+            SyntheticData data(BOOKS, 0.99, 42);
+            data.generateBooks(manager.books);
+            SalesHistory generated;
+            data.generateSales(manager.books, HISTORY, generated);
+            manager.rebuildBookIndexes();
+            manager.adoptSales(generated);
+            vector<string> ids = data.workloadIds((size_t)sellers * salesPerSeller);
+            const SalesReport kinds[] = {SalesReport::TopBooks, SalesReport::Categories, SalesReport::Customers,
+                                         SalesReport::Daily, SalesReport::Monthly};
+
+            for (const char* phase : {"alone", "reports", "sealing"}) {
+                bool withReports = string(phase) != "alone";
+                atomic<bool> selling(true);
+                atomic<size_t> reports(0);
+                atomic<size_t> edits(0);
+                vector<vector<double>> latencies(sellers);
+                vector<thread> readers;
+                if (withReports) {
+                    for (int r = 0; r < REPORTERS; r++) {
+                        readers.emplace_back([&]() {
+                            while (selling) {
+                                Snapshot view(manager);
+                                for (SalesReport kind : kinds) {
+                                    ReportTable first = buildReport(view, kind, INT64_MIN, INT64_MAX, 0);
+                                    ReportTable second = buildReport(view, kind, INT64_MIN, INT64_MAX, 0);
+                                    if (first.rows != second.rows) {
+                                        fail(first.title + " changed within one snapshot");
+                                    }
+                                }
+                                SalesSummary summary = summarizeSales(view);
+                                if (summary.totals.count != view.saleCount() || summary.totals.units != view.units() ||
+                                    summary.totals.revenue != view.revenue()) {
+                                    fail("snapshot totals differ from a scan of it");
+                                }
+                                reports += 2 * size(kinds) + 1;
+                            }
+                        });
+                    }
+                    readers.emplace_back([&]() {
+                        string error;
+                        for (size_t n = 0; selling; n++) {
+                            BookChanges changes;
+                            if (n % 2 == 0) {
+                                changes.title = "Renamed " + to_string(n);
+                            } else {
+                                changes.category = "Category " + to_string(n % 7);
+                            }
+                            if (!manager.applyUpdateBook(SyntheticData::bookId(n % 20), changes, error)) {
+                                fail("catalogue update failed: " + error);
+                            }
+                            manager.commitJournal();
+                            edits++;
+                            this_thread::sleep_for(chrono::microseconds(200));
+                        }
+                    });
+                }
+                if (string(phase) == "sealing") {
+                    readers.emplace_back([&]() {
+                        if (!manager.checkpoint()) {
+                            fail("checkpoint failed while sealing");
+                        }
+                    });
+                }
+
+                vector<thread> workers;
+                for (int t = 0; t < sellers; t++) {
+                    workers.emplace_back([&, t]() {
+                        string customer = "Terminal " + to_string(t);
+                        string error;
+                        for (int i = 0; i < salesPerSeller; i++) {
+                            Sale sale;
+                            auto start = chrono::steady_clock::now();
+                            bool sold = manager.checkout(ids[(size_t)t * salesPerSeller + i], 1, customer, sale, error);
+                            latencies[t].push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - start).count());
+                            if (!sold) {
+                                fail("checkout failed: " + error);
+                            }
+                        }
+                    });
+                }
+                for (auto& worker : workers) {
+                    worker.join();
+                }
+                selling = false;
+                for (auto& reader : readers) {
+                    reader.join();
+                }
+
+                vector<double> all;
+                for (const auto& perThread : latencies) {
+                    all.insert(all.end(), perThread.begin(), perThread.end());
+                }
+                BenchmarkResult result = BenchmarkResult::from(all.size(), "checkout", all, 1);
+                cout << left << setw(10) << phase << setw(12) << result.ops
+                     << fixed << setprecision(1) << setw(12) << result.p50Ns / 1000 << setw(12) << result.p99Ns / 1000
+                     << setw(12) << result.maxNs / 1000 << setw(10) << reports.load() << edits.load() << "\n";
+            }
+
+            // Nothing may be left waiting for readers that have gone
+            manager.epochs.collect();
+            if (manager.epochs.pending() != 0) {
+                problems.push_back(to_string(manager.epochs.pending()) + " retired versions were never freed");
+            }
+            size_t sealed = 0;
+            for (const auto& shard : manager.shards) {
+                sealed += shard.sealed;
+            }
+            if (sealed == 0) {
+                problems.push_back("the checkpoint sealed no sales");
+            }
+            vector<ReportTable> before;
+            for (SalesReport kind : kinds) {
+                before.push_back(manager.buildReport(kind, INT64_MIN, INT64_MAX, 0));
+            }
+            manager.shutdown();
+
+            BookshopManager reloaded(dataDirectory);
+            for (size_t i = 0; i < size(kinds); i++) {
+                if (reloaded.buildReport(kinds[i], INT64_MIN, INT64_MAX, 0).rows != before[i].rows) {
+                    problems.push_back(before[i].title + " differs after a reload");
+                }
+            }
+            reloaded.shutdown();
         }
-        
-        saveBooks();
-        cout << "\n✓ Book updated successfully!\n";
-        cout << "Press Enter to continue...";
-        cin.get();
+        removeScratchDirectory(dataDirectory);
+
+        cout << (problems.empty() ? "PASS" : "FAIL") << "\n";
+        for (const auto& problem : problems) {
+            cout << "  - " << problem << "\n";
+        }
+        return problems.empty();
     }
 
-    void deleteBook() {
-        clearScreen();
-        cout << "\n" << string(60, '=') << "\n";
-        cout << "                DELETE BOOK\n";
-        cout << string(60, '=') << "\n\n";
-        
-        string bookId = getValidatedString("Enter Book ID to delete: ");
-        
-        auto it = find_if(books.begin(), books.end(),
-                         [&bookId](const Book& book) { return book.id == bookId; });
-        
-        if (it == books.end()) {
-            cout << "\n✗ Book not found!\n";
-            cout << "Press Enter to continue...";
-            cin.get();
-            return;
+    // Fresh data directory under /tmp for self-tests; "" if none could be made
+    static string makeScratchDirectory(const char* name) {
+        string pattern = string("/tmp/") + name + "-XXXXXX";
+        vector<char> directory(pattern.begin(), pattern.end());
+        directory.push_back('\0');
+        if (!mkdtemp(directory.data())) {
+            cerr << "✗ Cannot create a temporary data directory\n";
+            return "";
         }
-        
-        cout << "\nBook Details:\n";
-        cout << "ID: " << it->id << "\n";
-        cout << "Title: " << it->title << "\n";
-        cout << "Author: " << it->author << "\n";
-        cout << "Price: $" << fixed << setprecision(2) << it->price << "\n";
-        
-        char confirm;
-        cout << "\nAre you sure you want to delete this book? (y/n): ";
-        cin >> confirm;
-        cin.ignore();
-        
-        if (confirm == 'y' || confirm == 'Y') {
-            books.erase(it);
-            saveBooks();
-            cout << "\n✓ Book deleted successfully!\n";
+        return string(directory.data()) + "/";
+    }
+
+    static void removeScratchDirectory(const string& dataDirectory) {
+        for (const char* name : {"books.txt", "sales.txt", "users.txt", "journal.txt", "journal.old",
+                                 "reorders.txt", "books.bin", "sales.bin"}) {
+            remove((dataDirectory + name).c_str());
+        }
+        for (size_t k = 0; k < SALES_SHARDS; k++) {
+            for (const char* suffix : {".txt", ".bin"}) {
+                remove((dataDirectory + "sales-" + to_string(k) + suffix).c_str());
+            }
+            // Segments follow on from each other, so each names the next
+            for (size_t first = 0;;) {
+                string path = dataDirectory + "sales-" + to_string(k) + "-" + to_string(first) + ".seg";
+                SegmentFile segment;
+                string error;
+                if (!segment.open(path, error) || segment.end() == first) {
+                    break;
+                }
+                first = segment.end();
+                remove(path.c_str());
+            }
+        }
+        rmdir(dataDirectory.c_str());
+    }
+
+    // Benchmark suite
+    // For each size, generates that many books and sales, then times
+    // loading and saving both snapshot formats, lookups, in-memory sales,
+    // durable checkouts, the sales report and search. Results go to a table
+    // on stdout and, if asked for, to a JSON file for tracking across
+    // releases.
+    static bool runBenchmarkSuite(const BenchmarkOptions& options) {
+        vector<BenchmarkResult> results;
+        // The table moves to stderr when the JSON goes to stdout
+        ostream& table = options.jsonPath == "-" ? cerr : cout;
+        table << left << setw(10) << "Records" << setw(14) << "Operation" << setw(10) << "Ops"
+             << setw(14) << "Items/s" << setw(12) << "p50 (µs)" << setw(12) << "p99 (µs)" << "max (µs)\n";
+        table << string(80, '-') << "\n";
+
+        auto timeNs = [](auto&& operation) {
+            auto start = chrono::steady_clock::now();
+            operation();
+            return chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        };
+        auto report = [&results, &table](BenchmarkResult result) {
+            table << left << setw(10) << result.records << setw(14) << result.operation << setw(10) << result.ops
+                 << setw(14) << fixed << setprecision(0) << result.itemsPerSecond() << setprecision(2)
+                 << setw(12) << result.p50Ns / 1000 << setw(12) << result.p99Ns / 1000 << result.maxNs / 1000
+                 << "\n";
+            results.push_back(result);
+        };
+
+        for (size_t records : options.sizes) {
+            string dataDirectory = makeScratchDirectory("bookshop-bench");
+            if (dataDirectory.empty()) {
+                return false;
+            }
+            SyntheticData data(records, options.skew, options.seed);
+            size_t items = 2 * records;
+            // The generated sales are all from before this month; they are
+            // kept in memory here and sealed only for the tiered timings
+            {
+                BookshopManager manager(dataDirectory, false, 0);
+                data.generateBooks(manager.books);
+                SalesHistory generated;
+                data.generateSales(manager.books, records, generated);
+                manager.rebuildBookIndexes();
+                manager.adoptSales(generated);
+
+                vector<double> saveText, saveBinary;
+                for (int r = 0; r < options.repeat; r++) {
+                    saveText.push_back(timeNs([&] {
+                        manager.saveBooksText(manager.books);
+                        manager.saveSales(allShards(), manager.shardSizes(), false);
+                    }));
+                }
+                for (int r = 0; r < options.repeat; r++) {
+                    saveBinary.push_back(timeNs([&] {
+                        manager.saveBooks(manager.books, true);
+                        manager.saveSales(allShards(), manager.shardSizes(), true);
+                    }));
+                }
+                report(BenchmarkResult::from(records, "save-text", saveText, items));
+                report(BenchmarkResult::from(records, "save-binary", saveBinary, items));
+            }
+
+            vector<double> loadBinary, loadText;
+            for (int r = 0; r < options.repeat; r++) {
+                loadBinary.push_back(timeNs([&] { BookshopManager loaded(dataDirectory, false, 0); }));
+            }
+            remove((dataDirectory + "books.bin").c_str());
+            for (size_t k = 0; k < SALES_SHARDS; k++) {
+                remove((dataDirectory + "sales-" + to_string(k) + ".bin").c_str());
+            }
+            for (int r = 0; r < options.repeat; r++) {
+                loadText.push_back(timeNs([&] { BookshopManager loaded(dataDirectory, false, 0); }));
+            }
+            report(BenchmarkResult::from(records, "load-text", loadText, items));
+            report(BenchmarkResult::from(records, "load-binary", loadBinary, items));
+
+            {
+                BookshopManager manager(dataDirectory, false, 0);
+                long checksum = 0;
+
+                vector<string> ids = data.workloadIds(200000);
+                vector<double> lookups;
+                lookups.reserve(ids.size());
+                for (const auto& id : ids) {
+                    lookups.push_back(timeNs([&] { checksum += manager.findBook(id) - manager.books.begin(); }));
+                }
+                report(BenchmarkResult::from(records, "lookup", lookups, 1));
+
+                vector<string> queries = data.workloadQueries(2000);
+                vector<double> searches;
+                for (const auto& query : queries) {
+                    searches.push_back(timeNs([&] {
+                        shared_lock<shared_mutex> catalogue(manager.catalogueMutex);
+                        checksum += manager.searchIndex.search(query, 20).size();
+                    }));
+                }
+                report(BenchmarkResult::from(records, "search", searches, 1));
+
+                vector<double> saleTimes;
+                string error;
+                for (size_t i = 0; i < 20000; i++) {
+                    Sale sale;
+                    saleTimes.push_back(timeNs([&] {
+                        checksum += manager.applySale(ids[i], 1, "Bench Customer", sale, error);
+                    }));
+                }
+                manager.commitJournal();
+                // Let the checkpoint this sets off finish before timing checkouts
+                manager.saveData();
+                report(BenchmarkResult::from(records, "sale", saleTimes, 1));
+
+                vector<double> checkouts;
+                for (size_t i = 0; i < 200; i++) {
+                    Sale sale;
+                    checkouts.push_back(timeNs([&] {
+                        checksum += manager.checkout(ids[ids.size() - 1 - i], 1, "Bench Customer", sale, error);
+                    }));
+                }
+                report(BenchmarkResult::from(records, "checkout", checkouts, 1));
+
+                vector<double> reports;
+                for (int r = 0; r < max(options.repeat, 5); r++) {
+                    reports.push_back(timeNs([&] {
+                        SalesSummary summary = manager.summarizeSales();
+                        checksum += (long)summary.totals.revenue.cents() + (long)manager.topSellers(10).size();
+                    }));
+                }
+                report(BenchmarkResult::from(records, "report", reports, manager.totalSales));
+
+                vector<double> analytics;
+                const SalesReport kinds[] = {SalesReport::TopBooks, SalesReport::Categories, SalesReport::Customers,
+                                             SalesReport::Daily, SalesReport::Monthly};
+                for (int r = 0; r < max(options.repeat, 5); r++) {
+                    for (SalesReport kind : kinds) {
+                        analytics.push_back(timeNs([&] {
+                            checksum += (long)manager.buildReport(kind, INT64_MIN, INT64_MAX, 0).rows.size();
+                        }));
+                    }
+                }
+                report(BenchmarkResult::from(records, "analytics", analytics, manager.totalSales));
+                benchmarkSink += checksum;
+            }
+
+            // The first load with the default hot window seals the history
+            // into segments; later ones only map them, and reports decode
+            // them
+            vector<double> sealing, loadTiered, reportTiered;
+            sealing.push_back(timeNs([&] { BookshopManager sealed(dataDirectory); }));
+            for (int r = 0; r < options.repeat; r++) {
+                loadTiered.push_back(timeNs([&] { BookshopManager loaded(dataDirectory); }));
+            }
+            report(BenchmarkResult::from(records, "seal", sealing, records));
+            report(BenchmarkResult::from(records, "load-tiered", loadTiered, items));
+            {
+                BookshopManager manager(dataDirectory);
+                const SalesReport kinds[] = {SalesReport::TopBooks, SalesReport::Categories, SalesReport::Customers,
+                                             SalesReport::Daily, SalesReport::Monthly};
+                long checksum = 0;
+                for (int r = 0; r < max(options.repeat, 5); r++) {
+                    for (SalesReport kind : kinds) {
+                        reportTiered.push_back(timeNs([&] {
+                            checksum += (long)manager.buildReport(kind, INT64_MIN, INT64_MAX, 0).rows.size();
+                        }));
+                    }
+                }
+                report(BenchmarkResult::from(records, "report-tiered", reportTiered, manager.totalSales));
+                benchmarkSink += checksum;
+            }
+            removeScratchDirectory(dataDirectory);
+        }
+
+        if (options.jsonPath.empty()) {
+            return true;
+        }
+        stringstream json;
+        json << "{\n  \"benchmark\": \"bookshop\",\n  \"format\": 1,\n"
+             << "  \"seed\": " << options.seed << ",\n  \"skew\": " << options.skew << ",\n"
+             << "  \"kernels\": \""
+             #ifdef BOOKSHOP_X86_KERNELS
+                 << (cpuHasAvx2() ? "avx2" : "scalar")
+             #else
+                 << "scalar"
+             #endif
+             << "\",\n  \"results\": [\n";
+        json << fixed << setprecision(1);
+        for (size_t i = 0; i < results.size(); i++) {
+            const BenchmarkResult& r = results[i];
+            json << "    {\"records\": " << r.records << ", \"operation\": \"" << r.operation
+                 << "\", \"ops\": " << r.ops << ", \"items\": " << r.items << ", \"seconds\": "
+                 << setprecision(6) << r.seconds << setprecision(1)
+                 << ", \"items_per_second\": " << r.itemsPerSecond() << ", \"p50_ns\": " << r.p50Ns
+                 << ", \"p90_ns\": " << r.p90Ns << ", \"p99_ns\": " << r.p99Ns << ", \"max_ns\": " << r.maxNs
+                 << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        json << "  ]\n}\n";
+        if (options.jsonPath == "-") {
+            cout << json.str();
+            return true;
+        }
+        ofstream file(options.jsonPath);
+        file << json.str();
+        if (!file.good()) {
+            cerr << "✗ Cannot write " << options.jsonPath << "\n";
+            return false;
+        }
+        cout << "✓ Wrote results to " << options.jsonPath << "\n";
+        return true;
+    }
+
+    // Build an analytics report over the sales made in [from, to), hot and
+    // sealed, from a snapshot. top limits the ranked reports, 0 keeps
+    // every row.
+    ReportTable buildReport(SalesReport kind, int64_t from, int64_t to, size_t top) {
+        Snapshot view(*this);
+        return buildReport(view, kind, from, to, top);
+    }
+
+    static ReportTable buildReport(const Snapshot& view, SalesReport kind, int64_t from, int64_t to, size_t top) {
+        METRIC_TIME(Report);
+        bool series = kind == SalesReport::Daily || kind == SalesReport::Monthly;
+        CalendarBuckets calendar(kind == SalesReport::Monthly);
+        map<int64_t, GroupTotal> periods;
+        vector<GroupTotal> totals;
+        vector<string> names;       // by group: book ID, category or customer
+        vector<string> details;     // by group: book title, or books sold in a category
+        {
+            // Each run is grouped in turn and the partial totals merged by
+            // book id or customer name. Sealed runs outside the range are
+            // never decoded.
+            vector<GroupTotal> byBook;
+            vector<PooledString> bookIds;
+            unordered_map<PooledString, size_t> bookGroup;
+            unordered_map<PooledString, size_t> customerGroup;
+            view.forEachPart(from, to, [&](const SalesColumns::View& columns) {
+                if (series) {
+                    for (const auto& period : columns.bucketTotals(from, to, calendar)) {
+                        periods[period.first].merge(period.second);
+                    }
+                } else if (kind == SalesReport::Customers) {
+                    vector<GroupTotal> part = columns.groupTotals(from, to, columns.customerCount(),
+                                                                  [&columns](uint32_t row) { return columns.customerCodeOf(row); });
+                    for (uint32_t code = 0; code < part.size(); code++) {
+                        if (part[code].orders == 0) {
+                            continue;
+                        }
+                        auto group = customerGroup.emplace(columns.customerName(code), totals.size());
+                        if (group.second) {
+                            totals.emplace_back();
+                            names.push_back(columns.customerName(code).str());
+                        }
+                        totals[group.first->second].merge(part[code]);
+                    }
+                } else {
+                    vector<GroupTotal> part = columns.groupTotals(from, to, columns.bookCount(),
+                                                                  [&columns](uint32_t row) { return columns.bookCodeOf(row); });
+                    for (uint32_t code = 0; code < part.size(); code++) {
+                        if (part[code].orders == 0) {
+                            continue;
+                        }
+                        auto group = bookGroup.emplace(columns.bookId(code), byBook.size());
+                        if (group.second) {
+                            byBook.emplace_back();
+                            bookIds.push_back(columns.bookId(code));
+                        }
+                        byBook[group.first->second].merge(part[code]);
+                    }
+                }
+            });
+            if (kind == SalesReport::TopBooks) {
+                totals = move(byBook);
+                for (const auto& id : bookIds) {
+                    names.push_back(id.str());
+                    const Book* book = view.findBook(id);
+                    details.push_back(book ? book->title.str() : "(deleted)");
+                }
+            } else if (kind == SalesReport::Categories) {
+                // Join the per-book totals with the catalogue and fold
+                // them into categories; far fewer rows than the sales
+                unordered_map<string, size_t> categoryGroup;
+                vector<size_t> booksSold;
+                for (size_t code = 0; code < byBook.size(); code++) {
+                    const Book* book = view.findBook(bookIds[code]);
+                    string category = book ? book->category.str() : "(deleted)";
+                    auto group = categoryGroup.emplace(category, totals.size());
+                    if (group.second) {
+                        totals.emplace_back();
+                        names.push_back(category);
+                        booksSold.push_back(0);
+                    }
+                    totals[group.first->second].merge(byBook[code]);
+                    booksSold[group.first->second]++;
+                }
+                for (size_t count : booksSold) {
+                    details.push_back(to_string(count));
+                }
+            }
+        }
+
+        ReportTable table;
+        if (series) {
+            table.title = kind == SalesReport::Daily ? "Daily Revenue" : "Monthly Revenue";
+            table.columns = {"Period", "Orders", "Units", "Revenue", "Avg Order", "Cumulative"};
+            Money cumulative;
+            for (const auto& period : periods) {
+                const GroupTotal& total = period.second;
+                cumulative += total.revenue;
+                table.rows.push_back({calendar.label(period.first), to_string(total.orders), to_string(total.units),
+                                      total.revenue.str(), (total.revenue / total.orders).str(),
+                                      cumulative.str()});
+            }
+            return table;
+        }
+
+        vector<uint32_t> ranked;
+        Money revenue;
+        for (uint32_t group = 0; group < totals.size(); group++) {
+            if (totals[group].orders > 0) {
+                ranked.push_back(group);
+                revenue += totals[group].revenue;
+            }
+        }
+        parallelSort(ranked, [&](uint32_t a, uint32_t b) {
+            if (totals[a].revenue != totals[b].revenue) {
+                return totals[a].revenue > totals[b].revenue;
+            }
+            return names[a] < names[b];
+        });
+        if (top > 0 && ranked.size() > top) {
+            ranked.resize(top);
+        }
+        auto share = [revenue](Money part) {
+            char text[16];
+            snprintf(text, sizeof(text), "%.1f%%", revenue > Money() ? part.cents() * 100.0 / revenue.cents() : 0.0);
+            return string(text);
+        };
+
+        if (kind == SalesReport::TopBooks) {
+            table.title = "Top Books by Revenue";
+            table.columns = {"Rank", "ID", "Title", "Units", "Orders", "Revenue", "Share"};
+        } else if (kind == SalesReport::Categories) {
+            table.title = "Revenue by Category";
+            table.columns = {"Category", "Books", "Units", "Orders", "Revenue", "Share"};
         } else {
-            cout << "\n✗ Deletion cancelled!\n";
+            table.title = "Customer Lifetime Value";
+            table.columns = {"Rank", "Customer", "Orders", "Units", "Revenue", "Avg Order", "First", "Last"};
         }
-        
-        cout << "Press Enter to continue...";
-        cin.get();
+        for (size_t i = 0; i < ranked.size(); i++) {
+            const GroupTotal& total = totals[ranked[i]];
+            const string& name = names[ranked[i]];
+            if (kind == SalesReport::TopBooks) {
+                table.rows.push_back({to_string(i + 1), name, details[ranked[i]], to_string(total.units),
+                                      to_string(total.orders), total.revenue.str(), share(total.revenue)});
+            } else if (kind == SalesReport::Categories) {
+                table.rows.push_back({name, details[ranked[i]], to_string(total.units), to_string(total.orders),
+                                      total.revenue.str(), share(total.revenue)});
+            } else {
+                table.rows.push_back({to_string(i + 1), name, to_string(total.orders), to_string(total.units),
+                                      total.revenue.str(), (total.revenue / total.orders).str(),
+                                      dayKey(total.first), dayKey(total.last)});
+            }
+        }
+        return table;
+    }
+
+    // Print the first maxRows rows of a report, each column as wide as its
+    // widest cell up to 30 characters
+    static void printReport(const ReportTable& table, size_t maxRows) {
+        const size_t MAX_WIDTH = 30;
+        size_t shown = min(maxRows, table.rows.size());
+        vector<size_t> widths;
+        for (const auto& column : table.columns) {
+            widths.push_back(column.size());
+        }
+        for (size_t r = 0; r < shown; r++) {
+            for (size_t c = 0; c < widths.size(); c++) {
+                widths[c] = min(MAX_WIDTH, max(widths[c], table.rows[r][c].size()));
+            }
+        }
+        auto printRow = [&widths](const vector<string>& cells) {
+            for (size_t c = 0; c < cells.size(); c++) {
+                cout << left << setw(widths[c] + 2) << cells[c].substr(0, widths[c]);
+            }
+            cout << "\n";
+        };
+        cout << "\n" << table.title << "\n";
+        printRow(table.columns);
+        cout << string(80, '-') << "\n";
+        for (size_t r = 0; r < shown; r++) {
+            printRow(table.rows[r]);
+        }
+        if (table.rows.empty()) {
+            cout << "No sales in this range.\n";
+        } else if (shown < table.rows.size()) {
+            cout << "... " << table.rows.size() - shown << " more row(s); export to CSV to see them all\n";
+        }
+    }
+
+    static bool writeReportCsv(const ReportTable& table, const string& path) {
+        if (path == "-") {
+            cout << table.csv();
+            return true;
+        }
+        AtomicFile file(path);
+        file.write(table.csv());
+        return file.commit();
     }
 
-    // Sales management functions
-    void makeSale() {
+    // Sales analytics
+    void viewAnalytics() {
+        awaitData();
         clearScreen();
-        cout << "\n" << string(60, '=') << "\n";
-        cout << "                MAKE SALE\n";
-        cout << string(60, '=') << "\n\n";
-        
-        string bookId = getValidatedString("Enter Book ID: ");
-        
-        auto it = find_if(books.begin(), books.end(),
-                         [&bookId](const Book& book) { return book.id == bookId; });
-        
-        if (it == books.end()) {
-            cout << "\n✗ Book not found!\n";
-            cout << "Press Enter to continue...";
-            cin.get();
+        cout << "\n" << string(80, '=') << "\n";
+        cout << "                    SALES ANALYTICS\n";
+        cout << string(80, '=') << "\n";
+        cout << "1. Top Books by Revenue\n";
+        cout << "2. Revenue by Category\n";
+        cout << "3. Customer Lifetime Value\n";
+        cout << "4. Daily Revenue\n";
+        cout << "5. Monthly Revenue\n";
+        cout << "6. Back\n";
+        int choice = getValidatedInt("Choose a report (1-6): ", 1, 6);
+        if (choice == 6) {
             return;
         }
-        
-        cout << "\nBook Details:\n";
-        cout << "Title: " << it->title << "\n";
-        cout << "Author: " << it->author << "\n";
-        cout << "Price: $" << fixed << setprecision(2) << it->price << "\n";
-        cout << "Available Quantity: " << it->quantity << "\n\n";
-        
-        if (it->quantity == 0) {
-            cout << "✗ Book is out of stock!\n";
-            cout << "Press Enter to continue...";
-            cin.get();
+        SalesReport kind = (SalesReport)(choice - 1);
+
+        int64_t from = INT64_MIN, to = INT64_MAX;
+        string answer;
+        cout << "Limit to a date range? (y/n): ";
+        getline(cin, answer);
+        if ((answer == "y" || answer == "Y") && !promptDateRange(from, to)) {
             return;
         }
-        
-        int quantity = getValidatedInt("Enter quantity to sell: ", 1, it->quantity);
-        string customerName = getValidatedString("Enter customer name: ");
-        
-        Sale newSale;
-        newSale.saleId = "S" + to_string(sales.size() + 1);
-        newSale.bookId = bookId;
-        newSale.bookTitle = it->title;
-        newSale.quantity = quantity;
-        newSale.totalAmount = quantity * it->price;
-        newSale.date = getCurrentDateTime();
-        newSale.customerName = customerName;
-        
-        // Update book quantity
-        it->quantity -= quantity;
-        
-        sales.push_back(newSale);
-        saveBooks();
-        saveSales();
-        
-        cout << "\n" << string(40, '-') << "\n";
-        cout << "         SALES RECEIPT\n";
-        cout << string(40, '-') << "\n";
-        cout << "Sale ID: " << newSale.saleId << "\n";
-        cout << "Book: " << newSale.bookTitle << "\n";
-        cout << "Quantity: " << newSale.quantity << "\n";
-        cout << "Unit Price: $" << fixed << setprecision(2) << it->price << "\n";
-        cout << "Total Amount: $" << fixed << setprecision(2) << newSale.totalAmount << "\n";
-        cout << "Customer: " << newSale.customerName << "\n";
-        cout << "Date: " << newSale.date << "\n";
-        cout << string(40, '-') << "\n";
-        
-        cout << "\n✓ Sale completed successfully!\n";
+
+        auto start = chrono::steady_clock::now();
+        ReportTable table = buildReport(kind, from, to, 0);
+        double millis = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        printReport(table, 20);
+        cout << "\n" << table.rows.size() << " row(s) in " << fixed << setprecision(1) << millis << " ms\n";
+
+        if (!table.rows.empty()) {
+            string path;
+            cout << "Export to CSV file (blank to skip): ";
+            getline(cin, path);
+            if (!path.empty()) {
+                if (writeReportCsv(table, path)) {
+                    cout << "✓ Wrote " << table.rows.size() << " row(s) to " << path << "\n";
+                } else {
+                    cout << "\n✗ Could not write " << path << "!\n";
+                }
+            }
+        }
         cout << "Press Enter to continue...";
         cin.get();
     }
 
-    void viewSales() {
+    // Runtime metrics
+    void viewMetrics() {
         clearScreen();
         cout << "\n" << string(80, '=') << "\n";
-        cout << "                    SALES HISTORY\n";
+        cout << "                    RUNTIME METRICS\n";
         cout << string(80, '=') << "\n";
-        
-        if (sales.empty()) {
-            cout << "\nNo sales records found.\n";
+        if (!Metrics::enabled()) {
+            cout << "\nMetrics were compiled out of this build (BOOKSHOP_NO_METRICS).\n";
             cout << "Press Enter to continue...";
             cin.get();
             return;
         }
-        
-        cout << left << setw(8) << "Sale ID" << setw(8) << "Book ID" << setw(25) << "Book Title"
-             << setw(5) << "Qty" << setw(10) << "Amount" << setw(15) << "Customer"
-             << "Date\n";
-        cout << string(80, '-') << "\n";
-        
-        double totalSales = 0;
-        for (const auto& sale : sales) {
-            cout << left << setw(8) << sale.saleId << setw(8) << sale.bookId
-                 << setw(25) << sale.bookTitle.substr(0, 24) << setw(5) << sale.quantity
-                 << setw(10) << fixed << setprecision(2) << sale.totalAmount
-                 << setw(15) << sale.customerName.substr(0, 14) << sale.date << "\n";
-            totalSales += sale.totalAmount;
+
+        Metrics::Totals all = Metrics::shared().totals();
+        cout << "\n";
+        for (size_t c = 0; c < Metrics::COUNTERS; c++) {
+            cout << left << setw(32) << Metrics::counterName(c) << all.counters[c] << "\n";
         }
-        
+
+        cout << "\n" << left << setw(24) << "Timer" << setw(12) << "Count" << setw(14) << "Mean (µs)"
+             << setw(14) << "p50 (µs)" << "p99 (µs)\n";
         cout << string(80, '-') << "\n";
-        cout << "Total Sales: $" << fixed << setprecision(2) << totalSales << "\n";
-        cout << "Total Transactions: " << sales.size() << "\n";
+        for (size_t t = 0; t < Metrics::TIMERS; t++) {
+            uint64_t count = 0;
+            for (uint64_t bucket : all.buckets[t]) {
+                count += bucket;
+            }
+            double mean = count ? all.sumNs[t] / 1000.0 / count : 0.0;
+            cout << left << setw(24) << Metrics::timerName(t) << setw(12) << count << fixed << setprecision(2)
+                 << setw(14) << mean << setw(14) << Metrics::percentileNs(all.buckets[t], 0.50) / 1000.0
+                 << Metrics::percentileNs(all.buckets[t], 0.99) / 1000.0 << "\n";
+        }
+        cout << "\nPercentiles are bucket upper bounds (powers of two).\n";
+        cout << "Written every " << METRICS_DUMP_INTERVAL.count() << " s to " << METRICS_FILE
+             << " in Prometheus text format.\n";
         cout << "Press Enter to continue...";
         cin.get();
     }
 
-    // Company information
-    void viewCompanyDetails() {
-        clearScreen();
-        cout << "\n" << string(60, '=') << "\n";
-        cout << "              COMPANY INFORMATION\n";
-        cout << string(60, '=') << "\n\n";
-        
-        cout << "Company Name: GENIUS BOOKS\n";
-        cout << "Established: 2020\n";
-        cout << "Address: 123 Main Street, City Center\n";
-        cout << "Phone: +1 (555) 123-4567\n";
-        cout << "Email: info@geniusbooks.com\n";
-        cout << "Website: www.geniusbooks.com\n\n";
-        
-        cout << "About Us:\n";
-        cout << "GENIUS BOOKS is a leading bookshop in the city, providing\n";
-        cout << "a wide variety of books across all genres. We pride ourselves\n";
-        cout << "on excellent customer service and competitive prices.\n\n";
-        
-        cout << "Our Mission:\n";
-        cout << "To promote reading culture and provide easy access to\n";
-        cout << "quality books for everyone in our community.\n\n";
-        
-        cout << "Current Statistics:\n";
-        cout << "Total Books in Stock: " << books.size() << "\n";
-        cout << "Total Sales Made: " << sales.size() << "\n";
-        cout << "System Users: " << users.size() << "\n";
-        
-        cout << "\nPress Enter to continue...";
-        cin.get();
+    // Low stock and reorder suggestions
+    void viewLowStock() {
+        awaitData();
+        while (true) {
+            clearScreen();
+            cout << "\n" << string(80, '=') << "\n";
+            cout << "                    LOW STOCK & REORDERS\n";
+            cout << string(80, '=') << "\n";
+            cout << "Alert when stock is at or below: " << stockWatcher.getThreshold()
+                 << "  |  Reorder up to: " << stockWatcher.getRestockLevel() << "\n";
+            cout << "Books low on stock: " << stockWatcher.lowCount()
+                 << "  |  Suggestions written to " << stockWatcher.file() << " this session: "
+                 << stockWatcher.suggestionCount() << "\n\n";
+
+            string page;
+            TableRow header;
+            header.text("ID", 8).text("Title", 30).text("Category", 15).text("Price", 10).text("Qty").appendTo(page);
+            page.append(80, '-');
+            page += '\n';
+            vector<pair<int, PooledString>> lowest = stockWatcher.lowest(PAGE_ROWS);
+            {
+                shared_lock<shared_mutex> catalogue(catalogueMutex);
+                for (const auto& entry : lowest) {
+                    auto it = findBook(entry.second);
+                    if (it == books.end()) {
+                        continue;
+                    }
+                    TableRow row;
+                    row.text(it->id, 8).text(it->title, 30).text(it->category, 15).money(it->price, 10)
+                       .integer(entry.first, 0).appendTo(page);
+                }
+            }
+            if (lowest.empty()) {
+                page += "No books are low on stock.\n";
+            }
+            cout << page;
+
+            cout << "\n1. Change alert threshold\n";
+            cout << "2. Write reorder list for all low books\n";
+            cout << "3. Back\n";
+            int choice = getValidatedInt("Enter your choice (1-3): ", 1, 3);
+            if (choice == 3) {
+                return;
+            }
+            if (choice == 1) {
+                int threshold = getValidatedInt("Alert when stock is at or below: ", 0);
+                int restockLevel = getValidatedInt("Suggest reordering up to: ", threshold + 1);
+                shared_lock<shared_mutex> catalogue(catalogueMutex);
+                stockWatcher.configure(threshold, restockLevel, booksAtOrBelow(threshold));
+                cout << "\n✓ Threshold updated!\n";
+            } else {
+                size_t written = stockWatcher.writeReorderList();
+                cout << "\n✓ Wrote " << written << " reorder suggestion(s) to " << stockWatcher.file() << "\n";
+            }
+            cout << "Press Enter to continue...";
+            cin.get();
+        }
     }
 
     // Main menu functions
@@ -603,6 +9431,9 @@ public:
         cout << "           GENIUS BOOKS MANAGEMENT SYSTEM\n";
         cout << string(60, '=') << "\n";
         
+        if (!dataLoaded) {
+            cout << "Loading books and sales in the background...\n";
+        }
         if (isLoggedIn) {
             cout << "Logged in as: " << currentUser << " (" << currentRole << ")\n";
             cout << string(60, '-') << "\n";
@@ -613,8 +9444,12 @@ public:
             cout << "5. Make Sale\n";
             cout << "6. View Sales History\n";
             cout << "7. View Company Details\n";
-            cout << "8. Logout\n";
-            cout << "9. Exit\n";
+            cout << "8. Search Books\n";
+            cout << "9. Low Stock & Reorders\n";
+            cout << "10. Sales Analytics\n";
+            cout << "11. Runtime Metrics\n";
+            cout << "12. Logout\n";
+            cout << "13. Exit\n";
         } else {
             cout << "Please login to access the system\n";
             cout << string(60, '-') << "\n";
@@ -627,29 +9462,17 @@ public:
     }
 
     void run() {
-        cout << "\n" << string(60, '=') << "\n";
-        cout << "     WELCOME TO GENIUS BOOKS MANAGEMENT SYSTEM\n";
-        cout << string(60, '=') << "\n";
-        cout << "Loading system... Please wait.\n";
-        
-        // Simulate loading
-        for (int i = 0; i < 3; i++) {
-            cout << ".";
-            cout.flush();
-            // Small delay simulation
-            for (int j = 0; j < 100000000; j++);
-        }
-        
-        cout << "\n✓ System loaded successfully!\n";
-        cout << "Press Enter to continue...";
-        cin.get();
-        
+        bool firstPrompt = true;
         while (true) {
             displayMainMenu();
+            if (firstPrompt) {
+                METRIC_OBSERVE(Startup, nanosecondsSinceLaunch());
+                firstPrompt = false;
+            }
             
             int choice;
             if (isLoggedIn) {
-                choice = getValidatedInt("Enter your choice (1-9): ", 1, 9);
+                choice = getValidatedInt("Enter your choice (1-13): ", 1, 13);
             } else {
                 choice = getValidatedInt("Enter your choice (1-3): ", 1, 3);
             }
@@ -696,11 +9519,30 @@ public:
                         viewCompanyDetails();
                         break;
                     case 8:
-                        logout();
+                        searchBooks();
                         break;
                     case 9:
+                        if (currentRole == "admin" || currentRole == "manager") {
+                            viewLowStock();
+                        } else {
+                            cout << "\n✗ Access denied! Only admin and manager can manage reorders.\n";
+                            cout << "Press Enter to continue...";
+                            cin.get();
+                        }
+                        break;
+                    case 10:
+                        viewAnalytics();
+                        break;
+                    case 11:
+                        viewMetrics();
+                        break;
+                    case 12:
+                        logout();
+                        break;
+                    case 13:
                         cout << "\n✓ Thank you for using GENIUS BOOKS Management System!\n";
                         saveData();
+                        shutdown();
                         exit(0);
                         break;
                 }
@@ -715,6 +9557,7 @@ public:
                     case 3:
                         cout << "\n✓ Thank you for using GENIUS BOOKS Management System!\n";
                         saveData();
+                        shutdown();
                         exit(0);
                         break;
                 }
@@ -723,8 +9566,716 @@ public:
     }
 };
 
-int main() {
-    BookshopManager system;
+// Lookup benchmark: average BookIndex::find latency as the catalogue grows
+void runLookupBenchmark(size_t maxBooks) {
+    const size_t LOOKUPS = 1000000;
+    mt19937_64 rng(42);
+
+    cout << left << setw(12) << "Books" << setw(16) << "Index (ns/op)"
+         << "Linear scan (ns/op)\n";
+    cout << string(50, '-') << "\n";
+
+    for (size_t n = 1000; n <= maxBooks; n *= 10) {
+        vector<Book> books(n);
+        for (size_t i = 0; i < n; i++) {
+            books[i].id = "B" + to_string(i);
+            books[i].price = Money::fromCents(100);
+            books[i].quantity = 1;
+        }
+        BookIndex index;
+        index.rebuild(books);
+
+        vector<string> keys(LOOKUPS);
+        for (auto& key : keys) {
+            key = "B" + to_string(rng() % n);
+        }
+
+        long checksum = 0;
+        auto start = chrono::steady_clock::now();
+        for (const auto& key : keys) {
+            checksum += index.find(key, books);
+        }
+        double indexNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / LOOKUPS;
+
+        // The old find_if scan, sampled less since it is O(n)
+        size_t linearLookups = max<size_t>(10, 10000000 / n);
+        linearLookups = min(linearLookups, LOOKUPS);
+        start = chrono::steady_clock::now();
+        for (size_t i = 0; i < linearLookups; i++) {
+            const string& key = keys[i];
+            auto it = find_if(books.begin(), books.end(),
+                             [&key](const Book& book) { return book.id == key; });
+            checksum += it - books.begin();
+        }
+        double linearNs = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count() / linearLookups;
+
+        benchmarkSink = checksum;
+        cout << left << setw(12) << n << setw(16) << fixed << setprecision(1) << indexNs
+             << linearNs << "\n";
+    }
+}
+
+// Aggregation benchmark: SalesColumns kernels over a synthetic history
+void runAggregateBenchmark(size_t salesCount) {
+    mt19937_64 rng(7);
+    EpochReclaimer epochs;
+    SalesColumns columns;
+    Sale sale;
+    sale.bookId = "B1";
+    sale.customerName = "Customer";
+    sale.date = 1700000000;
+    for (size_t i = 0; i < salesCount; i++) {
+        sale.bookId = "B" + to_string(rng() % 1000);
+        sale.quantity = 1 + (int)(rng() % 5);
+        sale.totalAmount = sale.quantity * Money::fromCents(100 + rng() % 5000);
+        sale.date += rng() % 60;
+        columns.append(sale, epochs);
+    }
+
+    auto start = chrono::steady_clock::now();
+    SalesColumns::View view = columns.view();
+    SalesTotals totals = view.totals();
+    double totalsMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    vector<int64_t> revenue;
+    vector<int64_t> units;
+    start = chrono::steady_clock::now();
+    view.revenueByBook(revenue, units);
+    double groupMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    cout << "Sales: " << salesCount << "\n";
+    cout << "Revenue: $" << totals.revenue
+         << " (sum/count/min/max in " << setprecision(3) << totalsMs << " ms)\n";
+    cout << "Revenue by book: " << revenue.size() << " groups in " << groupMs << " ms\n";
+    #ifdef BOOKSHOP_X86_KERNELS
+        cout << "Kernels: " << (cpuHasAvx2() ? "AVX2" : "scalar") << "\n";
+    #else
+        cout << "Kernels: scalar\n";
+    #endif
+}
+
+#ifdef BOOKSHOP_NETWORK
+// Set from SIGINT or SIGTERM to stop the service; read by every event
+// loop, so an atomic rather than a sig_atomic_t (lock-free, so safe in a
+// signal handler)
+atomic<bool> stopRequested(false);
+
+// Listening or connected TCP socket on address:port, non-blocking
+int openSocket(const string& address, uint16_t port, bool listening) {
+    sockaddr_in endpoint{};
+    endpoint.sin_family = AF_INET;
+    endpoint.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &endpoint.sin_addr) != 1) {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    int on = 1;
+    bool ok;
+    if (listening) {
+        // Every event loop listens on the port itself and the kernel
+        // spreads new connections across them
+        ok = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0
+             && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0
+             && ::bind(fd, (sockaddr*)&endpoint, sizeof(endpoint)) == 0 && listen(fd, SOMAXCONN) == 0;
+    } else {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        ok = connect(fd, (sockaddr*)&endpoint, sizeof(endpoint)) == 0 || errno == EINPROGRESS;
+    }
+    if (!ok) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send as much of out as the socket takes; false if the peer is gone
+bool sendPending(int fd, string& out, size_t& sent) {
+    while (sent < out.size()) {
+        ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        sent += (size_t)n;
+    }
+    out.clear();
+    sent = 0;
+    return true;
+}
+
+// Line protocol front end shared by many terminals; see
+// BookshopManager::handleRequest() for the requests. Each event loop
+// thread runs its own epoll set and listening socket. Every request read
+// in one pass of a loop is answered into the connection's output buffer;
+// journal records the pass queued are then committed together (one fsync
+// for the pass, shared with other loops by group commit) before any of
+// the responses go out, so a client never sees a sale that is not on disk.
+// If the commit fails, the answers that queued records become errors.
+class PosServer {
+private:
+    struct Connection {
+        int fd;
+        string in;
+        string out;
+        size_t sent = 0;
+        bool writing = false;       // waiting for EPOLLOUT
+        bool closing = false;       // peer is done sending
+        // Where in out the answers that wait on this pass's commit are
+        vector<pair<size_t, size_t>> uncommitted;
+    };
+
+    BookshopManager& manager;
+    string address;
+    uint16_t port;
+
+    // Requests longer than this close the connection
+    static const size_t MAX_REQUEST = 64 * 1024;
+
+    void closeConnection(int epoll, unordered_map<int, Connection>& open, int fd) {
+        epoll_ctl(epoll, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        open.erase(fd);
+    }
+
+    // Replace the answers that waited on a failed journal commit
+    static void failUncommitted(Connection& connection) {
+        string out;
+        size_t copied = 0;
+        for (const auto& answer : connection.uncommitted) {
+            out.append(connection.out, copied, answer.first - copied);
+            out += "ERR|could not write to the journal\n";
+            copied = answer.second;
+        }
+        out.append(connection.out, copied, string::npos);
+        connection.out.swap(out);
+    }
+
+    // Read what the peer sent and answer every whole request line.
+    // Returns true if any answer queued journal records.
+    bool serve(Connection& connection) {
+        char buffer[16384];
+        while (true) {
+            ssize_t n = recv(connection.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                connection.in.append(buffer, (size_t)n);
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                connection.closing = true;
+            }
+            if (n == 0 || errno != EINTR) {
+                break;
+            }
+        }
+        bool journalled = false;
+        size_t start = 0;
+        for (size_t end; (end = connection.in.find('\n', start)) != string::npos; start = end + 1) {
+            string_view line(connection.in.data() + start, end - start);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            if (!line.empty()) {
+                size_t answer = connection.out.size();
+                if (manager.handleRequest(line, connection.out)) {
+                    connection.uncommitted.push_back({answer, connection.out.size()});
+                    journalled = true;
+                }
+            }
+        }
+        connection.in.erase(0, start);
+        if (connection.in.size() > MAX_REQUEST) {
+            connection.out += "ERR|request too long\n";
+            connection.in.clear();
+            connection.closing = true;
+        }
+        return journalled;
+    }
+
+    void eventLoop(int listener) {
+        int epoll = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event event{};
+        event.events = EPOLLIN;
+        event.data.fd = listener;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, listener, &event);
+
+        unordered_map<int, Connection> open;
+        vector<epoll_event> ready(256);
+        vector<int> answered;
+        while (!stopRequested) {
+            int count = epoll_wait(epoll, ready.data(), (int)ready.size(), 200);
+            bool journalled = false;
+            answered.clear();
+            for (int i = 0; i < count; i++) {
+                int fd = ready[i].data.fd;
+                if (fd == listener) {
+                    int client;
+                    while ((client = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                        int on = 1;
+                        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+                        event.events = EPOLLIN | EPOLLRDHUP;
+                        event.data.fd = client;
+                        epoll_ctl(epoll, EPOLL_CTL_ADD, client, &event);
+                        open[client].fd = client;
+                    }
+                    continue;
+                }
+                auto it = open.find(fd);
+                if (it == open.end()) {
+                    continue;
+                }
+                if (ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    journalled = serve(it->second) || journalled;
+                }
+                answered.push_back(fd);
+            }
+
+            bool committed = !journalled || manager.commitJournal();
+            for (int fd : answered) {
+                auto it = open.find(fd);
+                if (it == open.end()) {
+                    continue;
+                }
+                Connection& connection = it->second;
+                if (!committed && !connection.uncommitted.empty()) {
+                    failUncommitted(connection);
+                }
+                connection.uncommitted.clear();
+                if (!sendPending(fd, connection.out, connection.sent) || (connection.closing && connection.out.empty())) {
+                    closeConnection(epoll, open, fd);
+                    continue;
+                }
+                bool backlog = !connection.out.empty();
+                if (backlog != connection.writing) {
+                    connection.writing = backlog;
+                    event.events = backlog ? EPOLLIN | EPOLLRDHUP | EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+                    event.data.fd = fd;
+                    epoll_ctl(epoll, EPOLL_CTL_MOD, fd, &event);
+                }
+            }
+        }
+        while (!open.empty()) {
+            closeConnection(epoll, open, open.begin()->first);
+        }
+        ::close(listener);
+        ::close(epoll);
+    }
+
+public:
+    PosServer(BookshopManager& shared, const string& bindAddress, uint16_t listenPort)
+        : manager(shared), address(bindAddress), port(listenPort) {}
+
+    // Serve until SIGINT or SIGTERM
+    bool run(size_t threads) {
+        vector<int> listeners;
+        for (size_t t = 0; t < threads; t++) {
+            int listener = openSocket(address, port, true);
+            if (listener < 0) {
+                cerr << "✗ Cannot listen on " << address << ":" << port << ": " << strerror(errno) << "\n";
+                for (int fd : listeners) {
+                    ::close(fd);
+                }
+                return false;
+            }
+            listeners.push_back(listener);
+        }
+        signal(SIGINT, [](int) { stopRequested = true; });
+        signal(SIGTERM, [](int) { stopRequested = true; });
+        signal(SIGPIPE, SIG_IGN);
+        cout << "✓ Serving on " << address << ":" << port << " with " << threads
+             << " event loop(s); Ctrl+C to stop\n" << flush;
+
+        vector<thread> loops;
+        for (int listener : listeners) {
+            loops.emplace_back([this, listener] { eventLoop(listener); });
+        }
+        for (auto& loop : loops) {
+            loop.join();
+        }
+        cout << "\n✓ Stopped serving\n";
+        return true;
+    }
+};
+
+// What --loadgen sends and for how long
+struct LoadOptions {
+    string address = "127.0.0.1";
+    uint16_t port = 7070;
+    size_t connections = 200;
+    size_t depth = 4;               // requests in flight per connection
+    size_t threads = 4;
+    double seconds = 10.0;
+};
+
+// Drive a running --serve instance from many connections at once and
+// report throughput and latency. Each connection keeps depth requests in
+// flight: 70% LOOKUP, 14% SEARCH, 8% SELL and 8% RESTOCK of books taken
+// from the server's catalogue.
+bool runLoadGenerator(const LoadOptions& options) {
+    // Fetch the catalogue with one blocking request
+    vector<string> ids, words;
+    {
+        int fd = openSocket(options.address, options.port, false);
+        if (fd < 0) {
+            cerr << "✗ Cannot connect to " << options.address << ":" << options.port << "\n";
+            return false;
+        }
+        int flags = fcntl(fd, F_GETFL);
+        fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+        string request = "LIST|0|1000\n", reply;
+        char buffer[65536];
+        ssize_t n = send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+        size_t expected = SIZE_MAX;
+        while (n > 0) {
+            n = recv(fd, buffer, sizeof(buffer), 0);
+            reply.append(buffer, n > 0 ? (size_t)n : 0);
+            if (expected == SIZE_MAX && reply.find('\n') != string::npos) {
+                expected = strtoull(reply.c_str() + 3, nullptr, 10) + 1;
+            }
+            if ((size_t)count(reply.begin(), reply.end(), '\n') >= expected) {
+                break;
+            }
+        }
+        ::close(fd);
+        forEachLine(reply, true, [&](string_view line) {
+            string_view fields[6];
+            if (splitFields(line, fields, 6) == 6) {
+                ids.emplace_back(fields[0]);
+                words.emplace_back(fields[1].substr(0, fields[1].find(' ')));
+            }
+        });
+        if (ids.empty()) {
+            cerr << "✗ The server has no books to request\n";
+            return false;
+        }
+    }
+
+    struct Client {
+        int fd;
+        string in;
+        string out;
+        size_t sent = 0;
+        deque<pair<chrono::steady_clock::time_point, bool>> inFlight;    // when sent, multi-line reply
+        size_t bodyLines = 0;
+    };
+
+    atomic<uint64_t> errors(0);
+    vector<vector<double>> latencies(options.threads);
+    auto deadline = chrono::steady_clock::now() + chrono::duration<double>(options.seconds);
+    auto worker = [&](size_t t) {
+        mt19937_64 rng(t + 1);
+        int epoll = epoll_create1(EPOLL_CLOEXEC);
+        size_t mine = options.connections / options.threads + (t < options.connections % options.threads ? 1 : 0);
+        vector<Client> clients(mine);
+        auto enqueue = [&](Client& client) {
+            const string& id = ids[rng() % ids.size()];
+            unsigned pick = rng() % 100;
+            bool multiLine = false;
+            if (pick < 70) {
+                client.out += "LOOKUP|" + id + "\n";
+            } else if (pick < 84) {
+                client.out += "SEARCH|" + words[rng() % words.size()] + "|10\n";
+                multiLine = true;
+            } else if (pick < 92) {
+                client.out += "SELL|" + id + "|1|Load Generator\n";
+            } else {
+                client.out += "RESTOCK|" + id + "|1\n";
+            }
+            client.inFlight.emplace_back(chrono::steady_clock::now(), multiLine);
+        };
+        for (size_t c = 0; c < mine; c++) {
+            clients[c].fd = openSocket(options.address, options.port, false);
+            if (clients[c].fd < 0) {
+                errors++;
+                continue;
+            }
+            for (size_t d = 0; d < options.depth; d++) {
+                enqueue(clients[c]);
+            }
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLOUT;
+            event.data.u64 = c;
+            epoll_ctl(epoll, EPOLL_CTL_ADD, clients[c].fd, &event);
+        }
+
+        vector<epoll_event> ready(256);
+        size_t busy = mine;
+        while (busy > 0) {
+            bool sending = chrono::steady_clock::now() < deadline;
+            int count = epoll_wait(epoll, ready.data(), (int)ready.size(), 100);
+            for (int i = 0; i < count; i++) {
+                Client& client = clients[ready[i].data.u64];
+                if (client.fd < 0) {
+                    continue;
+                }
+                char buffer[65536];
+                ssize_t n;
+                while ((n = recv(client.fd, buffer, sizeof(buffer), 0)) > 0) {
+                    client.in.append(buffer, (size_t)n);
+                }
+                size_t start = 0;
+                for (size_t end; (end = client.in.find('\n', start)) != string::npos; start = end + 1) {
+                    if (client.bodyLines > 0) {
+                        client.bodyLines--;
+                    } else if (client.inFlight.empty()) {
+                        errors++;
+                        continue;
+                    } else {
+                        if (client.in.compare(start, 4, "ERR|") == 0) {
+                            errors++;
+                        } else if (client.inFlight.front().second) {
+                            client.bodyLines = strtoull(client.in.c_str() + start + 3, nullptr, 10);
+                        }
+                    }
+                    if (client.bodyLines == 0 && !client.inFlight.empty()) {
+                        latencies[t].push_back(chrono::duration<double, nano>(
+                            chrono::steady_clock::now() - client.inFlight.front().first).count());
+                        client.inFlight.pop_front();
+                        if (sending) {
+                            enqueue(client);
+                        }
+                    }
+                }
+                client.in.erase(0, start);
+                bool alive = (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) && sendPending(client.fd, client.out, client.sent);
+                if (!alive || client.inFlight.empty()) {
+                    if (!alive) {
+                        errors++;
+                    }
+                    ::close(client.fd);
+                    client.fd = -1;
+                    busy--;
+                    continue;
+                }
+                epoll_event event{};
+                event.events = client.out.empty() ? EPOLLIN : EPOLLIN | EPOLLOUT;
+                event.data.u64 = ready[i].data.u64;
+                epoll_ctl(epoll, EPOLL_CTL_MOD, client.fd, &event);
+            }
+        }
+        ::close(epoll);
+    };
+
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (size_t t = 0; t < options.threads; t++) {
+        threads.emplace_back(worker, t);
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    vector<double> all;
+    for (auto& perThread : latencies) {
+        all.insert(all.end(), perThread.begin(), perThread.end());
+    }
+    BenchmarkResult result = BenchmarkResult::from(0, "request", all, 1);
+    cout << "Connections: " << options.connections << " x " << options.depth << " in flight, "
+         << options.threads << " thread(s)\n";
+    cout << "Requests:    " << result.ops << " in " << fixed << setprecision(2) << seconds << " s ("
+         << setprecision(0) << result.ops / seconds << " requests/s)\n";
+    cout << "Latency:     p50 " << setprecision(1) << result.p50Ns / 1000 << " µs, p90 " << result.p90Ns / 1000
+         << " µs, p99 " << result.p99Ns / 1000 << " µs, max " << result.maxNs / 1000 << " µs\n";
+    cout << "Errors:      " << errors << " (refused requests and failed connections)\n";
+    return result.ops > 0;
+}
+#endif
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && string(argv[1]) == "--bench-lookup") {
+        size_t maxBooks = argc > 2 ? strtoull(argv[2], nullptr, 10) : 10000000;
+        runLookupBenchmark(maxBooks);
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--stress-checkout") {
+        // --stress-checkout [max threads] [sales per thread]
+        int maxThreads = argc > 2 ? max(1, atoi(argv[2])) : 8;
+        int salesPerThread = argc > 3 ? max(1, atoi(argv[3])) : 2000;
+        return BookshopManager::runCheckoutStressTest(maxThreads, salesPerThread) ? 0 : 1;
+    }
+    if (argc > 1 && string(argv[1]) == "--stress-snapshots") {
+        // --stress-snapshots [seller threads] [checkouts per seller]
+        int sellers = argc > 2 ? max(1, atoi(argv[2])) : 4;
+        int salesPerSeller = argc > 3 ? max(1, atoi(argv[3])) : 2000;
+        return BookshopManager::runSnapshotStressTest(sellers, salesPerSeller) ? 0 : 1;
+    }
+    if (argc > 1 && string(argv[1]) == "--bench") {
+        // --bench [--sizes n,n,...] [--skew s] [--seed n] [--repeat n] [--json file|-]
+        BenchmarkOptions options;
+        for (int i = 2; i + 1 < argc; i += 2) {
+            string option = argv[i];
+            string value = argv[i + 1];
+            if (option == "--sizes") {
+                options.sizes.clear();
+                stringstream list(value);
+                string size;
+                while (getline(list, size, ',')) {
+                    options.sizes.push_back(max<size_t>(1, strtoull(size.c_str(), nullptr, 10)));
+                }
+            } else if (option == "--skew") {
+                options.skew = max(0.0, atof(value.c_str()));
+            } else if (option == "--seed") {
+                options.seed = strtoull(value.c_str(), nullptr, 10);
+            } else if (option == "--repeat") {
+                options.repeat = max(1, atoi(value.c_str()));
+            } else if (option == "--json") {
+                options.jsonPath = value;
+            } else {
+                cerr << "✗ Unknown benchmark option " << option << "\n";
+                return 1;
+            }
+        }
+        return BookshopManager::runBenchmarkSuite(options) ? 0 : 1;
+    }
+    if (argc > 1 && string(argv[1]) == "--loadgen") {
+        // --loadgen [--address a] [--port n] [--connections n] [--depth n] [--threads n] [--seconds s]
+    #ifdef BOOKSHOP_NETWORK
+        LoadOptions options;
+        for (int i = 2; i + 1 < argc; i += 2) {
+            string option = argv[i];
+            string value = argv[i + 1];
+            if (option == "--address") {
+                options.address = value;
+            } else if (option == "--port") {
+                options.port = (uint16_t)atoi(value.c_str());
+            } else if (option == "--connections") {
+                options.connections = max<size_t>(1, strtoull(value.c_str(), nullptr, 10));
+            } else if (option == "--depth") {
+                options.depth = max<size_t>(1, strtoull(value.c_str(), nullptr, 10));
+            } else if (option == "--threads") {
+                options.threads = max<size_t>(1, strtoull(value.c_str(), nullptr, 10));
+            } else if (option == "--seconds") {
+                options.seconds = max(0.1, atof(value.c_str()));
+            } else {
+                cerr << "✗ Unknown load generator option " << option << "\n";
+                return 1;
+            }
+        }
+        options.threads = min(options.threads, options.connections);
+        return runLoadGenerator(options) ? 0 : 1;
+    #else
+        cerr << "✗ The load generator needs Linux (epoll)\n";
+        return 1;
+    #endif
+    }
+    if (argc > 1 && string(argv[1]) == "--bench-aggregate") {
+        size_t salesCount = argc > 2 ? strtoull(argv[2], nullptr, 10) : 100000000;
+        runAggregateBenchmark(salesCount);
+        return 0;
+    }
+
+    // The interactive shell comes up while books and sales are still loading
+    BookshopManager system("", argc == 1);
+    if (argc > 1 && string(argv[1]) == "--import-text") {
+        system.importText();
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--export-text") {
+        system.exportText();
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--memory-report") {
+        system.printMemoryReport();
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--metrics") {
+        // Prometheus text for the load just done
+        cout << Metrics::shared().prometheus();
+        return 0;
+    }
+    if (argc > 1 && string(argv[1]) == "--check-aggregates") {
+        return system.checkAggregates() ? 0 : 1;
+    }
+    if (argc > 2 && string(argv[1]) == "--report") {
+        // --report <top-books|categories|customers|daily|monthly> [--from D] [--to D] [--top n] [--csv file|-]
+        const map<string, SalesReport> kinds = {
+            {"top-books", SalesReport::TopBooks}, {"categories", SalesReport::Categories},
+            {"customers", SalesReport::Customers}, {"daily", SalesReport::Daily}, {"monthly", SalesReport::Monthly}};
+        auto kind = kinds.find(argv[2]);
+        if (kind == kinds.end()) {
+            cerr << "✗ Unknown report " << argv[2] << "\n";
+            return 1;
+        }
+        int64_t from = INT64_MIN, to = INT64_MAX;
+        size_t top = 20;
+        string csvPath;
+        for (int i = 3; i + 1 < argc; i += 2) {
+            string option = argv[i];
+            string value = argv[i + 1];
+            int64_t day;
+            if ((option == "--from" || option == "--to") && !parseDay(value, day)) {
+                cerr << "✗ Dates must look like 2026-10-17\n";
+                return 1;
+            }
+            if (option == "--from") {
+                from = day;
+            } else if (option == "--to") {
+                to = startOfDay(day, 1);
+            } else if (option == "--top") {
+                top = strtoull(value.c_str(), nullptr, 10);
+            } else if (option == "--csv") {
+                csvPath = value;
+            } else {
+                cerr << "✗ Unknown report option " << option << "\n";
+                return 1;
+            }
+        }
+        ReportTable table = system.buildReport(kind->second, from, to, top);
+        if (csvPath.empty()) {
+            BookshopManager::printReport(table, table.rows.size());
+            return 0;
+        }
+        return BookshopManager::writeReportCsv(table, csvPath) ? 0 : 1;
+    }
+    if (argc > 1 && string(argv[1]) == "--serve") {
+        // --serve [--address a] [--port n] [--threads n]
+    #ifdef BOOKSHOP_NETWORK
+        string address = "127.0.0.1";
+        uint16_t port = 7070;
+        size_t threads = max<size_t>(1, min<size_t>(4, thread::hardware_concurrency()));
+        for (int i = 2; i + 1 < argc; i += 2) {
+            string option = argv[i];
+            string value = argv[i + 1];
+            if (option == "--address") {
+                address = value;
+            } else if (option == "--port") {
+                port = (uint16_t)atoi(value.c_str());
+            } else if (option == "--threads") {
+                threads = max<size_t>(1, strtoull(value.c_str(), nullptr, 10));
+            } else {
+                cerr << "✗ Unknown service option " << option << "\n";
+                return 1;
+            }
+        }
+        system.startMetricsDump();
+        PosServer server(system, address, port);
+        bool served = server.run(threads);
+        system.saveData();
+        system.shutdown();
+        return served ? 0 : 1;
+    #else
+        cerr << "✗ --serve needs Linux (epoll)\n";
+        return 1;
+    #endif
+    }
+    if (argc > 2 && string(argv[1]) == "--batch") {
+        // --batch <file|-> [batch size]
+        system.startMetricsDump();
+        size_t batchSize = argc > 3 ? max<size_t>(1, strtoull(argv[3], nullptr, 10)) : 1000;
+        string source = argv[2];
+        if (source == "-") {
+            return system.runBatch(cin, batchSize) == 0 ? 0 : 1;
+        }
+        ifstream input(source);
+        if (!input.is_open()) {
+            cerr << "✗ Cannot open " << source << "\n";
+            return 1;
+        }
+        return system.runBatch(input, batchSize) == 0 ? 0 : 1;
+    }
+    system.startMetricsDump();
     system.run();
     return 0;
 }